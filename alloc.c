@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <libavutil/avutil.h>
+
+#include "alloc.h"
+#include "stats.h"
+
+typedef int64_t i64;
+
+/* Samples kept for the growth report; halved by decimation when full. */
+#define MAX_SAMPLES 4096
+
+/* Allocations made outside of any stage (setup, teardown) go here. */
+#define STAGE_OTHER NR_STAGES
+
+struct stage_allocs {
+	i64 allocs;
+	i64 frees;
+	i64 bytes;
+};
+
+struct alloc_sample {
+	int cue;
+	i64 live_count;
+	i64 live_bytes;
+	i64 rss_bytes;
+};
+
+static struct {
+	bool                counting;  /* Allocations are tracked, from before main() on. */
+	bool                enabled;   /* Samples are taken and reported. */
+	i64                 live_count;
+	i64                 live_bytes;
+	i64                 peak_bytes;
+	struct stage_allocs stages[NR_STAGES + 1];
+	struct alloc_sample samples[MAX_SAMPLES];
+	int                 nr_samples;
+	int                 sample_stride;
+	int                 sample_skipped;
+} accounting;
+
+static __thread int current_stage = STAGE_OTHER;
+
+static const char *stage_name(int stage)
+{
+	return stage == STAGE_OTHER ? "other" : stats_stage_name(stage);
+}
+
+/* A library must not replace the allocator of the program that loads it. */
+#if defined(__GLIBC__) && !defined(SPEECHFUL_LIBRARY)
+#include <malloc.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void  __libc_free(void *ptr);
+
+static void account_alloc(void *ptr)
+{
+	i64 size, live, peak;
+
+	if (!ptr)
+		return;
+
+	size = malloc_usable_size(ptr);
+	live = __atomic_add_fetch(&accounting.live_bytes, size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&accounting.live_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&accounting.stages[current_stage].allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&accounting.stages[current_stage].bytes, size, __ATOMIC_RELAXED);
+
+	peak = __atomic_load_n(&accounting.peak_bytes, __ATOMIC_RELAXED);
+	while (live > peak
+	       && !__atomic_compare_exchange_n(&accounting.peak_bytes, &peak, live, true,
+	                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void account_free(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	__atomic_sub_fetch(&accounting.live_bytes, (i64)malloc_usable_size(ptr), __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&accounting.live_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&accounting.stages[current_stage].frees, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	void *ptr = __libc_malloc(size);
+
+	if (accounting.counting)
+		account_alloc(ptr);
+	return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	void *ptr = __libc_calloc(nmemb, size);
+
+	if (accounting.counting)
+		account_alloc(ptr);
+	return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	void *new_ptr;
+
+	if (!accounting.counting)
+		return __libc_realloc(ptr, size);
+
+	account_free(ptr);
+	if (!(new_ptr = __libc_realloc(ptr, size)) && size) {
+		/* The old block is still alive. */
+		account_alloc(ptr);
+		return NULL;
+	}
+	account_alloc(new_ptr);
+
+	return new_ptr;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	void *ptr = __libc_memalign(alignment, size);
+
+	if (accounting.counting)
+		account_alloc(ptr);
+	return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+	return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (!alignment || alignment % sizeof(void *) || (alignment & (alignment - 1)))
+		return EINVAL;
+
+	if (!(ptr = memalign(alignment, size)))
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+void free(void *ptr)
+{
+	if (accounting.counting)
+		account_free(ptr);
+	__libc_free(ptr);
+}
+
+/*
+ * Counting from the first constructor on, rather than from alloc_accounting_init(),
+ * means the blocks freed later were counted when they were allocated. Only
+ * those of libc's own start-up are missed, and they live as long as the process.
+ * Without the variable every call goes straight to libc.
+ */
+__attribute__((constructor(101)))
+static void start_counting(void)
+{
+	accounting.counting = getenv(ALLOC_STATS_ENV) != NULL;
+}
+
+bool alloc_accounting_init(bool enabled)
+{
+	if (!accounting.counting)
+		return false;
+
+	accounting.enabled       = enabled;
+	accounting.sample_stride = 1;
+	return true;
+}
+#else
+bool alloc_accounting_init(bool enabled)
+{
+	(void)enabled;
+	return false;
+}
+#endif
+
+int alloc_enter_stage(int stage)
+{
+	int prev = current_stage;
+	current_stage = stage;
+	return prev;
+}
+
+void alloc_leave_stage(int prev_stage)
+{
+	current_stage = prev_stage;
+}
+
+static i64 rss_bytes(void)
+{
+	FILE *statm;
+	long pages = 0;
+
+	if (!(statm = fopen("/proc/self/statm", "r")))
+		return 0;
+
+	if (fscanf(statm, "%*d %ld", &pages) != 1)
+		pages = 0;
+	fclose(statm);
+
+	return (i64)pages * sysconf(_SC_PAGESIZE);
+}
+
+void alloc_sample(int cue)
+{
+	struct alloc_sample *s;
+	int i;
+
+	if (!accounting.enabled)
+		return;
+
+	if (++accounting.sample_skipped < accounting.sample_stride)
+		return;
+	accounting.sample_skipped = 0;
+
+	if (accounting.nr_samples == MAX_SAMPLES) {
+		for (i = 0; i < MAX_SAMPLES / 2; ++i)
+			accounting.samples[i] = accounting.samples[i * 2 + 1];
+		accounting.nr_samples     = MAX_SAMPLES / 2;
+		accounting.sample_stride *= 2;
+	}
+
+	s = &accounting.samples[accounting.nr_samples++];
+	s->cue        = cue;
+	s->live_count = alloc_live_count();
+	s->live_bytes = alloc_live_bytes();
+	s->rss_bytes  = rss_bytes();
+}
+
+i64 alloc_live_count(void)
+{
+	return __atomic_load_n(&accounting.live_count, __ATOMIC_RELAXED);
+}
+
+i64 alloc_live_bytes(void)
+{
+	return __atomic_load_n(&accounting.live_bytes, __ATOMIC_RELAXED);
+}
+
+void alloc_report_summary(FILE *out)
+{
+	int i;
+
+	fprintf(out, "Allocations: %" PRId64 " live (%" PRId64 " bytes), peak %" PRId64 " bytes, RSS %" PRId64 " bytes.\n",
+	        alloc_live_count(), alloc_live_bytes(), accounting.peak_bytes, rss_bytes());
+
+	fprintf(out, "%-10s %12s %12s %14s\n", "stage", "allocs", "frees", "bytes");
+	for (i = 0; i <= NR_STAGES; ++i) {
+		const struct stage_allocs *s = &accounting.stages[i];
+
+		fprintf(out, "%-10s %12" PRId64 " %12" PRId64 " %14" PRId64 "\n",
+		        stage_name(i), s->allocs, s->frees, s->bytes);
+	}
+}
+
+int alloc_report_json(const char *filepath)
+{
+	FILE *out;
+	int i;
+
+	if (strcmp(filepath, "-") == 0)
+		out = stdout;
+	else if (!(out = fopen(filepath, "w")))
+		return AVERROR(errno);
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"live_count\": %" PRId64 ",\n", alloc_live_count());
+	fprintf(out, "  \"live_bytes\": %" PRId64 ",\n", alloc_live_bytes());
+	fprintf(out, "  \"peak_bytes\": %" PRId64 ",\n", accounting.peak_bytes);
+	fprintf(out, "  \"rss_bytes\": %" PRId64 ",\n", rss_bytes());
+
+	fprintf(out, "  \"stages\": {\n");
+	for (i = 0; i <= NR_STAGES; ++i) {
+		const struct stage_allocs *s = &accounting.stages[i];
+
+		fprintf(out, "    \"%s\": {\"allocs\": %" PRId64 ", \"frees\": %" PRId64 ", \"bytes\": %" PRId64 "}%s\n",
+		        stage_name(i), s->allocs, s->frees, s->bytes, i < NR_STAGES ? "," : "");
+	}
+	fprintf(out, "  },\n");
+
+	/* One sample per line, [cue, live_count, live_bytes, rss_bytes], so scripts can grep them. */
+	fprintf(out, "  \"samples\": [\n");
+	for (i = 0; i < accounting.nr_samples; ++i) {
+		const struct alloc_sample *s = &accounting.samples[i];
+
+		fprintf(out, "    [%d, %" PRId64 ", %" PRId64 ", %" PRId64 "]%s\n",
+		        s->cue, s->live_count, s->live_bytes, s->rss_bytes,
+		        i + 1 < accounting.nr_samples ? "," : "");
+	}
+	fprintf(out, "  ]\n");
+	fprintf(out, "}\n");
+
+	if (out != stdout && fclose(out) == EOF)
+		return AVERROR(errno);
+
+	return 0;
+}
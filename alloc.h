@@ -0,0 +1,38 @@
+#ifndef SPEECHFUL_ALLOC_H
+#define SPEECHFUL_ALLOC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Allocation accounting. The process allocator is interposed (glibc only), so
+ * everything libav* allocates behind av_malloc() is counted as well, and each
+ * allocation is charged to the pipeline stage the calling thread is in.
+ * Counting has to start before main(), so the blocks freed later were all
+ * counted, and only does when ALLOC_STATS_ENV is set in the environment;
+ * otherwise every call goes straight to libc. malloc(), calloc(), realloc(),
+ * memalign(), aligned_alloc(), posix_memalign(), valloc() and pvalloc() are
+ * all covered.
+ *
+ * Returns false when interposition is not available on this platform, or
+ * counting was not started.
+ */
+#define ALLOC_STATS_ENV "SPEECHFUL_ALLOC_STATS"
+
+bool alloc_accounting_init(bool enabled);
+
+/* Stage bookkeeping, driven by `stats_stage_begin()` and `stats_stage_end()`. */
+int  alloc_enter_stage(int stage);
+void alloc_leave_stage(int prev_stage);
+
+/* Records the live allocations and the RSS after cue `cue` was processed. */
+void alloc_sample(int cue);
+
+int64_t alloc_live_count(void);
+int64_t alloc_live_bytes(void);
+
+void alloc_report_summary(FILE *out);
+int  alloc_report_json(const char *filepath);
+
+#endif
@@ -0,0 +1,824 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <math.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+#include <libavutil/avutil.h>
+
+#include "analysis.h"
+#include "pipeline.h"
+#include "stats.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Features are taken over 10 ms windows, short enough to follow syllables. */
+#define WINDOW_MS 10
+
+/* The noise floor follows quieter windows at once and louder ones at this pace. */
+#define FLOOR_RISE_DB_PER_S 0.5f
+/* Below this the floor stops following, or digital silence would make any hiss speech. */
+#define FLOOR_MIN_DB        -70.0f
+
+/* Fricatives are quiet but cross zero often; they keep speech going, never start it. */
+#define FRICATIVE_ZCR 0.25f
+
+/* Edge refinement slides its window by a quarter of it. */
+#define REFINE_STEPS_PER_WINDOW 4
+/* Nearby edges are searched with one decode, up to this much audio at once. */
+#define MAX_SPAN_MS 30000
+
+/*
+ * Decodes the input to mono float at the decoder's own rate, which is all
+ * the detectors need to look at.
+ */
+struct mono_decoder {
+	struct AVFormatContext *fmt_ctx;
+	struct AVStream        *st;
+	struct AVCodecContext  *dec;
+	struct resampler       *to_mono;
+	struct AVPacket        *pkt;
+	struct AVFrame         *frame;
+};
+
+/* Receives `n` mono samples, the first of which is sample `pos` of the stream. */
+typedef int (*mono_fn)(void *opaque, const float *x, int n, i64 pos);
+
+static int mono_decoder_open(struct mono_decoder *md, struct AVFormatContext *fmt_ctx,
+                             struct AVStream *st, struct AVCodecContext *dec)
+{
+	struct audio_encoder_settings mono = {
+		.channels    = 1,
+		.sample_rate = dec->sample_rate,
+		.sample_fmt  = AV_SAMPLE_FMT_FLT,
+	};
+	int ret;
+
+	memset(md, 0, sizeof(struct mono_decoder));
+	md->fmt_ctx = fmt_ctx;
+	md->st      = st;
+	md->dec     = dec;
+
+	if ((ret = resampler_open(&md->to_mono, &mono, dec)) < 0)
+		return ret;
+
+	if (!(md->pkt = av_packet_alloc()) || !(md->frame = av_frame_alloc()))
+		return AVERROR(ENOMEM);
+
+	return 0;
+}
+
+static void mono_decoder_close(struct mono_decoder *md)
+{
+	resampler_free(&md->to_mono);
+	av_packet_free(&md->pkt);
+	av_frame_free(&md->frame);
+}
+
+static int mono_decoder_frame(struct mono_decoder *md, mono_fn fn, void *opaque)
+{
+	struct AVFrame *frame = md->frame;
+	u8 **mono;
+	i64 pos;
+	int samples, ret;
+
+	pos = frame->pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE
+	      : tb2samples(md->st->time_base, md->dec->sample_rate, frame->pts);
+
+	ret = samples = resample(md->to_mono, &mono, (const u8 *const *)frame->extended_data,
+	                         frame->nb_samples, 1, AV_SAMPLE_FMT_FLT);
+	av_frame_unref(frame);
+	if (ret < 0)
+		return ret;
+
+	if (samples)
+		ret = fn(opaque, (const float *)mono[0], samples, pos);
+
+	av_freep(mono);
+	av_freep(&mono);
+
+	return ret;
+}
+
+/*
+ * Decodes the stream from the current read position until a packet starts at
+ * or after sample `until`, or to the end. The decoder is flushed afterwards.
+ */
+static int mono_decoder_run(struct mono_decoder *md, i64 until, mono_fn fn, void *opaque)
+{
+	struct AVPacket *pkt = md->pkt;
+	int ret;
+
+	while ((ret = read_packet(md->fmt_ctx, md->st->index, pkt)) == 0) {
+		if (pkt->pts != AV_NOPTS_VALUE
+		    && tb2samples(md->st->time_base, md->dec->sample_rate, pkt->pts) >= until) {
+			av_packet_unref(pkt);
+			avcodec_flush_buffers(md->dec);
+			return 0;
+		}
+
+		ret = decoder_send_packet(md->dec, pkt);
+		av_packet_unref(pkt);
+		if (ret < 0)
+			return ret;
+
+		while ((ret = decoder_receive_frame(md->dec, md->frame)) == 0)
+			if ((ret = mono_decoder_frame(md, fn, opaque)) < 0)
+				return ret;
+
+		if (ret != AVERROR(EAGAIN))
+			return ret;
+	}
+
+	if (ret != AVERROR_EOF)
+		return ret;
+
+	if ((ret = decoder_send_packet(md->dec, NULL)) < 0)
+		return ret;
+
+	while ((ret = decoder_receive_frame(md->dec, md->frame)) == 0)
+		if ((ret = mono_decoder_frame(md, fn, opaque)) < 0)
+			return ret;
+
+	avcodec_flush_buffers(md->dec);
+
+	return ret == AVERROR_EOF ? 0 : ret;
+}
+
+/* The feature kernels; `prev` is the sample before `x`. */
+typedef float (*sum_squares_fn)(const float *x, int n);
+typedef int   (*sign_changes_fn)(const float *x, int n, float prev);
+
+static float sum_squares_c(const float *x, int n)
+{
+	float s = 0;
+	int i;
+
+	for (i = 0; i < n; ++i)
+		s += x[i] * x[i];
+
+	return s;
+}
+
+static int sign_changes_c(const float *x, int n, float prev)
+{
+	int c = 0, i;
+
+	for (i = 0; i < n; ++i) {
+		c   += (prev < 0) != (x[i] < 0);
+		prev = x[i];
+	}
+
+	return c;
+}
+
+#ifdef HAVE_X86
+static inline float hsum_sse2(__m128 v)
+{
+	v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+
+	return _mm_cvtss_f32(v);
+}
+
+static inline int hsum_epi32_sse2(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return _mm_cvtsi128_si32(v);
+}
+
+static float sum_squares_sse2(const float *x, int n)
+{
+	__m128 acc = _mm_setzero_ps();
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128 v = _mm_loadu_ps(x + i);
+
+		acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+	}
+
+	return hsum_sse2(acc) + sum_squares_c(x + i, n - i);
+}
+
+/* Each lane compares a sample with the one before it; an all-ones mask subtracted counts one. */
+static int sign_changes_sse2(const float *x, int n, float prev)
+{
+	__m128 zero = _mm_setzero_ps();
+	__m128i acc = _mm_setzero_si128();
+	int c, i;
+
+	if (n <= 0)
+		return 0;
+
+	c = (prev < 0) != (x[0] < 0);
+
+	for (i = 1; i + 4 <= n; i += 4) {
+		__m128 a = _mm_cmplt_ps(_mm_loadu_ps(x + i - 1), zero);
+		__m128 b = _mm_cmplt_ps(_mm_loadu_ps(x + i), zero);
+
+		acc = _mm_sub_epi32(acc, _mm_castps_si128(_mm_xor_ps(a, b)));
+	}
+
+	return c + hsum_epi32_sse2(acc) + sign_changes_c(x + i, n - i, x[i - 1]);
+}
+
+__attribute__((target("avx2")))
+static float sum_squares_avx2(const float *x, int n)
+{
+	__m256 acc = _mm256_setzero_ps();
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256 v = _mm256_loadu_ps(x + i);
+
+		acc = _mm256_add_ps(acc, _mm256_mul_ps(v, v));
+	}
+
+	return hsum_sse2(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)))
+	     + sum_squares_c(x + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int sign_changes_avx2(const float *x, int n, float prev)
+{
+	__m256 zero = _mm256_setzero_ps();
+	__m256i acc = _mm256_setzero_si256();
+	int c, i;
+
+	if (n <= 0)
+		return 0;
+
+	c = (prev < 0) != (x[0] < 0);
+
+	for (i = 1; i + 8 <= n; i += 8) {
+		__m256 a = _mm256_cmp_ps(_mm256_loadu_ps(x + i - 1), zero, _CMP_LT_OQ);
+		__m256 b = _mm256_cmp_ps(_mm256_loadu_ps(x + i), zero, _CMP_LT_OQ);
+
+		acc = _mm256_sub_epi32(acc, _mm256_castps_si256(_mm256_xor_ps(a, b)));
+	}
+
+	return c + hsum_epi32_sse2(_mm_add_epi32(_mm256_castsi256_si128(acc),
+	                                         _mm256_extracti128_si256(acc, 1)))
+	     + sign_changes_c(x + i, n - i, x[i - 1]);
+}
+#endif
+
+#ifdef HAVE_NEON
+static float sum_squares_neon(const float *x, int n)
+{
+	float32x4_t acc = vdupq_n_f32(0);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		float32x4_t v = vld1q_f32(x + i);
+
+		acc = vfmaq_f32(acc, v, v);
+	}
+
+	return vaddvq_f32(acc) + sum_squares_c(x + i, n - i);
+}
+
+static int sign_changes_neon(const float *x, int n, float prev)
+{
+	float32x4_t zero = vdupq_n_f32(0);
+	uint32x4_t acc = vdupq_n_u32(0);
+	int c, i;
+
+	if (n <= 0)
+		return 0;
+
+	c = (prev < 0) != (x[0] < 0);
+
+	for (i = 1; i + 4 <= n; i += 4) {
+		uint32x4_t a = vcltq_f32(vld1q_f32(x + i - 1), zero);
+		uint32x4_t b = vcltq_f32(vld1q_f32(x + i), zero);
+
+		acc = vsubq_u32(acc, veorq_u32(a, b));
+	}
+
+	return c + (int)vaddvq_u32(acc) + sign_changes_c(x + i, n - i, x[i - 1]);
+}
+#endif
+
+struct feature_kernels {
+	sum_squares_fn  sum_squares;
+	sign_changes_fn sign_changes;
+};
+
+/* Picked once per detection or search, from what the machine running us supports. */
+static void pick_kernels(struct feature_kernels *k)
+{
+	k->sum_squares  = sum_squares_c;
+	k->sign_changes = sign_changes_c;
+
+#if defined(HAVE_X86)
+	k->sum_squares  = sum_squares_sse2;
+	k->sign_changes = sign_changes_sse2;
+
+	if (__builtin_cpu_supports("avx2")) {
+		k->sum_squares  = sum_squares_avx2;
+		k->sign_changes = sign_changes_avx2;
+	}
+#elif defined(HAVE_NEON)
+	k->sum_squares  = sum_squares_neon;
+	k->sign_changes = sign_changes_neon;
+#endif
+}
+
+struct vad_state {
+	const struct speechful_vad *vad;
+	struct feature_kernels      kernels;
+	struct cue_table           *table;
+	i64                         padding_left;
+	i64                         padding_right;
+	i64                         min_speech;
+	i64                         min_silence;
+	float                       floor_rise_db;
+
+	/* The window being accumulated. */
+	int   window;
+	i64   window_start;
+	int   fill;
+	float sum_sq;
+	int   crossings;
+	float last;
+
+	i64   next;
+	bool  started;
+	float floor_db;
+	bool  speaking;
+
+	/* Speech in progress, and the previous run, held back until the gap after it is known. */
+	struct range current;
+	struct range pending;
+	bool         has_pending;
+};
+
+static int flush_pending(struct vad_state *s)
+{
+	struct range cue = s->pending;
+
+	if (!s->has_pending)
+		return 0;
+
+	s->has_pending = false;
+
+	if (cue.end - cue.start < s->min_speech)
+		return 0;
+
+	cue.start -= s->padding_left;
+	cue.end   += s->padding_right;
+
+	return cue_table_append(s->table, cue);
+}
+
+/* Short gaps are bridged before short runs are dropped, so breaths inside a sentence survive. */
+static int speech_ended(struct vad_state *s, struct range speech)
+{
+	int ret;
+
+	if (s->has_pending && speech.start - s->pending.end < s->min_silence) {
+		s->pending.end = speech.end;
+		return 0;
+	}
+
+	ret = flush_pending(s);
+
+	s->pending     = speech;
+	s->has_pending = true;
+
+	return ret;
+}
+
+static int window_done(struct vad_state *s)
+{
+	float energy_db = 10 * log10f(s->sum_sq / s->fill + 1e-12f);
+	float zcr       = (float)s->crossings / s->fill;
+	bool speaking;
+	int ret = 0;
+
+	if (energy_db < s->floor_db || !s->started)
+		s->floor_db = energy_db > FLOOR_MIN_DB ? energy_db : FLOOR_MIN_DB;
+	else
+		s->floor_db += s->floor_rise_db;
+
+	s->started = true;
+
+	/* Hysteresis: harder to start than to keep going. */
+	if (!s->speaking)
+		speaking = energy_db > s->floor_db + s->vad->start_db;
+	else
+		speaking = energy_db > s->floor_db + s->vad->stop_db
+		           || (zcr > FRICATIVE_ZCR && energy_db > s->floor_db + s->vad->stop_db / 2);
+
+	if (speaking && !s->speaking) {
+		s->current.start = s->window_start;
+	} else if (!speaking && s->speaking) {
+		s->current.end = s->window_start;
+		ret = speech_ended(s, s->current);
+	}
+
+	s->speaking  = speaking;
+	s->fill      = 0;
+	s->sum_sq    = 0;
+	s->crossings = 0;
+
+	return ret;
+}
+
+static int vad_feed(void *opaque, const float *x, int n, i64 pos)
+{
+	struct vad_state *s = opaque;
+	struct stage_clock clock;
+	int ret = 0;
+
+	/* Timestamps may be missing from a frame, the sample count never is. */
+	if (pos != AV_NOPTS_VALUE && pos >= s->next)
+		s->next = pos;
+
+	stats_stage_begin(&clock, STAGE_ANALYSIS);
+
+	while (n > 0) {
+		int take;
+
+		if (!s->fill)
+			s->window_start = s->next;
+
+		take = MIN(n, s->window - s->fill);
+
+		s->sum_sq    += s->kernels.sum_squares(x, take);
+		s->crossings += s->kernels.sign_changes(x, take, s->last);
+
+		s->last  = x[take - 1];
+		s->fill += take;
+		s->next += take;
+		x       += take;
+		n       -= take;
+
+		if (s->fill == s->window && (ret = window_done(s)) < 0)
+			break;
+	}
+
+	stats_stage_end(&clock);
+
+	return ret;
+}
+
+int cue_table_detect(struct cue_table *table, struct AVFormatContext *fmt_ctx,
+                     struct AVStream *st, struct AVCodecContext *dec,
+                     const struct speechful_vad *vad,
+                     i64 padding_left_in_ms, i64 padding_right_in_ms)
+{
+	struct mono_decoder md;
+	struct vad_state s = {0};
+	int ret;
+
+	s.vad           = vad;
+	s.table         = table;
+	s.padding_left  = ms2samples(dec->sample_rate, padding_left_in_ms);
+	s.padding_right = ms2samples(dec->sample_rate, padding_right_in_ms);
+	s.min_speech    = ms2samples(dec->sample_rate, vad->min_speech_ms);
+	s.min_silence   = ms2samples(dec->sample_rate, vad->min_silence_ms);
+	s.window        = ms2samples(dec->sample_rate, WINDOW_MS);
+	s.floor_rise_db = FLOOR_RISE_DB_PER_S * WINDOW_MS / 1000;
+
+	if (s.window < 1)
+		s.window = 1;
+
+	pick_kernels(&s.kernels);
+
+	if ((ret = mono_decoder_open(&md, fmt_ctx, st, dec)) < 0)
+		goto end;
+
+	if ((ret = mono_decoder_run(&md, INT64_MAX, vad_feed, &s)) < 0)
+		goto end;
+
+	/* The last window may be short, and speech may run until the very end. */
+	if (s.fill && (ret = window_done(&s)) < 0)
+		goto end;
+
+	if (s.speaking) {
+		s.current.end = s.next;
+		if ((ret = speech_ended(&s, s.current)) < 0)
+			goto end;
+	}
+
+	if ((ret = flush_pending(&s)) < 0)
+		goto end;
+
+	cue_table_settle(table);
+
+end:
+	mono_decoder_close(&md);
+
+	return ret;
+}
+
+/* The decoded samples of `span`; only [`lo`, `hi`) was actually filled. */
+struct span_buffer {
+	struct range           span;
+	float                 *x;
+	i64                    lo;
+	i64                    hi;
+	i64                    next;
+	struct feature_kernels kernels;
+};
+
+static int span_collect(void *opaque, const float *x, int n, i64 pos)
+{
+	struct span_buffer *b = opaque;
+	struct range have, overlap;
+
+	if (pos == AV_NOPTS_VALUE)
+		pos = b->next;
+	b->next = pos + n;
+
+	have.start = pos;
+	have.end   = pos + n;
+
+	if (have.end <= b->span.start || have.start >= b->span.end)
+		return 0;
+
+	overlap = get_overlapped_region(have, b->span);
+	memcpy(b->x + (overlap.start - b->span.start), x + (overlap.start - pos),
+	       (overlap.end - overlap.start) * sizeof(float));
+
+	if (b->lo == b->hi)
+		b->lo = overlap.start;
+	b->hi = overlap.end;
+
+	return 0;
+}
+
+static int decode_span(struct mono_decoder *md, struct span_buffer *b)
+{
+	struct AVStream *st = md->st;
+	struct stage_clock clock;
+	int ret;
+
+	b->lo = b->hi = b->next = b->span.start;
+
+	stats_stage_begin(&clock, STAGE_SEEK);
+	ret = av_seek_frame(md->fmt_ctx, st->index,
+	                    samples2tb(st->time_base, md->dec->sample_rate, b->span.start),
+	                    AVSEEK_FLAG_BACKWARD);
+	stats_stage_end(&clock);
+	stats_count(COUNTER_SEEKS, 1);
+
+	if (ret < 0)
+		return ret;
+
+	avcodec_flush_buffers(md->dec);
+
+	return mono_decoder_run(md, b->span.end, span_collect, b);
+}
+
+/*
+ * Returns the middle of the quietest window whose middle lies in `within`,
+ * or -1 when none was decoded. Ties go to the earliest window when `early`,
+ * to the latest otherwise, so edges rather move out of a cue than into it.
+ */
+static i64 quietest_point(const struct span_buffer *b, struct range within, int window, bool early)
+{
+	int step = window / REFINE_STEPS_PER_WINDOW;
+	float best_energy = 0;
+	i64 best = -1;
+	i64 at;
+
+	if (step < 1)
+		step = 1;
+
+	for (at = within.start - window / 2; at + window / 2 <= within.end; at += step) {
+		float energy;
+
+		if (at < b->lo || at + window > b->hi)
+			continue;
+
+		energy = b->kernels.sum_squares(b->x + (at - b->span.start), window);
+
+		if (best < 0 || energy < best_energy || (!early && energy == best_energy)) {
+			best_energy = energy;
+			best        = at + window / 2;
+		}
+	}
+
+	return best;
+}
+
+static i64 *cue_edge(struct cue_table *table, int edge)
+{
+	struct range *cue = &table->cues[edge / 2];
+	return edge % 2 ? &cue->end : &cue->start;
+}
+
+/* An edge may not move past the middle of its own cue. */
+static struct range edge_search_range(const struct cue_table *table, int edge, i64 search)
+{
+	const struct range *cue = &table->cues[edge / 2];
+	i64 middle = cue->start + (cue->end - cue->start) / 2;
+	struct range within;
+
+	if (edge % 2) {
+		within.start = cue->end - search > middle ? cue->end - search : middle;
+		within.end   = cue->end + search;
+	} else {
+		within.start = cue->start - search;
+		within.end   = cue->start + search < middle ? cue->start + search : middle;
+	}
+
+	return within;
+}
+
+int cue_table_refine(struct cue_table *table, struct AVFormatContext *fmt_ctx,
+                     struct AVStream *st, struct AVCodecContext *dec, i64 search_in_ms)
+{
+	struct mono_decoder md;
+	struct span_buffer b = {0};
+	i64 search   = ms2samples(dec->sample_rate, search_in_ms);
+	i64 max_span = ms2samples(dec->sample_rate, MAX_SPAN_MS);
+	int window   = ms2samples(dec->sample_rate, WINDOW_MS);
+	i64 capacity = 0;
+	int nr_edges = table->nr_cues * 2;
+	int edge, next;
+	int ret;
+
+	if (!search || !nr_edges)
+		return 0;
+
+	if (window < 1)
+		window = 1;
+
+	pick_kernels(&b.kernels);
+
+	if ((ret = mono_decoder_open(&md, fmt_ctx, st, dec)) < 0)
+		goto end;
+
+	for (edge = 0; edge < nr_edges; edge = next) {
+		struct stage_clock clock;
+		struct range span;
+		int k;
+
+		span.start = *cue_edge(table, edge) - search - window;
+		span.end   = *cue_edge(table, edge) + search + window;
+		if (span.start < 0)
+			span.start = 0;
+
+		for (next = edge + 1; next < nr_edges; ++next) {
+			i64 end = *cue_edge(table, next) + search + window;
+
+			if (*cue_edge(table, next) - search - window > span.end || end - span.start > max_span)
+				break;
+			span.end = end;
+		}
+
+		if (span.end - span.start > capacity) {
+			float *x;
+
+			if (!(x = av_realloc_array(b.x, span.end - span.start, sizeof(float)))) {
+				ret = AVERROR(ENOMEM);
+				goto end;
+			}
+			b.x      = x;
+			capacity = span.end - span.start;
+		}
+
+		b.span = span;
+
+		if ((ret = decode_span(&md, &b)) < 0)
+			goto end;
+
+		stats_stage_begin(&clock, STAGE_ANALYSIS);
+
+		for (k = edge; k < next; ++k) {
+			i64 at = quietest_point(&b, edge_search_range(table, k, search), window, k % 2 == 0);
+
+			if (at >= 0)
+				*cue_edge(table, k) = at;
+		}
+
+		stats_stage_end(&clock);
+	}
+
+	cue_table_settle(table);
+
+end:
+	av_free(b.x);
+	mono_decoder_close(&md);
+
+	return ret;
+}
+
+/* Decodes around `within` and sets `*at` to the middle of its quietest window, or -1. */
+static int find_cut(struct mono_decoder *md, struct span_buffer *b, i64 *capacity,
+                    struct range within, int window, i64 *at)
+{
+	struct stage_clock clock;
+	struct range span;
+	int ret;
+
+	span.start = within.start - window;
+	span.end   = within.end + window;
+	if (span.start < 0)
+		span.start = 0;
+
+	if (span.end - span.start > *capacity) {
+		float *x;
+
+		if (!(x = av_realloc_array(b->x, span.end - span.start, sizeof(float))))
+			return AVERROR(ENOMEM);
+		b->x      = x;
+		*capacity = span.end - span.start;
+	}
+
+	b->span = span;
+
+	if ((ret = decode_span(md, b)) < 0)
+		return ret;
+
+	stats_stage_begin(&clock, STAGE_ANALYSIS);
+	/* Ties go to the latest window, for pieces as long as they may be. */
+	*at = quietest_point(b, within, window, false);
+	stats_stage_end(&clock);
+
+	return 0;
+}
+
+int cue_table_split(struct cue_table *table, struct AVFormatContext *fmt_ctx,
+                    struct AVStream *st, struct AVCodecContext *dec, i64 max_in_ms)
+{
+	struct mono_decoder md;
+	struct span_buffer b = {0};
+	struct cue_table pieces = {0};
+	i64 max      = ms2samples(dec->sample_rate, max_in_ms);
+	int window   = ms2samples(dec->sample_rate, WINDOW_MS);
+	i64 capacity = 0;
+	int i, ret;
+
+	if (window < 1)
+		window = 1;
+
+	/* A piece has to be long enough for its cut to be looked for. */
+	if (max < 4 * window)
+		return AVERROR(EINVAL);
+
+	for (i = 0; i < table->nr_cues; ++i)
+		if (table->cues[i].end - table->cues[i].start > max)
+			break;
+
+	if (i == table->nr_cues)
+		return 0;
+
+	pick_kernels(&b.kernels);
+
+	if ((ret = mono_decoder_open(&md, fmt_ctx, st, dec)) < 0)
+		goto end;
+
+	for (i = 0; i < table->nr_cues; ++i) {
+		struct range cue = table->cues[i];
+		i64 pos = cue.start;
+
+		while (cue.end - pos > max) {
+			struct range within = {pos + max / 2, pos + max};
+			i64 at;
+
+			if ((ret = find_cut(&md, &b, &capacity, within, window, &at)) < 0)
+				goto end;
+
+			/* Nothing was decoded there; the piece ends where it has to. */
+			if (at < 0)
+				at = within.end;
+
+			if ((ret = cue_table_append(&pieces, (struct range){pos, at})) < 0)
+				goto end;
+			pos = at;
+		}
+
+		if ((ret = cue_table_append(&pieces, (struct range){pos, cue.end})) < 0)
+			goto end;
+	}
+
+	cue_table_free(table);
+	*table = pieces;
+	pieces = (struct cue_table){0};
+
+end:
+	cue_table_free(&pieces);
+	av_free(b.x);
+	mono_decoder_close(&md);
+
+	return ret;
+}
@@ -0,0 +1,43 @@
+#ifndef SPEECHFUL_ANALYSIS_H
+#define SPEECHFUL_ANALYSIS_H
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+
+#include "pipeline.h"
+#include "speechful.h"
+
+/*
+ * Decodes `st` from the current read position to the end and fills `table`
+ * with the speech `vad` finds in it, padded the way subtitle cues are. The
+ * decoder is flushed afterwards, and the input is left at its end, so the
+ * extraction that follows has to seek.
+ *
+ * This is a pass of its own, not part of extraction: the whole input is
+ * decoded here, and the cues are decoded again when they are extracted. A
+ * job with mostly speech therefore decodes close to twice, while the
+ * detection itself adds little to the decoding.
+ */
+int cue_table_detect(struct cue_table *table, struct AVFormatContext *fmt_ctx,
+                     struct AVStream *st, struct AVCodecContext *dec,
+                     const struct speechful_vad *vad,
+                     i64 padding_left_in_ms, i64 padding_right_in_ms);
+
+/*
+ * Moves every cue edge to the middle of the quietest 10 ms found within
+ * `search_in_ms` of it, without crossing the middle of its cue, then settles
+ * the table. Only the audio around the edges is decoded, by seeking.
+ */
+int cue_table_refine(struct cue_table *table, struct AVFormatContext *fmt_ctx,
+                     struct AVStream *st, struct AVCodecContext *dec, i64 search_in_ms);
+
+/*
+ * Cuts every cue longer than `max_in_ms` into pieces that are not, each cut
+ * at the middle of the quietest 10 ms in the second half of the `max_in_ms`
+ * that the piece may span. The pieces abut. Only the audio around the cuts
+ * is decoded, by seeking.
+ */
+int cue_table_split(struct cue_table *table, struct AVFormatContext *fmt_ctx,
+                    struct AVStream *st, struct AVCodecContext *dec, i64 max_in_ms);
+
+#endif
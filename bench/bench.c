@@ -0,0 +1,745 @@
+/*
+ * speechful-bench: micro-benchmarks for the extraction loop helpers and
+ * end-to-end runs of the speechful binary over the synthetic corpus.
+ *
+ * Every result is reported as realtime-x (seconds of media per second of
+ * wall time) and samples/s. Results can be saved as a baseline and later
+ * compared against it; a throughput drop above the threshold is a failure.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+#include <libavutil/avutil.h>
+#include <libavutil/audio_fifo.h>
+
+#include "gen.h"
+#include "pipeline.h"
+#include "speechful.h"
+
+#define MAX_RESULTS 64
+
+#define IN_RATE   48000
+#define OUT_RATE  44100
+#define CHANNELS  2
+#define FRAME     1024
+
+struct result {
+	char   name[64];
+	double realtime_x;
+	double samples_per_s;
+};
+
+static struct {
+	bool          quick;
+	const char   *filter;
+	const char   *baseline;
+	const char   *save_baseline;
+	const char   *speechful;
+	double        threshold;
+	struct result results[MAX_RESULTS];
+	int           nr_results;
+} bench = {
+	.speechful = "./speechful",
+	.threshold = 10,
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double min_seconds(void)
+{
+	return bench.quick ? 0.2 : 1.0;
+}
+
+static bool selected(const char *name)
+{
+	return !bench.filter || strstr(name, bench.filter);
+}
+
+static void record(const char *name, double samples, int sample_rate, double seconds)
+{
+	struct result *r;
+
+	if (bench.nr_results == MAX_RESULTS)
+		return;
+
+	r = &bench.results[bench.nr_results++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->samples_per_s = samples / seconds;
+	r->realtime_x    = r->samples_per_s / sample_rate;
+
+	printf("%-32s %12.1fx realtime %16.0f samples/s\n", r->name, r->realtime_x, r->samples_per_s);
+	fflush(stdout);
+}
+
+static int alloc_input(u8 ***buf, int channels, int samples, enum AVSampleFormat fmt)
+{
+	int ret, i, c;
+
+	if ((ret = av_samples_alloc_array_and_samples(buf, NULL, channels, samples, fmt, 0)) < 0)
+		return ret;
+
+	/* Any signal will do, as long as it is not silence. */
+	for (c = 0; c < channels; ++c)
+		for (i = 0; i < samples; ++i)
+			((float *)(*buf)[c])[i] = (i % 97) / 97.0f - 0.5f;
+
+	return 0;
+}
+
+static void bench_get_overlapped_region(void)
+{
+	volatile i64 sink = 0;
+	double started = now(), elapsed;
+	i64 calls = 0;
+
+	do {
+		int i;
+		for (i = 0; i < 1000000; ++i) {
+			struct range frame = {i * FRAME, (i + 1) * FRAME};
+			struct range cue   = {i * FRAME + i % FRAME, (i + 2) * FRAME};
+			sink += get_overlapped_region(frame, cue).start;
+		}
+		calls += 1000000;
+	} while ((elapsed = now() - started) < min_seconds());
+
+	(void)sink;
+	/* Each call decides the overlap of one decoded frame. */
+	record("get_overlapped_region", (double)calls * FRAME, IN_RATE, elapsed);
+}
+
+static int bench_extract_audio_region(void)
+{
+	u8 **src;
+	double started, elapsed;
+	i64 samples = 0;
+	int ret;
+
+	if ((ret = alloc_input(&src, CHANNELS, FRAME, AV_SAMPLE_FMT_FLTP)) < 0)
+		return ret;
+
+	started = now();
+	do {
+		struct range length = {0, FRAME}, region = {FRAME / 8, FRAME - FRAME / 8};
+		u8 **dst;
+
+		if ((ret = extract_audio_region(&dst, (const u8 *const *)src, FRAME, CHANNELS,
+		                                AV_SAMPLE_FMT_FLTP, length, region)) < 0)
+			break;
+
+		samples += ret;
+		av_freep(dst);
+		av_freep(&dst);
+	} while ((elapsed = now() - started) < min_seconds());
+
+	av_freep(src);
+	av_freep(&src);
+
+	if (ret < 0)
+		return ret;
+
+	record("extract_audio_region", samples, IN_RATE, elapsed);
+	return 0;
+}
+
+/*
+ * Converts planar float to `dst` through `resampler_open()` or, to compare
+ * it against, through swr alone. Both allocate their output on every call,
+ * as `resample()` does.
+ */
+struct converter {
+	struct AVCodecContext        *dec;
+	struct resampler             *resampler;
+	struct SwrContext            *swr;
+	struct audio_encoder_settings dst;
+};
+
+static void converter_close(struct converter *cv)
+{
+	resampler_free(&cv->resampler);
+	swr_free(&cv->swr);
+	avcodec_free_context(&cv->dec);
+}
+
+static int converter_open(struct converter *cv, int in_channels, int in_rate,
+                          struct audio_encoder_settings dst, bool swr_only)
+{
+	struct AVChannelLayout dst_layout;
+	int ret;
+
+	memset(cv, 0, sizeof(struct converter));
+	cv->dst = dst;
+
+	/* Stands in for an opened decoder, `resampler_open()` only reads its audio parameters. */
+	if (!(cv->dec = avcodec_alloc_context3(NULL)))
+		return AVERROR(ENOMEM);
+
+	av_channel_layout_default(&cv->dec->ch_layout, in_channels);
+	cv->dec->sample_rate = in_rate;
+	cv->dec->sample_fmt  = AV_SAMPLE_FMT_FLTP;
+
+	av_channel_layout_default(&dst_layout, dst.channels);
+
+	if (!swr_only)
+		ret = resampler_open(&cv->resampler, &dst, cv->dec);
+	else if ((ret = swr_alloc_set_opts2(&cv->swr, &dst_layout, dst.sample_fmt, dst.sample_rate,
+	                                    &cv->dec->ch_layout, cv->dec->sample_fmt,
+	                                    cv->dec->sample_rate, 0, NULL)) >= 0)
+		ret = swr_init(cv->swr);
+
+	if (ret < 0)
+		converter_close(cv);
+
+	return ret;
+}
+
+static int converter_run(struct converter *cv, u8 ***dst, const u8 *const *src, int samples)
+{
+	int capacity, ret;
+
+	if (cv->resampler)
+		return resample(cv->resampler, dst, src, samples, cv->dst.channels, cv->dst.sample_fmt);
+
+	capacity = swr_get_out_samples(cv->swr, samples);
+	if ((ret = av_samples_alloc_array_and_samples(dst, NULL, cv->dst.channels, capacity,
+	                                              cv->dst.sample_fmt, 0)) < 0)
+		return ret;
+
+	if ((ret = swr_convert(cv->swr, *dst, capacity, (const u8 **)src, samples)) < 0) {
+		av_freep(*dst);
+		av_freep(dst);
+	}
+
+	return ret;
+}
+
+static int bench_convert(const char *name, int in_channels, int in_rate,
+                         struct audio_encoder_settings dst, bool swr_only)
+{
+	struct converter cv;
+	u8 **src = NULL;
+	double started, elapsed;
+	i64 samples = 0;
+	int ret;
+
+	if ((ret = converter_open(&cv, in_channels, in_rate, dst, swr_only)) < 0)
+		return ret;
+
+	if ((ret = alloc_input(&src, in_channels, FRAME, AV_SAMPLE_FMT_FLTP)) < 0)
+		goto end;
+
+	started = now();
+	do {
+		u8 **out;
+
+		if ((ret = converter_run(&cv, &out, (const u8 *const *)src, FRAME)) < 0)
+			goto end;
+
+		samples += FRAME;
+		av_freep(out);
+		av_freep(&out);
+	} while ((elapsed = now() - started) < min_seconds());
+
+	record(name, samples, in_rate, elapsed);
+
+end:
+	if (src) {
+		av_freep(src);
+		av_freep(&src);
+	}
+	converter_close(&cv);
+	return ret;
+}
+
+static int bench_resample(void)
+{
+	struct audio_encoder_settings dst = {CHANNELS, OUT_RATE, 0, AV_SAMPLE_FMT_S16P};
+
+	return bench_convert("resample", CHANNELS, IN_RATE, dst, false);
+}
+
+/*
+ * The conversions our own stages cover, each next to swr doing the same:
+ * the downmix alone, and the polyphase filter with the downmix after it.
+ */
+static int bench_own_stages(void)
+{
+	static const struct {
+		const char                   *name;
+		int                           in_channels;
+		int                           in_rate;
+		struct audio_encoder_settings dst;
+	} cases[] = {
+		{"downmix_5.1_stereo_s16p",    6,        IN_RATE, {2, IN_RATE, 0, AV_SAMPLE_FMT_S16P}},
+		{"downmix_stereo_mono_fltp",   CHANNELS, IN_RATE, {1, IN_RATE, 0, AV_SAMPLE_FMT_FLTP}},
+		{"polyphase_48k_16k_mono_s16p", CHANNELS, 48000,  {1, 16000, 0, AV_SAMPLE_FMT_S16P}},
+		{"polyphase_44k_16k_mono_s16p", CHANNELS, 44100,  {1, 16000, 0, AV_SAMPLE_FMT_S16P}},
+		{"polyphase_48k_24k_mono_fltp", CHANNELS, 48000,  {1, 24000, 0, AV_SAMPLE_FMT_FLTP}},
+		{"polyphase_44k_24k_mono_fltp", CHANNELS, 44100,  {1, 24000, 0, AV_SAMPLE_FMT_FLTP}},
+	};
+	char name[64];
+	int ret, i;
+
+	for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); ++i) {
+		if (!selected(cases[i].name))
+			continue;
+
+		if ((ret = bench_convert(cases[i].name, cases[i].in_channels, cases[i].in_rate,
+		                         cases[i].dst, false)) < 0)
+			return ret;
+
+		snprintf(name, sizeof(name), "%s_swr", cases[i].name);
+		if ((ret = bench_convert(name, cases[i].in_channels, cases[i].in_rate,
+		                         cases[i].dst, true)) < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Level in dB of what `cv` makes of a tone at `freq`, relative to the tone. The edges are left out, so filter delay does not count.
+ */
+static int tone_gain(struct converter *cv, int in_rate, double freq, double *gain_db)
+{
+	int length = in_rate, out_rate = cv->dst.sample_rate, pos, got = 0, i, ret = 0;
+	float *y;
+	double e = 0;
+	u8 **src;
+
+	if (!(y = av_malloc_array(length + FRAME, sizeof(float))))
+		return AVERROR(ENOMEM);
+
+	if ((ret = av_samples_alloc_array_and_samples(&src, NULL, 1, FRAME, AV_SAMPLE_FMT_FLTP, 0)) < 0)
+		goto end;
+
+	for (pos = 0; pos < length; pos += FRAME) {
+		u8 **out;
+
+		for (i = 0; i < FRAME; ++i)
+			((float *)src[0])[i] = 0.5 * sin(2 * 3.14159265358979323846 * freq * (pos + i) / in_rate);
+
+		if ((ret = converter_run(cv, &out, (const u8 *const *)src, FRAME)) < 0)
+			break;
+
+		memcpy(y + got, out[0], ret * sizeof(float));
+		got += ret;
+		av_freep(out);
+		av_freep(&out);
+	}
+
+	for (i = out_rate / 10; i < got - out_rate / 10; ++i)
+		e += (double)y[i] * y[i];
+	*gain_db = 10 * log10(e / (got - out_rate / 5) / 0.125 + 1e-30);
+
+	av_freep(src);
+	av_freep(&src);
+end:
+	av_freep(&y);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Passband ripple up to 80% of the output's Nyquist rate, and the loudest
+ * alias of a tone between it and the input's, for the polyphase filter and
+ * for swr. Printed only, the baseline compares throughput.
+ */
+static int bench_polyphase_quality(void)
+{
+	static const int rates[][2] = {{48000, 16000}, {48000, 24000}, {44100, 16000}, {44100, 24000}};
+	int r, swr_only, ret;
+
+	for (r = 0; r < (int)(sizeof(rates) / sizeof(rates[0])); ++r) {
+		struct audio_encoder_settings dst = {1, rates[r][1], 0, AV_SAMPLE_FMT_FLTP};
+		double nyquist = rates[r][1] / 2.0;
+
+		for (swr_only = 0; swr_only < 2; ++swr_only) {
+			double ripple = 0, alias = -200, gain, f;
+			struct converter cv;
+
+			for (f = 100; f <= 0.8 * nyquist; f += nyquist / 8) {
+				if ((ret = converter_open(&cv, 1, rates[r][0], dst, swr_only)) < 0)
+					return ret;
+				ret = tone_gain(&cv, rates[r][0], f, &gain);
+				converter_close(&cv);
+				if (ret < 0)
+					return ret;
+				ripple = fabs(gain) > ripple ? fabs(gain) : ripple;
+			}
+
+			for (f = 1.05 * nyquist; f < 0.95 * rates[r][0] / 2; f += nyquist / 8) {
+				if ((ret = converter_open(&cv, 1, rates[r][0], dst, swr_only)) < 0)
+					return ret;
+				ret = tone_gain(&cv, rates[r][0], f, &gain);
+				converter_close(&cv);
+				if (ret < 0)
+					return ret;
+				alias = gain > alias ? gain : alias;
+			}
+
+			printf("quality %d->%d %-9s ripple %.3f dB, worst alias %.1f dB\n",
+			       rates[r][0], rates[r][1], swr_only ? "swr" : "polyphase", ripple, alias);
+		}
+	}
+
+	fflush(stdout);
+	return 0;
+}
+
+static int bench_format_write_audio_data(void)
+{
+	struct audio_encoder_settings settings = {CHANNELS, OUT_RATE, 64000, AV_SAMPLE_FMT_S16P};
+	struct AVFormatContext *fmt = NULL;
+	struct AVCodecContext *enc = NULL;
+	struct AVAudioFifo *queue = NULL;
+	struct AVStream *st;
+	u8 **src = NULL;
+	double started, elapsed;
+	i64 samples = 0, next_pts = 0;
+	int ret;
+
+	if ((ret = codec_open_audio_encoder(&enc, avcodec_find_encoder(AV_CODEC_ID_MP3), settings, NULL)) < 0)
+		goto end;
+
+	/* The null muxer measures encoding without the cost of a disk. */
+	if ((ret = avformat_alloc_output_context2(&fmt, NULL, "null", NULL)) < 0)
+		goto end;
+
+	if (!(st = avformat_new_stream(fmt, NULL))
+	    || !(queue = av_audio_fifo_alloc(enc->sample_fmt, CHANNELS, 1))) {
+		ret = AVERROR(ENOMEM);
+		goto end;
+	}
+
+	if ((ret = avcodec_parameters_from_context(st->codecpar, enc)) < 0)
+		goto end;
+	st->time_base = enc->time_base;
+
+	if ((ret = avformat_write_header(fmt, NULL)) < 0)
+		goto end;
+
+	if ((ret = av_samples_alloc_array_and_samples(&src, NULL, CHANNELS, FRAME, enc->sample_fmt, 0)) < 0)
+		goto end;
+	av_samples_set_silence(src, 0, FRAME, CHANNELS, enc->sample_fmt);
+
+	started = now();
+	do {
+		ret = format_write_audio_data(fmt, NULL, enc, queue, (const u8 *const *)src, FRAME, &next_pts);
+		if (ret < 0 && ret != AVERROR(EAGAIN))
+			goto end;
+		samples += FRAME;
+	} while ((elapsed = now() - started) < min_seconds());
+
+	if ((ret = format_write_audio_data(fmt, NULL, enc, queue, NULL, 0, &next_pts)) < 0)
+		goto end;
+
+	record("format_write_audio_data", samples, OUT_RATE, elapsed);
+
+end:
+	if (src) {
+		av_freep(src);
+		av_freep(&src);
+	}
+	if (queue)
+		av_audio_fifo_free(queue);
+	avcodec_free_context(&enc);
+	avformat_free_context(fmt);
+	return ret;
+}
+
+/* Writes `duration` seconds of the synthetic corpus to `media`, its cues to `sub`. */
+static int generate(const char *media, const char *sub, const char *codec,
+                    const char *pattern, int duration)
+{
+	char a_duration[32], a_codec[64], a_pattern[64], a_sub[528];
+	const char *gen_argv[8];
+
+	snprintf(a_duration, sizeof(a_duration), "--duration=%d", duration);
+	snprintf(a_codec,    sizeof(a_codec),    "--codec=%s", codec);
+	snprintf(a_pattern,  sizeof(a_pattern),  "--pattern=%s", pattern);
+	snprintf(a_sub,      sizeof(a_sub),      "--sub=%s", sub);
+
+	gen_argv[0] = "generate";
+	gen_argv[1] = a_duration;
+	gen_argv[2] = a_codec;
+	gen_argv[3] = a_pattern;
+	gen_argv[4] = a_sub;
+	gen_argv[5] = media;
+
+	return generate_main(6, gen_argv) != 0 ? AVERROR(EINVAL) : 0;
+}
+
+static int run_job(struct speechful *sf, const struct speechful_config *config)
+{
+	struct speechful_job *job = NULL;
+	int ret, close_ret;
+
+	if ((ret = speechful_job_open(&job, sf, config)) < 0)
+		return ret;
+
+	ret = speechful_job_run(job);
+	close_ret = speechful_job_close(&job);
+
+	return ret < 0 ? ret : close_ret;
+}
+
+/*
+ * Short MP3 jobs one after another in one process, as a serve worker runs
+ * them: opening every context afresh, and from a pool refilled between jobs,
+ * the way the worker does it once a job is answered. Only the jobs are timed.
+ */
+static int bench_pooled_jobs(const char *dir)
+{
+	static const char *const names[] = {"jobs/mp3/5s/cold", "jobs/mp3/5s/pooled"};
+	struct speechful_config config;
+	struct speechful_pool *pool = NULL;
+	struct speechful *sf = NULL;
+	char media[512], sub[512], out[512];
+	int duration = 5, mode, ret;
+
+	if (!selected("jobs/mp3") || !avcodec_find_encoder_by_name("libmp3lame"))
+		return 0;
+
+	snprintf(media, sizeof(media), "%s/jobs.mp3", dir);
+	snprintf(sub,   sizeof(sub),   "%s/jobs.srt", dir);
+	snprintf(out,   sizeof(out),   "%s/jobs-out.mp3", dir);
+
+	if ((ret = generate(media, sub, "libmp3lame", "dense", duration)) < 0
+	    || (ret = speechful_alloc(&sf)) < 0
+	    || (ret = speechful_pool_alloc(&pool)) < 0)
+		goto end;
+
+	speechful_config_init(&config);
+	config.input     = media;
+	config.subtitles = sub;
+	config.output    = out;
+
+	for (mode = 0; mode < 2 && ret >= 0; ++mode) {
+		double started, elapsed = 0;
+		int jobs = 0;
+
+		config.pool = mode ? pool : NULL;
+
+		/* The first job fills the pool, like the first one a worker gets. */
+		if (mode && ((ret = run_job(sf, &config)) < 0 || (ret = speechful_pool_refill(pool)) < 0))
+			break;
+
+		while (elapsed < min_seconds()) {
+			started = now();
+			if ((ret = run_job(sf, &config)) < 0)
+				break;
+			elapsed += now() - started;
+			jobs++;
+
+			if (mode && (ret = speechful_pool_refill(pool)) < 0)
+				break;
+		}
+
+		if (ret >= 0)
+			record(names[mode], (double)jobs * duration * IN_RATE, IN_RATE, elapsed);
+	}
+
+end:
+	speechful_pool_free(&pool);
+	speechful_free(&sf);
+	return ret;
+}
+
+static int bench_end_to_end(const char *dir, const char *codec, const char *ext,
+                            const char *pattern, int duration)
+{
+	char name[64], media[512], sub[512], cmd[2048];
+	double started, elapsed;
+	int ret;
+
+	snprintf(name, sizeof(name), "e2e/%s/%s/%ds", codec, pattern, duration);
+	if (!selected(name))
+		return 0;
+
+	if (!avcodec_find_encoder_by_name(codec)) {
+		printf("%-32s skipped, encoder not available\n", name);
+		return 0;
+	}
+
+	snprintf(media, sizeof(media), "%s/%s-%s-%d.%s", dir, codec, pattern, duration, ext);
+	snprintf(sub,   sizeof(sub),   "%s/%s-%s-%d.srt", dir, codec, pattern, duration);
+
+	if ((ret = generate(media, sub, codec, pattern, duration)) < 0)
+		return ret;
+
+	snprintf(cmd, sizeof(cmd), "'%s' --sub='%s' --out='%s/out.mp3' '%s' >/dev/null 2>&1",
+	         bench.speechful, sub, dir, media);
+
+	started = now();
+	ret = system(cmd);
+	elapsed = now() - started;
+
+	if (ret != 0) {
+		fprintf(stderr, "%s: '%s' failed\n", name, cmd);
+		return AVERROR_EXTERNAL;
+	}
+
+	record(name, (double)duration * IN_RATE, IN_RATE, elapsed);
+	return 0;
+}
+
+static int run_end_to_end(void)
+{
+	static const struct { const char *codec, *ext; } codecs[] = {
+		{"aac",        "m4a"},
+		{"libmp3lame", "mp3"},
+		{"flac",       "flac"},
+	};
+	static const char *const patterns[] = {"sparse", "dense"};
+	char dir[] = "/tmp/speechful-bench-XXXXXX";
+	char cmd[64];
+	int duration = bench.quick ? 60 : 1800;
+	size_t c, p;
+	int ret = 0;
+
+	if (!mkdtemp(dir))
+		return AVERROR(errno);
+
+	ret = bench_pooled_jobs(dir);
+
+	for (c = 0; c < sizeof(codecs) / sizeof(*codecs) && ret >= 0; ++c)
+		for (p = 0; p < sizeof(patterns) / sizeof(*patterns) && ret >= 0; ++p)
+			ret = bench_end_to_end(dir, codecs[c].codec, codecs[c].ext, patterns[p], duration);
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+	if (system(cmd) != 0)
+		fprintf(stderr, "%s: failed to remove the corpus\n", dir);
+
+	return ret;
+}
+
+static int save_baseline(const char *filepath)
+{
+	FILE *out;
+	int i;
+
+	if (!(out = fopen(filepath, "w")))
+		return AVERROR(errno);
+
+	fprintf(out, "# name realtime_x samples_per_s\n");
+	for (i = 0; i < bench.nr_results; ++i)
+		fprintf(out, "%s %.3f %.0f\n", bench.results[i].name,
+		        bench.results[i].realtime_x, bench.results[i].samples_per_s);
+
+	return fclose(out) == EOF ? AVERROR(errno) : 0;
+}
+
+/* Returns the number of regressions, or a negative error code. */
+static int compare_baseline(const char *filepath)
+{
+	char line[256], name[64];
+	double realtime_x, samples_per_s;
+	FILE *in;
+	int regressions = 0, i;
+
+	if (!(in = fopen(filepath, "r")))
+		return AVERROR(errno);
+
+	while (fgets(line, sizeof(line), in)) {
+		if (line[0] == '#' || sscanf(line, "%63s %lf %lf", name, &realtime_x, &samples_per_s) != 3)
+			continue;
+
+		for (i = 0; i < bench.nr_results; ++i) {
+			const struct result *r = &bench.results[i];
+			double change;
+
+			if (strcmp(r->name, name) != 0)
+				continue;
+
+			change = 100 * (r->samples_per_s - samples_per_s) / samples_per_s;
+			if (change < -bench.threshold) {
+				printf("REGRESSION %-32s %+.1f%% (%.1fx -> %.1fx realtime)\n",
+				       name, change, realtime_x, r->realtime_x);
+				++regressions;
+			}
+		}
+	}
+
+	fclose(in);
+	return regressions;
+}
+
+int main(int argc, char **argv)
+{
+	int i, ret = 0;
+
+	for (i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+
+		if (strcmp(arg, "--quick") == 0) {
+			bench.quick = true;
+		} else if (strncmp(arg, "--filter=", 9) == 0) {
+			bench.filter = arg + 9;
+		} else if (strncmp(arg, "--baseline=", 11) == 0) {
+			bench.baseline = arg + 11;
+		} else if (strncmp(arg, "--save-baseline=", 16) == 0) {
+			bench.save_baseline = arg + 16;
+		} else if (strncmp(arg, "--speechful=", 12) == 0) {
+			bench.speechful = arg + 12;
+		} else if (sscanf(arg, "--threshold=%lf", &bench.threshold) != 1) {
+			fprintf(stderr, "usage: %s [--quick] [--filter=<substring>] [--speechful=<binary>]"
+			        " [--baseline=<file>] [--save-baseline=<file>] [--threshold=<percent>]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	av_log_set_level(AV_LOG_ERROR);
+
+	if (selected("get_overlapped_region"))
+		bench_get_overlapped_region();
+	if (ret >= 0 && selected("extract_audio_region"))
+		ret = bench_extract_audio_region();
+	if (ret >= 0 && selected("resample"))
+		ret = bench_resample();
+	if (ret >= 0)
+		ret = bench_own_stages();
+	if (ret >= 0 && selected("polyphase_quality"))
+		ret = bench_polyphase_quality();
+	if (ret >= 0 && selected("format_write_audio_data"))
+		ret = bench_format_write_audio_data();
+	if (ret >= 0)
+		ret = run_end_to_end();
+
+	if (ret < 0) {
+		fprintf(stderr, "Benchmark failed: %s\n", av_err2str(ret));
+		return 1;
+	}
+
+	if (bench.save_baseline && (ret = save_baseline(bench.save_baseline)) < 0) {
+		fprintf(stderr, "%s: failed to save baseline: %s\n", bench.save_baseline, av_err2str(ret));
+		return 1;
+	}
+
+	if (bench.baseline) {
+		if ((ret = compare_baseline(bench.baseline)) < 0) {
+			fprintf(stderr, "%s: failed to read baseline: %s\n", bench.baseline, av_err2str(ret));
+			return 1;
+		}
+		if (ret > 0) {
+			printf("%d benchmark(s) regressed more than %.1f%%.\n", ret, bench.threshold);
+			return 1;
+		}
+	}
+
+	return 0;
+}
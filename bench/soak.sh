@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Soak benchmark: runs speechful over a long synthetic input several times
+# with allocation accounting on, and fails if the live allocation count or
+# the RSS keeps growing while cues are processed, or if a run leaks more
+# than the previous one.
+#
+# Tunables (environment): SPEECHFUL, DURATION (seconds of input), ROUNDS,
+# WARMUP (percent of cue samples ignored), MAX_LIVE_GROWTH (allocations),
+# MAX_RSS_GROWTH (bytes).
+
+set -e
+
+SPEECHFUL=${SPEECHFUL:-./speechful}
+DURATION=${DURATION:-3600}
+ROUNDS=${ROUNDS:-5}
+WARMUP=${WARMUP:-10}
+MAX_LIVE_GROWTH=${MAX_LIVE_GROWTH:-64}
+MAX_RSS_GROWTH=${MAX_RSS_GROWTH:-$((8 * 1024 * 1024))}
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+"$SPEECHFUL" generate --duration="$DURATION" --pattern=dense \
+             --sub="$WORKDIR/soak.srt" "$WORKDIR/soak.m4a" >/dev/null
+
+prev_leaked=
+status=0
+
+for ((round = 1; round <= ROUNDS; ++round)); do
+	"$SPEECHFUL" --sub="$WORKDIR/soak.srt" --out="$WORKDIR/out.mp3" \
+	             --alloc-stats="$WORKDIR/alloc.json" "$WORKDIR/soak.m4a" 2>/dev/null
+
+	# Samples are printed one per line as [cue, live_count, live_bytes, rss_bytes].
+	read -r live_growth rss_growth < <(awk -v warmup="$WARMUP" '
+		/^ *\[[0-9]/ {
+			gsub(/[][ ]/, "")
+			split($0, f, ",")
+			live[n] = f[2]; rss[n] = f[4]; ++n
+		}
+		END {
+			first = int(n * warmup / 100)
+			if (n == 0) { print 0, 0; exit }
+			print live[n - 1] - live[first], rss[n - 1] - rss[first]
+		}' "$WORKDIR/alloc.json")
+
+	leaked=$(awk -F'[:,]' '/"live_count"/ { print $2 + 0 }' "$WORKDIR/alloc.json")
+
+	echo "round $round: live allocations grew by $live_growth, RSS grew by $rss_growth bytes, $leaked leaked at exit"
+
+	if ((live_growth > MAX_LIVE_GROWTH)); then
+		echo "FAIL: live allocation count grows while processing cues" >&2
+		status=1
+	fi
+
+	if ((rss_growth > MAX_RSS_GROWTH)); then
+		echo "FAIL: RSS grows while processing cues" >&2
+		status=1
+	fi
+
+	if [[ -n $prev_leaked ]] && ((leaked > prev_leaked)); then
+		echo "FAIL: round $round leaked more than round $((round - 1))" >&2
+		status=1
+	fi
+
+	prev_leaked=$leaked
+done
+
+exit $status
@@ -1,6 +1,21 @@
 #!/bin/bash
-
-GCCFLAGS="-Wall -Wextra -pedantic -std=c99 -g"
+#
+# ./build.sh         builds speechful, libspeechful.a and libspeechful.so
+# ./build.sh bench   also builds speechful-bench, see bench/bench.c
+GCCFLAGS="-Wall -Wextra -pedantic -std=c99 -g -O2 -pthread"
 FFMPEG="-I$HOME/opt/include -L$HOME/opt/lib -lavformat -lavcodec -lswresample -lavutil"
+LIB_SOURCES="alloc.c analysis.c downmix.c io.c loudness.c mel.c peaks.c pipeline.c polyphase.c pool.c raw.c segment.c speechful.c stats.c trace.c trim.c"
+SOURCES="daemon.c gen.c $LIB_SOURCES"
+gcc $GCCFLAGS -o speechful main.c $SOURCES $FFMPEG -lm || exit 1
+
+# The library leaves the host's allocator alone, see alloc.c.
+mkdir -p _lib || exit 1
+for src in $LIB_SOURCES; do
+	gcc $GCCFLAGS -fPIC -DSPEECHFUL_LIBRARY -I$HOME/opt/include -c -o _lib/${src%.c}.o $src || exit 1
+done
+ar rcs libspeechful.a _lib/*.o || exit 1
+gcc -shared -pthread -o libspeechful.so _lib/*.o $FFMPEG -lm || exit 1
 
-gcc $GCCFLAGS -o speechful main.c $FFMPEG
+if [ "$1" = "bench" ]; then
+	gcc $GCCFLAGS -I. -o speechful-bench bench/bench.c $SOURCES $FFMPEG -lm || exit 1
+fi
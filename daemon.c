@@ -0,0 +1,628 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <libavutil/avutil.h>
+
+#include "daemon.h"
+#include "speechful.h"
+
+#define DEFAULT_QUEUE 64
+
+/* How long to wait before accepting again when out of descriptors or memory. */
+#define ACCEPT_BACKOFF_MS 100
+
+/* How often finished readers are joined while no connection comes in. */
+#define REAP_INTERVAL_MS 1000
+
+struct serve_options {
+	const char *socket_filepath;
+	int         nr_workers;
+	int         max_queued;
+};
+
+/* Shared by the reader of a connection and its jobs, the last one closes it. */
+struct client {
+	int             fd;
+	pthread_mutex_t lock;
+	int             refs;
+};
+
+struct request {
+	struct client          *client;
+	unsigned                id;
+	char                   *line; /* The strings of `config` point into it. */
+	struct speechful_config config;
+	struct request         *next;
+};
+
+/* A connection's reader thread, kept so it can be stopped and joined. */
+struct reader {
+	struct server *server;
+	struct client *client;
+	pthread_t      thread;
+	bool           done;
+	struct reader *next;
+};
+
+struct server {
+	struct speechful *sf;
+	pthread_mutex_t   lock;
+	pthread_cond_t    not_empty;
+	pthread_cond_t    not_full;
+	struct request   *head;
+	struct request   *tail;
+	int               nr_queued;
+	int               max_queued;
+	bool              closing;
+	unsigned          next_id;
+	struct reader    *readers;
+};
+
+static volatile sig_atomic_t stop_requested;
+
+static void request_stop(int sig)
+{
+	(void)sig;
+	stop_requested = 1;
+}
+
+static int parse_options(struct serve_options *opts, int argc, const char *const *argv)
+{
+	int i;
+
+	memset(opts, 0, sizeof(struct serve_options));
+	opts->nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	opts->max_queued = DEFAULT_QUEUE;
+
+	if (opts->nr_workers < 1)
+		opts->nr_workers = 1;
+
+	for (i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		int ok = 1;
+
+		if (strncmp(arg, "--socket=", 9) == 0) {
+			opts->socket_filepath = arg + 9;
+		} else if (strncmp(arg, "--workers=", 10) == 0) {
+			ok = sscanf(arg, "--workers=%d", &opts->nr_workers) == 1 && opts->nr_workers > 0;
+		} else if (strncmp(arg, "--queue=", 8) == 0) {
+			ok = sscanf(arg, "--queue=%d", &opts->max_queued) == 1 && opts->max_queued > 0;
+		} else {
+			ok = 0;
+		}
+
+		if (!ok) {
+			av_log(NULL, AV_LOG_ERROR, "Invalid argument: %s\n", arg);
+			return AVERROR(EINVAL);
+		}
+	}
+
+	if (!opts->socket_filepath) {
+		av_log(NULL, AV_LOG_ERROR, "usage: %s --socket=<path> [--workers=<n>] [--queue=<n>]\n",
+		       argv[0]);
+		return AVERROR(EINVAL);
+	}
+
+	return 0;
+}
+
+static void reply(struct client *client, const char *fmt, ...)
+{
+	va_list va;
+
+	pthread_mutex_lock(&client->lock);
+	va_start(va, fmt);
+	/* A client that went away only loses its replies. */
+	vdprintf(client->fd, fmt, va);
+	va_end(va);
+	pthread_mutex_unlock(&client->lock);
+}
+
+static void client_get(struct client *client)
+{
+	pthread_mutex_lock(&client->lock);
+	client->refs++;
+	pthread_mutex_unlock(&client->lock);
+}
+
+static void client_put(struct client *client)
+{
+	int refs;
+
+	pthread_mutex_lock(&client->lock);
+	refs = --client->refs;
+	pthread_mutex_unlock(&client->lock);
+
+	if (refs)
+		return;
+
+	close(client->fd);
+	pthread_mutex_destroy(&client->lock);
+	av_free(client);
+}
+
+static void request_free(struct request *req)
+{
+	av_free(req->line);
+	av_free(req);
+}
+
+/* Fills `config` from the tab-separated key=value fields of `line`, in place. */
+static int parse_request(struct speechful_config *config, char *line, const char **why)
+{
+	char *field, *save = NULL;
+
+	speechful_config_init(config);
+
+	for (field = strtok_r(line, "\t", &save); field; field = strtok_r(NULL, "\t", &save)) {
+		char *value = strchr(field, '=');
+		long long n = 0;
+		bool number;
+
+		if (!value) {
+			*why = "fields are key=value";
+			return AVERROR(EINVAL);
+		}
+
+		*value++ = '\0';
+		number = sscanf(value, "%lld", &n) == 1 && n >= 0;
+
+		if (strcmp(field, "input") == 0) {
+			config->input = value;
+		} else if (strcmp(field, "sub") == 0) {
+			config->subtitles = value;
+		} else if (strcmp(field, "out") == 0) {
+			config->output = value;
+		} else if (strcmp(field, "sample-rate") == 0 && number && n > 0) {
+			config->sample_rate = n;
+		} else if (strcmp(field, "channels") == 0 && number && n > 0) {
+			config->channels = n;
+		} else if (strcmp(field, "bit-rate") == 0 && number && n > 0) {
+			config->bit_rate = n;
+		} else if (strcmp(field, "padding-left-ms") == 0 && number) {
+			config->padding_left_ms = n;
+		} else if (strcmp(field, "padding-right-ms") == 0 && number) {
+			config->padding_right_ms = n;
+		} else if (strcmp(field, "fast-probe") == 0 && number) {
+			config->fast_probe = n != 0;
+		} else if (strcmp(field, "refine-ms") == 0 && number) {
+			config->refine_ms = n;
+		} else if (strcmp(field, "vad") == 0 && number) {
+			config->vad.enabled = n != 0;
+		} else if (strcmp(field, "trim-silence") == 0 && number) {
+			config->trim.enabled = n != 0;
+		} else if (strcmp(field, "loudnorm") == 0 && number) {
+			config->loudness.enabled = n != 0;
+		} else if (strcmp(field, "segment") == 0 && number) {
+			config->segment.enabled = n != 0;
+		} else if (strcmp(field, "segment-max-ms") == 0 && number && n > 0) {
+			config->segment.max_ms = n;
+		} else if (strcmp(field, "segment-target-ms") == 0 && number) {
+			config->segment.target_ms = n;
+		} else if (strcmp(field, "segment-bucket-ms") == 0 && number && n > 0) {
+			config->segment.bucket_ms = n;
+		} else if (strcmp(field, "manifest") == 0) {
+			config->segment.manifest = value;
+		} else if (strcmp(field, "mel") == 0) {
+			config->mel.dir = value;
+		} else if (strcmp(field, "mel-bins") == 0 && number && n > 0) {
+			config->mel.bins = n;
+		} else if (strcmp(field, "mel-window-ms") == 0 && number && n > 0) {
+			config->mel.window_ms = n;
+		} else if (strcmp(field, "mel-hop-ms") == 0 && number && n > 0) {
+			config->mel.hop_ms = n;
+		} else if (strcmp(field, "raw") == 0) {
+			config->raw.path = value;
+		} else if (strcmp(field, "raw-s16") == 0 && number) {
+			config->raw.sample_fmt = n ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_FLT;
+		} else if (strcmp(field, "peaks") == 0) {
+			config->peaks.path = value;
+		} else if (strcmp(field, "peaks-bucket") == 0 && number && n > 0) {
+			config->peaks.bucket = n;
+		} else if (strcmp(field, "peaks-levels") == 0 && number && n > 0) {
+			config->peaks.levels = n;
+		} else {
+			*why = "unknown field or invalid value";
+			return AVERROR(EINVAL);
+		}
+	}
+
+	if (!config->input
+	    || (!config->output && !config->mel.dir && !config->raw.path && !config->peaks.path)) {
+		*why = "input and one of out, mel, raw or peaks are required";
+		return AVERROR(EINVAL);
+	}
+
+	return 0;
+}
+
+/* Blocks while the queue is full; fails once the server is shutting down. */
+static int enqueue(struct server *server, struct request *req)
+{
+	pthread_mutex_lock(&server->lock);
+
+	while (server->nr_queued == server->max_queued && !server->closing)
+		pthread_cond_wait(&server->not_full, &server->lock);
+
+	if (server->closing) {
+		pthread_mutex_unlock(&server->lock);
+		return AVERROR_EXIT;
+	}
+
+	if (server->tail)
+		server->tail->next = req;
+	else
+		server->head = req;
+	server->tail = req;
+	server->nr_queued++;
+
+	pthread_cond_signal(&server->not_empty);
+	pthread_mutex_unlock(&server->lock);
+
+	return 0;
+}
+
+static struct request *dequeue(struct server *server)
+{
+	struct request *req;
+
+	pthread_mutex_lock(&server->lock);
+
+	/* Queued jobs still run when shutting down, only new ones are refused. */
+	while (!server->head && !server->closing)
+		pthread_cond_wait(&server->not_empty, &server->lock);
+
+	if ((req = server->head)) {
+		if (!(server->head = req->next))
+			server->tail = NULL;
+		server->nr_queued--;
+		pthread_cond_signal(&server->not_full);
+	}
+
+	pthread_mutex_unlock(&server->lock);
+
+	return req;
+}
+
+static void *reader_thread(void *opaque)
+{
+	struct reader *reader = opaque;
+	struct server *server = reader->server;
+	struct client *client = reader->client;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *in;
+	int fd;
+
+	if ((fd = dup(client->fd)) < 0 || !(in = fdopen(fd, "r"))) {
+		if (fd >= 0)
+			close(fd);
+		goto end;
+	}
+
+	while ((len = getline(&line, &size, in)) >= 0) {
+		struct request *req;
+		const char *why = NULL;
+
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+
+		if (!len)
+			continue;
+
+		if (!(req = av_mallocz(sizeof(struct request))) || !(req->line = av_strdup(line))) {
+			av_free(req);
+			reply(client, "error - out of memory\n");
+			continue;
+		}
+
+		if (parse_request(&req->config, req->line, &why) < 0) {
+			reply(client, "error - %s\n", why);
+			request_free(req);
+			continue;
+		}
+
+		pthread_mutex_lock(&server->lock);
+		req->id = ++server->next_id;
+		pthread_mutex_unlock(&server->lock);
+
+		req->client = client;
+		client_get(client);
+
+		reply(client, "accepted %u\n", req->id);
+
+		if (enqueue(server, req) < 0) {
+			reply(client, "error %u server is shutting down\n", req->id);
+			client_put(client);
+			request_free(req);
+			break;
+		}
+	}
+
+	free(line);
+	fclose(in);
+
+end:
+	client_put(client);
+
+	pthread_mutex_lock(&server->lock);
+	reader->done = true;
+	pthread_mutex_unlock(&server->lock);
+
+	return NULL;
+}
+
+/* Joins the readers whose clients hung up, or all of them once they were told to stop. */
+static void reap_readers(struct server *server, bool all)
+{
+	struct reader **link = &server->readers;
+
+	while (*link) {
+		struct reader *reader = *link;
+		bool done;
+
+		pthread_mutex_lock(&server->lock);
+		done = reader->done;
+		pthread_mutex_unlock(&server->lock);
+
+		if (!done && !all) {
+			link = &reader->next;
+			continue;
+		}
+
+		pthread_join(reader->thread, NULL);
+		*link = reader->next;
+		client_put(reader->client);
+		av_free(reader);
+	}
+}
+
+static void report_progress(void *opaque, int done, int nr_cues)
+{
+	struct request *req = opaque;
+
+	reply(req->client, "progress %u %d %d\n", req->id, done, nr_cues);
+}
+
+static void *worker_thread(void *opaque)
+{
+	struct server *server = opaque;
+	struct speechful_pool *pool = NULL;
+	struct request *req;
+
+	/* Jobs of the same shape reuse this worker's contexts; without a pool they open their own. */
+	if (speechful_pool_alloc(&pool) < 0)
+		pool = NULL;
+
+	while ((req = dequeue(server))) {
+		struct speechful_job *job = NULL;
+		int ret;
+
+		req->config.progress        = report_progress;
+		req->config.progress_opaque = req;
+		req->config.pool            = pool;
+
+		if ((ret = speechful_job_open(&job, server->sf, &req->config)) >= 0) {
+			int close_ret;
+
+			ret = speechful_job_run(job);
+			/* Deferred output writes fail here. */
+			close_ret = speechful_job_close(&job);
+			if (ret >= 0)
+				ret = close_ret;
+		}
+
+		if (ret < 0)
+			reply(req->client, "error %u %s\n", req->id, av_err2str(ret));
+		else
+			reply(req->client, "done %u\n", req->id);
+
+		client_put(req->client);
+		request_free(req);
+
+		/* After the reply, so the client is not kept waiting for the next job's encoder. */
+		if (pool)
+			speechful_pool_refill(pool);
+	}
+
+	speechful_pool_free(&pool);
+
+	return NULL;
+}
+
+/*
+ * Starts a thread with SIGINT and SIGTERM blocked, so they are only ever
+ * delivered to the main thread and interrupt its accept().
+ */
+static int start_thread(pthread_t *thread, void *(*fn)(void *), void *opaque)
+{
+	sigset_t block, old;
+	int ret;
+
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	ret = pthread_create(thread, NULL, fn, opaque);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return ret;
+}
+
+static int listen_on(const char *filepath)
+{
+	struct sockaddr_un addr = {0};
+	int fd;
+
+	if (strlen(filepath) >= sizeof(addr.sun_path))
+		return AVERROR(ENAMETOOLONG);
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, filepath);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return AVERROR(errno);
+
+	/* A socket left behind by a previous server would fail the bind. */
+	unlink(filepath);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+		int ret = AVERROR(errno);
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+int serve_main(int argc, const char *const *argv)
+{
+	struct serve_options opts;
+	struct server server = {0};
+	struct sigaction sa = {0};
+	struct reader *reader;
+	pthread_t *workers;
+	int i, nr_started = 0;
+	int listen_fd, ret;
+
+	if (parse_options(&opts, argc, argv) < 0)
+		return 1;
+
+	if (!(workers = av_malloc_array(opts.nr_workers, sizeof(pthread_t)))) {
+		av_log(NULL, AV_LOG_ERROR, "Out of memory.\n");
+		return 1;
+	}
+
+	if ((ret = speechful_alloc(&server.sf)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "Failed to initialize: %s\n", av_err2str(ret));
+		av_free(workers);
+		return 1;
+	}
+
+	server.max_queued = opts.max_queued;
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.not_empty, NULL);
+	pthread_cond_init(&server.not_full, NULL);
+
+	/* accept() must return on a signal rather than be restarted, like poll() does. */
+	sa.sa_handler = request_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((listen_fd = listen_on(opts.socket_filepath)) < 0) {
+		ret = listen_fd;
+		av_log(NULL, AV_LOG_ERROR, "%s: failed to listen: %s\n", opts.socket_filepath, av_err2str(ret));
+		goto end;
+	}
+
+	for (; nr_started < opts.nr_workers; ++nr_started) {
+		if ((ret = start_thread(&workers[nr_started], worker_thread, &server)) != 0) {
+			ret = AVERROR(ret);
+			av_log(NULL, AV_LOG_ERROR, "Failed to start worker: %s\n", av_err2str(ret));
+			goto end;
+		}
+	}
+
+	av_log(NULL, AV_LOG_INFO, "Listening on %s with %d worker(s), up to %d queued job(s).\n",
+	       opts.socket_filepath, opts.nr_workers, opts.max_queued);
+
+	while (!stop_requested) {
+		struct pollfd pfd = {.fd = listen_fd, .events = POLLIN};
+		struct client *client;
+		int fd;
+
+		/* Readers of clients that hung up are joined even while nobody connects. */
+		if (poll(&pfd, 1, REAP_INTERVAL_MS) <= 0) {
+			reap_readers(&server, false);
+			continue;
+		}
+
+		if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+			int err = errno;
+
+			if (err != EINTR && err != ECONNABORTED)
+				av_log(NULL, AV_LOG_WARNING, "accept: %s\n", av_err2str(AVERROR(err)));
+
+			/*
+			 * These last until a connection closes or memory is freed, and
+			 * the pending connection stays queued meanwhile, so accepting
+			 * again at once would only spin. A signal cuts the wait short.
+			 */
+			if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) {
+				reap_readers(&server, false);
+				poll(NULL, 0, ACCEPT_BACKOFF_MS);
+			}
+			continue;
+		}
+
+		reap_readers(&server, false);
+
+		if (!(client = av_mallocz(sizeof(struct client)))
+		    || !(reader = av_mallocz(sizeof(struct reader)))) {
+			av_free(client);
+			close(fd);
+			continue;
+		}
+
+		/* One reference for the reader, one for the server to shut the fd down at exit. */
+		client->fd   = fd;
+		client->refs = 2;
+		pthread_mutex_init(&client->lock, NULL);
+
+		reader->server = &server;
+		reader->client = client;
+
+		if (start_thread(&reader->thread, reader_thread, reader) != 0) {
+			av_free(reader);
+			client_put(client);
+			client_put(client);
+			continue;
+		}
+
+		reader->next   = server.readers;
+		server.readers = reader;
+	}
+
+	ret = 0;
+
+end:
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(opts.socket_filepath);
+	}
+
+	pthread_mutex_lock(&server.lock);
+	server.closing = true;
+	pthread_cond_broadcast(&server.not_empty);
+	pthread_cond_broadcast(&server.not_full);
+	pthread_mutex_unlock(&server.lock);
+
+	/* Readers blocked on their clients see the end of input; replies still go out. */
+	for (reader = server.readers; reader; reader = reader->next)
+		shutdown(reader->client->fd, SHUT_RD);
+	reap_readers(&server, true);
+
+	for (i = 0; i < nr_started; ++i)
+		pthread_join(workers[i], NULL);
+
+	speechful_free(&server.sf);
+	av_free(workers);
+
+	return ret < 0;
+}
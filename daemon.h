@@ -0,0 +1,35 @@
+#ifndef SPEECHFUL_DAEMON_H
+#define SPEECHFUL_DAEMON_H
+
+/*
+ * `speechful serve --socket=<path> [--workers=<n>] [--queue=<n>]`: runs jobs
+ * sent over a Unix domain socket on a pool of worker threads, so the process
+ * startup is paid once. `argv[0]` is the subcommand name. Returns the
+ * process exit status.
+ *
+ * A client writes one job per line as tab-separated key=value fields:
+ *
+ *     input=<path>  out=<path>  [sub=<path>]  [sample-rate=<hz>]
+ *     [channels=<n>]  [bit-rate=<bps>]  [padding-left-ms=<ms>]
+ *     [padding-right-ms=<ms>]  [refine-ms=<ms>]  [fast-probe=1]  [vad=1]
+ *     [trim-silence=1]  [loudnorm=1]  [segment=1]  [segment-max-ms=<ms>]
+ *     [segment-target-ms=<ms>]  [segment-bucket-ms=<ms>]  [manifest=<path>]
+ *     [mel=<dir>]  [mel-bins=<n>]  [mel-window-ms=<ms>]  [mel-hop-ms=<ms>]
+ *     [raw=<path>]  [raw-s16=1]  [peaks=<path>]  [peaks-bucket=<n>]
+ *     [peaks-levels=<n>]
+ *
+ * `out` may be left out when `mel`, `raw` or `peaks` is given.
+ *
+ * and reads one line per event back:
+ *
+ *     accepted <id>
+ *     progress <id> <cues done> <cues>
+ *     done <id>
+ *     error <id> <message>        (the id is "-" for a malformed line)
+ *
+ * Jobs wait in a bounded queue. While it is full the server stops reading
+ * from that client, which is the backpressure.
+ */
+int serve_main(int argc, const char *const *argv);
+
+#endif
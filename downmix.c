@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <math.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+
+#include "downmix.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define MAX_IN_CHANNELS  8
+#define MAX_OUT_CHANNELS 2
+
+/* swr's default centre and surround mix levels, -3 dB. */
+#define SQRT1_2 0.70710678118654752440
+
+/* The inputs one output channel is made of, those it ignores left out. */
+struct mix_row {
+	int   nr_taps;
+	int   channel[MAX_IN_CHANNELS];
+	float coeff[MAX_IN_CHANNELS];
+};
+
+typedef void (*mix_flt_fn)(const struct mix_row *row, const float *const *src, float *dst, int n);
+typedef void (*mix_s16_fn)(const struct mix_row *row, const float *const *src, int16_t *dst, int n);
+
+struct downmix {
+	int            out_channels;
+	bool           to_s16;
+	struct mix_row rows[MAX_OUT_CHANNELS];
+	mix_flt_fn     mix_flt;
+	mix_s16_fn     mix_s16;
+};
+
+/*
+ * Every kernel sums the products in tap order without fusing them, so they
+ * all give the same samples and the scalar code can finish what a vector
+ * loop leaves over. Conversion to s16 rounds to nearest like swr's lrintf().
+ */
+static inline float mix_one(const struct mix_row *row, const float *const *src, int i)
+{
+	float y = 0;
+	int t;
+
+	for (t = 0; t < row->nr_taps; ++t)
+		y += row->coeff[t] * src[row->channel[t]][i];
+
+	return y;
+}
+
+static inline int16_t flt2s16(float y)
+{
+	y *= 32768.0f;
+	y = y < -32768.0f ? -32768.0f : y > 32767.0f ? 32767.0f : y;
+
+	return (int16_t)lrintf(y);
+}
+
+static void mix_flt_c(const struct mix_row *row, const float *const *src, float *dst, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		dst[i] = mix_one(row, src, i);
+}
+
+static void mix_s16_c(const struct mix_row *row, const float *const *src, int16_t *dst, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		dst[i] = flt2s16(mix_one(row, src, i));
+}
+
+#ifdef HAVE_X86
+/* SSE2 is part of x86-64, it needs no check. */
+static inline __m128 mix4_sse2(const struct mix_row *row, const float *const *src, int i)
+{
+	__m128 acc = _mm_setzero_ps();
+	int t;
+
+	for (t = 0; t < row->nr_taps; ++t)
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(row->coeff[t]),
+		                                 _mm_loadu_ps(src[row->channel[t]] + i)));
+
+	return acc;
+}
+
+static inline __m128i s32_sse2(__m128 y)
+{
+	y = _mm_mul_ps(y, _mm_set1_ps(32768.0f));
+	y = _mm_min_ps(_mm_max_ps(y, _mm_set1_ps(-32768.0f)), _mm_set1_ps(32767.0f));
+
+	return _mm_cvtps_epi32(y);
+}
+
+static void mix_flt_sse2(const struct mix_row *row, const float *const *src, float *dst, int n)
+{
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm_storeu_ps(dst + i, mix4_sse2(row, src, i));
+
+	for (; i < n; ++i)
+		dst[i] = mix_one(row, src, i);
+}
+
+static void mix_s16_sse2(const struct mix_row *row, const float *const *src, int16_t *dst, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i lo = s32_sse2(mix4_sse2(row, src, i));
+		__m128i hi = s32_sse2(mix4_sse2(row, src, i + 4));
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+	}
+
+	for (; i < n; ++i)
+		dst[i] = flt2s16(mix_one(row, src, i));
+}
+
+__attribute__((target("avx2")))
+static inline __m256 mix8_avx2(const struct mix_row *row, const float *const *src, int i)
+{
+	__m256 acc = _mm256_setzero_ps();
+	int t;
+
+	for (t = 0; t < row->nr_taps; ++t)
+		acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(row->coeff[t]),
+		                                       _mm256_loadu_ps(src[row->channel[t]] + i)));
+
+	return acc;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i s32_avx2(__m256 y)
+{
+	y = _mm256_mul_ps(y, _mm256_set1_ps(32768.0f));
+	y = _mm256_min_ps(_mm256_max_ps(y, _mm256_set1_ps(-32768.0f)), _mm256_set1_ps(32767.0f));
+
+	return _mm256_cvtps_epi32(y);
+}
+
+__attribute__((target("avx2")))
+static void mix_flt_avx2(const struct mix_row *row, const float *const *src, float *dst, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(dst + i, mix8_avx2(row, src, i));
+
+	for (; i < n; ++i)
+		dst[i] = mix_one(row, src, i);
+}
+
+/* Packing works within 128-bit lanes, the permute puts the halves back in order. */
+__attribute__((target("avx2")))
+static void mix_s16_avx2(const struct mix_row *row, const float *const *src, int16_t *dst, int n)
+{
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i lo = s32_avx2(mix8_avx2(row, src, i));
+		__m256i hi = s32_avx2(mix8_avx2(row, src, i + 8));
+
+		_mm256_storeu_si256((__m256i *)(dst + i),
+		                    _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8));
+	}
+
+	for (; i < n; ++i)
+		dst[i] = flt2s16(mix_one(row, src, i));
+}
+#endif
+
+#ifdef HAVE_NEON
+static inline float32x4_t mix4_neon(const struct mix_row *row, const float *const *src, int i)
+{
+	float32x4_t acc = vdupq_n_f32(0);
+	int t;
+
+	for (t = 0; t < row->nr_taps; ++t)
+		acc = vaddq_f32(acc, vmulq_n_f32(vld1q_f32(src[row->channel[t]] + i), row->coeff[t]));
+
+	return acc;
+}
+
+static inline int16x4_t s16_neon(float32x4_t y)
+{
+	y = vmulq_n_f32(y, 32768.0f);
+	y = vminq_f32(vmaxq_f32(y, vdupq_n_f32(-32768.0f)), vdupq_n_f32(32767.0f));
+
+	return vqmovn_s32(vcvtnq_s32_f32(y));
+}
+
+static void mix_flt_neon(const struct mix_row *row, const float *const *src, float *dst, int n)
+{
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		vst1q_f32(dst + i, mix4_neon(row, src, i));
+
+	for (; i < n; ++i)
+		dst[i] = mix_one(row, src, i);
+}
+
+static void mix_s16_neon(const struct mix_row *row, const float *const *src, int16_t *dst, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		vst1q_s16(dst + i, vcombine_s16(s16_neon(mix4_neon(row, src, i)),
+		                                s16_neon(mix4_neon(row, src, i + 4))));
+
+	for (; i < n; ++i)
+		dst[i] = flt2s16(mix_one(row, src, i));
+}
+#endif
+
+/* Picked once, from what the machine running us supports. */
+static void pick_kernels(struct downmix *d)
+{
+	d->mix_flt = mix_flt_c;
+	d->mix_s16 = mix_s16_c;
+
+#if defined(HAVE_X86)
+	d->mix_flt = mix_flt_sse2;
+	d->mix_s16 = mix_s16_sse2;
+
+	if (__builtin_cpu_supports("avx2")) {
+		d->mix_flt = mix_flt_avx2;
+		d->mix_s16 = mix_s16_avx2;
+	}
+#elif defined(HAVE_NEON)
+	d->mix_flt = mix_flt_neon;
+	d->mix_s16 = mix_s16_neon;
+#endif
+}
+
+int downmix_open(struct downmix **dm, const struct AVChannelLayout *in_layout,
+                 enum AVSampleFormat in_fmt, int in_rate,
+                 int out_channels, enum AVSampleFormat out_fmt, int out_rate)
+{
+	enum AVSampleFormat packed = av_get_packed_sample_fmt(out_fmt);
+	double matrix[MAX_OUT_CHANNELS][MAX_IN_CHANNELS] = {{0}};
+	struct AVChannelLayout out_layout;
+	struct downmix *d;
+	int ret, o, i;
+
+	*dm = NULL;
+
+	/* One channel is the same in either layout. */
+	if (in_fmt != AV_SAMPLE_FMT_FLTP || in_rate != out_rate
+	    || in_layout->order != AV_CHANNEL_ORDER_NATIVE
+	    || in_layout->nb_channels < 1 || in_layout->nb_channels > MAX_IN_CHANNELS
+	    || out_channels < 1 || out_channels > MAX_OUT_CHANNELS
+	    || (packed != AV_SAMPLE_FMT_FLT && packed != AV_SAMPLE_FMT_S16)
+	    || (out_channels > 1 && !av_sample_fmt_is_planar(out_fmt)))
+		return AVERROR(ENOSYS);
+
+	av_channel_layout_default(&out_layout, out_channels);
+
+	/*
+	 * The matrix swr would build for itself, so the output does not depend
+	 * on which of us made it: its default mix levels, and coefficients
+	 * normalised to keep integer output from clipping.
+	 */
+	if ((ret = swr_build_matrix2(in_layout, &out_layout, SQRT1_2, SQRT1_2, 0,
+	                             packed == AV_SAMPLE_FMT_S16 ? 1.0 : INT_MAX, 1.0,
+	                             matrix[0], MAX_IN_CHANNELS, AV_MATRIX_ENCODING_NONE, NULL)) < 0)
+		return ret;
+
+	if (!(d = *dm = av_mallocz(sizeof(struct downmix))))
+		return AVERROR(ENOMEM);
+
+	d->out_channels = out_channels;
+	d->to_s16       = packed == AV_SAMPLE_FMT_S16;
+
+	for (o = 0; o < out_channels; ++o) {
+		struct mix_row *row = &d->rows[o];
+
+		for (i = 0; i < in_layout->nb_channels; ++i) {
+			if (matrix[o][i] == 0)
+				continue;
+
+			row->channel[row->nr_taps] = i;
+			row->coeff[row->nr_taps++] = matrix[o][i];
+		}
+	}
+
+	pick_kernels(d);
+
+	return 0;
+}
+
+void downmix_free(struct downmix **dm)
+{
+	av_freep(dm);
+}
+
+void downmix_run(const struct downmix *d, u8 *const *dst, const u8 *const *src, int samples)
+{
+	int o;
+
+	for (o = 0; o < d->out_channels; ++o) {
+		if (d->to_s16)
+			d->mix_s16(&d->rows[o], (const float *const *)src, (int16_t *)dst[o], samples);
+		else
+			d->mix_flt(&d->rows[o], (const float *const *)src, (float *)dst[o], samples);
+	}
+}
@@ -0,0 +1,23 @@
+#ifndef SPEECHFUL_DOWNMIX_H
+#define SPEECHFUL_DOWNMIX_H
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+
+#include "pipeline.h"
+
+/*
+ * Mixes planar float down to one or two channels of float or s16 in a single
+ * pass, where swr would mix and convert in two. Only takes conversions at an
+ * unchanged rate; anything else is AVERROR(ENOSYS), left to swr.
+ */
+struct downmix;
+
+int  downmix_open(struct downmix **dm, const struct AVChannelLayout *in_layout,
+                  enum AVSampleFormat in_fmt, int in_rate,
+                  int out_channels, enum AVSampleFormat out_fmt, int out_rate);
+void downmix_free(struct downmix **dm);
+
+void downmix_run(const struct downmix *dm, u8 *const *dst, const u8 *const *src, int samples);
+
+#endif
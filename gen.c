@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <math.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+
+#include "gen.h"
+
+typedef uint8_t  u8;
+typedef int64_t  i64;
+typedef uint64_t u64;
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+enum cue_pattern {
+	PATTERN_SPARSE,
+	PATTERN_DENSE,
+	PATTERN_OVERLAPPING,
+	PATTERN_OUT_OF_ORDER,
+};
+
+static const char *const pattern_names[] = {
+	[PATTERN_SPARSE]       = "sparse",
+	[PATTERN_DENSE]        = "dense",
+	[PATTERN_OVERLAPPING]  = "overlapping",
+	[PATTERN_OUT_OF_ORDER] = "out-of-order",
+};
+
+struct gen_options {
+	const char      *media_filepath;
+	const char      *sub_filepath;
+	const char      *codec;
+	const char      *format;
+	double           duration;
+	int              sample_rate;
+	int              channels;
+	int              nr_cues;
+	enum cue_pattern pattern;
+	u64              seed;
+};
+
+/* Cue times in milliseconds, as written to the SRT file. */
+struct gen_cue {
+	i64 start;
+	i64 end;
+};
+
+static u64 next_random(u64 *state)
+{
+	/* xorshift64*, plenty for timing jitter and noise. */
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double random_unit(u64 *state)
+{
+	return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int parse_options(struct gen_options *opts, int argc, const char *const *argv)
+{
+	int i;
+
+	memset(opts, 0, sizeof(struct gen_options));
+	opts->codec       = "aac";
+	opts->duration    = 600;
+	opts->sample_rate = 48000;
+	opts->channels    = 2;
+	opts->nr_cues     = -1;
+	opts->pattern     = PATTERN_SPARSE;
+	opts->seed        = 1;
+
+	for (i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		int ok = 1;
+
+		if (arg[0] != '-' || arg[1] != '-') {
+			if (!opts->media_filepath)
+				opts->media_filepath = arg;
+			else
+				ok = 0;
+		} else if (strncmp(arg, "--sub=", 6) == 0) {
+			opts->sub_filepath = arg + 6;
+		} else if (strncmp(arg, "--codec=", 8) == 0) {
+			opts->codec = arg + 8;
+		} else if (strncmp(arg, "--format=", 9) == 0) {
+			opts->format = arg + 9;
+		} else if (strncmp(arg, "--duration=", 11) == 0) {
+			ok = sscanf(arg, "--duration=%lf", &opts->duration) == 1 && opts->duration > 0;
+		} else if (strncmp(arg, "--sample-rate=", 14) == 0) {
+			ok = sscanf(arg, "--sample-rate=%d", &opts->sample_rate) == 1 && opts->sample_rate > 0;
+		} else if (strncmp(arg, "--channels=", 11) == 0) {
+			ok = sscanf(arg, "--channels=%d", &opts->channels) == 1 && opts->channels > 0;
+		} else if (strncmp(arg, "--cues=", 7) == 0) {
+			ok = sscanf(arg, "--cues=%d", &opts->nr_cues) == 1 && opts->nr_cues >= 0;
+		} else if (strncmp(arg, "--seed=", 7) == 0) {
+			unsigned long long seed;
+			ok = sscanf(arg, "--seed=%llu", &seed) == 1;
+			opts->seed = seed ? seed : 1;
+		} else if (strncmp(arg, "--pattern=", 10) == 0) {
+			int p;
+			for (p = 0; p < (int)(sizeof(pattern_names) / sizeof(*pattern_names)); ++p)
+				if (strcmp(arg + 10, pattern_names[p]) == 0)
+					break;
+			ok = p < (int)(sizeof(pattern_names) / sizeof(*pattern_names));
+			opts->pattern = p;
+		} else {
+			ok = 0;
+		}
+
+		if (!ok) {
+			av_log(NULL, AV_LOG_ERROR, "Invalid argument: %s\n", arg);
+			return AVERROR(EINVAL);
+		}
+	}
+
+	if (!opts->media_filepath || !opts->sub_filepath) {
+		av_log(NULL, AV_LOG_ERROR, "usage: %s [--duration=<s>] [--codec=<name>] [--format=<name>] "
+		       "[--sample-rate=<hz>] [--channels=<n>] [--cues=<n>] "
+		       "[--pattern=sparse|dense|overlapping|out-of-order] [--seed=<n>] "
+		       "--sub=<out.srt> <out media>\n", argv[0]);
+		return AVERROR(EINVAL);
+	}
+
+	/* Roughly one cue every 4 seconds, like typical dialogue. */
+	if (opts->nr_cues < 0)
+		opts->nr_cues = opts->duration / 4;
+
+	return 0;
+}
+
+/*
+ * Lays the cues out over equal slots of the input. Sparse cues take a short
+ * part of their slot at a random offset, dense ones fill it but for a short
+ * gap, overlapping ones spill into the next slot; out-of-order is dense with
+ * the cues shuffled afterwards.
+ */
+static void layout_cues(struct gen_cue *cues, const struct gen_options *opts, u64 *rng)
+{
+	i64 total = opts->duration * 1000;
+	i64 slot  = opts->nr_cues ? total / opts->nr_cues : total;
+	int i;
+
+	for (i = 0; i < opts->nr_cues; ++i) {
+		i64 slot_start = i * slot;
+		i64 length, offset;
+
+		switch (opts->pattern) {
+		case PATTERN_SPARSE:
+			length = slot * (0.2 + 0.2 * random_unit(rng));
+			offset = (slot - length) * random_unit(rng);
+			break;
+		default:
+		case PATTERN_DENSE:
+		case PATTERN_OUT_OF_ORDER:
+			length = slot - FFMIN(slot / 10, 100);
+			offset = 0;
+			break;
+		case PATTERN_OVERLAPPING:
+			length = slot * (1.3 + 0.4 * random_unit(rng));
+			offset = 0;
+			break;
+		}
+
+		cues[i].start = slot_start + offset;
+		cues[i].end   = FFMIN(cues[i].start + FFMAX(length, 1), total);
+	}
+
+	if (opts->pattern == PATTERN_OUT_OF_ORDER) {
+		for (i = opts->nr_cues - 1; i > 0; --i) {
+			int j = next_random(rng) % (i + 1);
+			struct gen_cue tmp = cues[i];
+			cues[i] = cues[j];
+			cues[j] = tmp;
+		}
+	}
+}
+
+static void write_srt_time(FILE *out, i64 ms)
+{
+	fprintf(out, "%02d:%02d:%02d,%03d",
+	        (int)(ms / 3600000), (int)(ms / 60000 % 60), (int)(ms / 1000 % 60), (int)(ms % 1000));
+}
+
+static int write_srt(const char *filepath, const struct gen_cue *cues, int nr_cues)
+{
+	FILE *out;
+	int i;
+
+	if (!(out = fopen(filepath, "w")))
+		return AVERROR(errno);
+
+	for (i = 0; i < nr_cues; ++i) {
+		fprintf(out, "%d\n", i + 1);
+		write_srt_time(out, cues[i].start);
+		fputs(" --> ", out);
+		write_srt_time(out, cues[i].end);
+		fprintf(out, "\nSynthetic cue %d.\n\n", i + 1);
+	}
+
+	if (fclose(out) == EOF)
+		return AVERROR(errno);
+
+	return 0;
+}
+
+static int compare_cues(const void *a, const void *b)
+{
+	const struct gen_cue *x = a, *y = b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+/*
+ * Fills `frame` starting at sample `at`: an amplitude-modulated pair of tones
+ * inside cues, faint noise outside, so energy-based tooling has something
+ * realistic to find. `cues` must be sorted; `cursor` tracks the current cue.
+ */
+static void synthesize(struct AVFrame *frame, i64 at, int sample_rate,
+                       const struct gen_cue *cues, int nr_cues, int *cursor, u64 *rng)
+{
+	enum AVSampleFormat fmt = frame->format;
+	int channels = frame->ch_layout.nb_channels;
+	bool planar = av_sample_fmt_is_planar(fmt);
+	int i, c;
+
+	for (i = 0; i < frame->nb_samples; ++i) {
+		i64 ms = (at + i) * 1000 / sample_rate;
+		double t = (double)(at + i) / sample_rate, v;
+		bool speech = false;
+		int k;
+
+		while (*cursor < nr_cues && cues[*cursor].end <= ms)
+			++*cursor;
+		for (k = *cursor; k < nr_cues && cues[k].start <= ms; ++k) {
+			if (cues[k].end > ms) {
+				speech = true;
+				break;
+			}
+		}
+
+		if (speech) {
+			double envelope = 0.5 + 0.5 * sin(2 * M_PI * 4 * t);
+			v = 0.3 * envelope * (sin(2 * M_PI * 220 * t) + 0.5 * sin(2 * M_PI * 660 * t));
+		} else {
+			v = 0.003 * (2 * random_unit(rng) - 1);
+		}
+
+		for (c = 0; c < channels; ++c) {
+			int idx = planar ? i : i * channels + c;
+			u8 *plane = frame->extended_data[planar ? c : 0];
+
+			switch (av_get_packed_sample_fmt(fmt)) {
+			case AV_SAMPLE_FMT_U8:  ((u8      *)plane)[idx] = 128 + v * 127;        break;
+			case AV_SAMPLE_FMT_S16: ((int16_t *)plane)[idx] = v * 32767;            break;
+			case AV_SAMPLE_FMT_S32: ((int32_t *)plane)[idx] = v * 2147483647.0;     break;
+			case AV_SAMPLE_FMT_FLT: ((float   *)plane)[idx] = v;                    break;
+			case AV_SAMPLE_FMT_DBL: ((double  *)plane)[idx] = v;                    break;
+			default:                                                                break;
+			}
+		}
+	}
+}
+
+static int encode_and_write(struct AVFormatContext *fmt, struct AVCodecContext *enc,
+                            const struct AVFrame *frame, struct AVPacket *pkt)
+{
+	int ret;
+
+	if ((ret = avcodec_send_frame(enc, frame)) < 0)
+		return ret;
+
+	while ((ret = avcodec_receive_packet(enc, pkt)) == 0) {
+		av_packet_rescale_ts(pkt, enc->time_base, fmt->streams[0]->time_base);
+		ret = av_interleaved_write_frame(fmt, pkt);
+		av_packet_unref(pkt);
+		if (ret < 0)
+			return ret;
+	}
+
+	return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static int write_media(const struct gen_options *opts, struct gen_cue *cues, u64 *rng)
+{
+	const struct AVCodec *codec;
+	struct AVFormatContext *fmt = NULL;
+	struct AVCodecContext *enc = NULL;
+	struct AVStream *st;
+	struct AVPacket *pkt = NULL;
+	struct AVFrame *frame = NULL;
+	i64 total = opts->duration * opts->sample_rate, at;
+	int cursor = 0, samples;
+	int ret;
+
+	if (!(codec = avcodec_find_encoder_by_name(opts->codec))) {
+		av_log(NULL, AV_LOG_ERROR, "%s: unknown encoder.\n", opts->codec);
+		return AVERROR_ENCODER_NOT_FOUND;
+	}
+
+	if ((ret = avformat_alloc_output_context2(&fmt, NULL, opts->format, opts->media_filepath)) < 0)
+		return ret;
+
+	if (!(enc = avcodec_alloc_context3(codec)) || !(st = avformat_new_stream(fmt, NULL))
+	    || !(pkt = av_packet_alloc()) || !(frame = av_frame_alloc())) {
+		ret = AVERROR(ENOMEM);
+		goto end;
+	}
+
+	av_channel_layout_default(&enc->ch_layout, opts->channels);
+	enc->sample_rate   = opts->sample_rate;
+	enc->sample_fmt    = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+	enc->time_base.num = 1;
+	enc->time_base.den = opts->sample_rate;
+
+	if (fmt->oformat->flags & AVFMT_GLOBALHEADER)
+		enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	if ((ret = avcodec_open2(enc, codec, NULL)) < 0)
+		goto end;
+
+	if ((ret = avcodec_parameters_from_context(st->codecpar, enc)) < 0)
+		goto end;
+	st->time_base = enc->time_base;
+
+	if (!(fmt->oformat->flags & AVFMT_NOFILE)
+	    && (ret = avio_open(&fmt->pb, opts->media_filepath, AVIO_FLAG_WRITE)) < 0)
+		goto end;
+
+	if ((ret = avformat_write_header(fmt, NULL)) < 0)
+		goto end;
+
+	qsort(cues, opts->nr_cues, sizeof(struct gen_cue), compare_cues);
+
+	for (at = 0; at < total; at += samples) {
+		/* Fixed frame size encoders still take a shorter last frame. */
+		samples = FFMIN(enc->frame_size ? enc->frame_size : 1024, total - at);
+
+		if ((ret = av_channel_layout_copy(&frame->ch_layout, &enc->ch_layout)) < 0)
+			goto end;
+		frame->format      = enc->sample_fmt;
+		frame->sample_rate = enc->sample_rate;
+		frame->nb_samples  = samples;
+		frame->pts         = at;
+
+		if ((ret = av_frame_get_buffer(frame, 0)) < 0)
+			goto end;
+
+		synthesize(frame, at, opts->sample_rate, cues, opts->nr_cues, &cursor, rng);
+
+		ret = encode_and_write(fmt, enc, frame, pkt);
+		av_frame_unref(frame);
+		if (ret < 0)
+			goto end;
+	}
+
+	if ((ret = encode_and_write(fmt, enc, NULL, pkt)) < 0)
+		goto end;
+
+	ret = av_write_trailer(fmt);
+
+end:
+	av_frame_free(&frame);
+	av_packet_free(&pkt);
+	avcodec_free_context(&enc);
+	if (fmt->pb)
+		avio_closep(&fmt->pb);
+	avformat_free_context(fmt);
+
+	return ret;
+}
+
+int generate_main(int argc, const char *const *argv)
+{
+	struct gen_options opts;
+	struct gen_cue *cues;
+	u64 rng;
+	int ret;
+
+	if (parse_options(&opts, argc, argv) < 0)
+		return 1;
+
+	rng = opts.seed;
+
+	if (!(cues = av_malloc_array(opts.nr_cues ? opts.nr_cues : 1, sizeof(struct gen_cue)))) {
+		av_log(NULL, AV_LOG_ERROR, "Out of memory.\n");
+		return 1;
+	}
+
+	layout_cues(cues, &opts, &rng);
+
+	/* Written before the media, whose synthesis sorts the cues. */
+	if ((ret = write_srt(opts.sub_filepath, cues, opts.nr_cues)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "%s: failed to write subtitles: %s\n",
+		       opts.sub_filepath, av_err2str(ret));
+		goto end;
+	}
+
+	if ((ret = write_media(&opts, cues, &rng)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "%s: failed to write media: %s\n",
+		       opts.media_filepath, av_err2str(ret));
+		goto end;
+	}
+
+	printf("%s: %.3fs, %s, %d Hz, %d channel(s); %s: %d %s cue(s).\n",
+	       opts.media_filepath, opts.duration, opts.codec, opts.sample_rate, opts.channels,
+	       opts.sub_filepath, opts.nr_cues, pattern_names[opts.pattern]);
+
+end:
+	av_free(cues);
+	return ret < 0;
+}
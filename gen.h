@@ -0,0 +1,11 @@
+#ifndef SPEECHFUL_GEN_H
+#define SPEECHFUL_GEN_H
+
+/*
+ * `speechful generate [options]`: writes a synthetic input and a matching SRT
+ * file, the reproducible corpus used by the benchmarks. `argv[0]` is the
+ * subcommand name. Returns the process exit status.
+ */
+int generate_main(int argc, const char *const *argv);
+
+#endif
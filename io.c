@@ -0,0 +1,889 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libavformat/avio.h>
+#include <libavutil/avutil.h>
+#include <libavutil/mem.h>
+
+#include "io.h"
+#include "stats.h"
+
+#define IO_BUFFER_SIZE (64 * 1024)
+
+/* Read-ahead: two buffers of this size, and at most this many ranges waiting. */
+#define READAHEAD_SLOT_SIZE   (4 * 1024 * 1024)
+#define READAHEAD_MAX_PENDING 16
+
+/* Output is handed to the writer thread in buffers this large. */
+#define WRITER_BUFFER_SIZE (1024 * 1024)
+
+enum io_kind {
+	IO_PIPE,
+	IO_MMAP,
+	IO_READAHEAD,
+	IO_WRITER,
+};
+
+enum slot_state {
+	SLOT_EMPTY,
+	SLOT_LOADING,
+	SLOT_READY,
+};
+
+struct readahead_slot {
+	enum slot_state state;
+	int64_t         start;
+	int64_t         end;
+	bool            wanted; /* Prefetched and not read past yet. */
+	uint8_t        *data;
+};
+
+struct readahead {
+	pthread_t             thread;
+	pthread_mutex_t       lock;
+	pthread_cond_t        wake_loader;
+	pthread_cond_t        wake_reader;
+	bool                  stop;
+	int                   delay_us;
+	struct readahead_slot slots[2];
+	int                   active; /* The slot the demuxer reads from, or -1. */
+	int64_t               reader_pos;
+	int64_t               pending_start[READAHEAD_MAX_PENDING];
+	int64_t               pending_end[READAHEAD_MAX_PENDING];
+	int                   pending_head;
+	int                   nr_pending;
+};
+
+struct write_buffer {
+	uint8_t *data;
+	int64_t  offset;
+	int      len;
+	bool     queued;
+};
+
+struct writer {
+	pthread_t           thread;
+	bool                threaded; /* Otherwise buffers are written in place. */
+	pthread_mutex_t     lock;
+	pthread_cond_t      wake_writer;
+	pthread_cond_t      wake_muxer;
+	bool                stop;
+	int                 error;
+	struct write_buffer buffers[2];
+	int                 filling; /* Taken by the muxer. */
+	int                 next;    /* Written next by the thread. */
+};
+
+struct io_file {
+	enum io_kind      kind;
+	int               fd;
+	int64_t           size;
+	int64_t           pos;
+
+	/* IO_MMAP only. */
+	uint8_t          *map;
+
+	/* IO_READAHEAD only. */
+	struct readahead *ra;
+
+	/* IO_WRITER only. */
+	struct writer    *wr;
+};
+
+static int pipe_read(void *opaque, uint8_t *buf, int size)
+{
+	struct io_file *file = opaque;
+	ssize_t n;
+
+	do {
+		n = read(file->fd, buf, size);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		return AVERROR(errno);
+
+	return n ? (int)n : AVERROR_EOF;
+}
+
+static int pipe_write(void *opaque, const uint8_t *buf, int size)
+{
+	struct io_file *file = opaque;
+	int written = 0;
+
+	while (written < size) {
+		ssize_t n = write(file->fd, buf + written, size - written);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return AVERROR(errno);
+		}
+
+		written += n;
+	}
+
+	return written;
+}
+
+static int open_pipe(struct AVIOContext **pb, int fd, int write_flag)
+{
+	struct io_file *file;
+	unsigned char *buffer;
+
+	if (!(file = av_mallocz(sizeof(struct io_file))))
+		return AVERROR(ENOMEM);
+
+	file->kind = IO_PIPE;
+	file->fd   = fd;
+
+	if (!(buffer = av_malloc(IO_BUFFER_SIZE))) {
+		av_free(file);
+		return AVERROR(ENOMEM);
+	}
+
+	if (!(*pb = avio_alloc_context(buffer, IO_BUFFER_SIZE, write_flag, file,
+	                               write_flag ? NULL : pipe_read,
+	                               write_flag ? pipe_write : NULL,
+	                               NULL))) {
+		av_free(buffer);
+		av_free(file);
+		return AVERROR(ENOMEM);
+	}
+
+	return 0;
+}
+
+static int mmap_read(void *opaque, uint8_t *buf, int size)
+{
+	struct io_file *file = opaque;
+	int n = FFMIN(size, file->size - file->pos);
+
+	if (n <= 0)
+		return AVERROR_EOF;
+
+	memcpy(buf, file->map + file->pos, n);
+	file->pos += n;
+
+	return n;
+}
+
+static int64_t file_seek(void *opaque, int64_t offset, int whence)
+{
+	struct io_file *file = opaque;
+	int64_t pos;
+
+	switch (whence & ~AVSEEK_FORCE) {
+	case AVSEEK_SIZE:
+		return file->size;
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = file->pos + offset;
+		break;
+	case SEEK_END:
+		pos = file->size + offset;
+		break;
+	default:
+		return AVERROR(EINVAL);
+	}
+
+	if (pos < 0 || pos > file->size)
+		return AVERROR(EINVAL);
+
+	return file->pos = pos;
+}
+
+int io_open_mmap_input(struct AVIOContext **pb, const char *filepath)
+{
+	struct io_file *file;
+	unsigned char *buffer = NULL;
+	struct stat st;
+	int ret;
+
+	if (!(file = av_mallocz(sizeof(struct io_file))))
+		return AVERROR(ENOMEM);
+
+	file->kind = IO_MMAP;
+
+	if ((file->fd = open(filepath, O_RDONLY)) < 0) {
+		ret = AVERROR(errno);
+		goto err_free_file;
+	}
+
+	if (fstat(file->fd, &st) < 0) {
+		ret = AVERROR(errno);
+		goto err_close_fd;
+	}
+
+	/* Pipes, devices and the like are left to the regular file protocol. */
+	if (!S_ISREG(st.st_mode)) {
+		ret = AVERROR(ENOTSUP);
+		goto err_close_fd;
+	}
+
+	file->size = st.st_size;
+
+	if (file->size
+	    && (file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0)) == MAP_FAILED) {
+		ret = AVERROR(errno);
+		goto err_close_fd;
+	}
+
+	if (!(buffer = av_malloc(IO_BUFFER_SIZE))
+	    || !(*pb = avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, file, mmap_read, NULL, file_seek))) {
+		ret = AVERROR(ENOMEM);
+		goto err_unmap;
+	}
+
+	return 0;
+
+err_unmap:
+	av_free(buffer);
+	if (file->map)
+		munmap(file->map, file->size);
+err_close_fd:
+	close(file->fd);
+err_free_file:
+	av_free(file);
+
+	return ret;
+}
+
+static void mmap_hint(struct io_file *file, int64_t offset, int64_t length, enum io_hint hint)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	int64_t start, end;
+
+	if (!file->map)
+		return;
+
+	start = FFMAX(offset, 0) / page * page;
+	end   = FFMIN(offset + length, file->size);
+	if (start >= end)
+		return;
+
+	if (hint == IO_HINT_WILLNEED) {
+		madvise(file->map + start, end - start, MADV_WILLNEED);
+		posix_fadvise(file->fd, start, end - start, POSIX_FADV_WILLNEED);
+	} else {
+		/* Only whole pages inside the range may be dropped. */
+		end = end / page * page;
+		if (FFMAX(offset, 0) > start)
+			start += page;
+		if (start >= end)
+			return;
+
+		madvise(file->map + start, end - start, MADV_DONTNEED);
+		posix_fadvise(file->fd, start, end - start, POSIX_FADV_DONTNEED);
+	}
+}
+
+static int64_t pread_delayed(const struct io_file *file, uint8_t *buf, int64_t size, int64_t offset)
+{
+	ssize_t n;
+
+	/* Stands in for the round-trip of a network filesystem. */
+	if (file->ra->delay_us)
+		usleep(file->ra->delay_us);
+
+	do {
+		n = pread(file->fd, buf, size, offset);
+	} while (n < 0 && errno == EINTR);
+
+	return n < 0 ? AVERROR(errno) : n;
+}
+
+static bool slot_covers(const struct readahead_slot *slot, int64_t pos)
+{
+	return slot->state != SLOT_EMPTY && pos >= slot->start && pos < slot->end;
+}
+
+/* A slot may be reloaded unless the demuxer is in it or is still heading for it. */
+static int free_slot(const struct readahead *ra)
+{
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		const struct readahead_slot *slot = &ra->slots[i];
+
+		if (slot->state == SLOT_EMPTY)
+			return i;
+		if (slot->state == SLOT_READY && i != ra->active
+		    && (!slot->wanted || ra->reader_pos >= slot->end))
+			return i;
+	}
+
+	return -1;
+}
+
+static void *readahead_loader(void *opaque)
+{
+	struct io_file *file = opaque;
+	struct readahead *ra = file->ra;
+
+	pthread_mutex_lock(&ra->lock);
+
+	while (!ra->stop) {
+		struct readahead_slot *slot;
+		int64_t start, end, n;
+		int i, k;
+
+		if (!ra->nr_pending || (i = free_slot(ra)) < 0) {
+			pthread_cond_wait(&ra->wake_loader, &ra->lock);
+			continue;
+		}
+
+		k     = ra->pending_head;
+		start = ra->pending_start[k];
+		end   = FFMIN(FFMIN(ra->pending_end[k], start + READAHEAD_SLOT_SIZE), file->size);
+
+		/* Skip what is already buffered. */
+		if (slot_covers(&ra->slots[!i], start))
+			end = start = FFMIN(ra->slots[!i].end, ra->pending_end[k]);
+
+		if (start >= end) {
+			ra->pending_start[k] = end;
+			if (end >= ra->pending_end[k] || end >= file->size) {
+				ra->pending_head = (ra->pending_head + 1) % READAHEAD_MAX_PENDING;
+				--ra->nr_pending;
+			}
+			continue;
+		}
+
+		slot = &ra->slots[i];
+		slot->state  = SLOT_LOADING;
+		slot->start  = start;
+		slot->end    = end;
+		slot->wanted = true;
+
+		pthread_mutex_unlock(&ra->lock);
+		n = pread_delayed(file, slot->data, end - start, start);
+		pthread_mutex_lock(&ra->lock);
+
+		if (n > 0) {
+			slot->end   = start + n;
+			slot->state = SLOT_READY;
+		} else {
+			slot->state = SLOT_EMPTY;
+		}
+
+		/* The range may have been dropped by a DONTNEED meanwhile. */
+		if (ra->nr_pending && ra->pending_head == k && ra->pending_start[k] == start) {
+			ra->pending_start[k] = n > 0 ? start + n : ra->pending_end[k];
+			if (ra->pending_start[k] >= ra->pending_end[k] || n <= 0) {
+				ra->pending_head = (ra->pending_head + 1) % READAHEAD_MAX_PENDING;
+				--ra->nr_pending;
+			}
+		}
+
+		pthread_cond_broadcast(&ra->wake_reader);
+	}
+
+	pthread_mutex_unlock(&ra->lock);
+
+	return NULL;
+}
+
+static int readahead_read(void *opaque, uint8_t *buf, int size)
+{
+	struct io_file *file = opaque;
+	struct readahead *ra = file->ra;
+	int64_t n;
+	int i;
+
+	if (file->pos >= file->size)
+		return AVERROR_EOF;
+
+	pthread_mutex_lock(&ra->lock);
+
+	ra->reader_pos = file->pos;
+
+	for (;;) {
+		for (i = 0; i < 2 && !slot_covers(&ra->slots[i], file->pos); ++i)
+			;
+
+		if (i == 2 || ra->slots[i].state == SLOT_READY)
+			break;
+
+		/* The loader is on it already; waiting beats a second round-trip. */
+		pthread_cond_wait(&ra->wake_reader, &ra->lock);
+	}
+
+	if (i < 2) {
+		struct readahead_slot *slot = &ra->slots[i];
+
+		n = FFMIN(size, slot->end - file->pos);
+		memcpy(buf, slot->data + (file->pos - slot->start), n);
+
+		if (ra->active >= 0 && ra->active != i)
+			ra->slots[ra->active].wanted = false;
+		ra->active = i;
+
+		pthread_mutex_unlock(&ra->lock);
+		pthread_cond_signal(&ra->wake_loader);
+
+		stats_count(COUNTER_READAHEAD_HIT_BYTES, n);
+	} else {
+		ra->active = -1;
+		pthread_mutex_unlock(&ra->lock);
+		pthread_cond_signal(&ra->wake_loader);
+
+		if ((n = pread_delayed(file, buf, size, file->pos)) < 0)
+			return n;
+		if (n == 0)
+			return AVERROR_EOF;
+
+		stats_count(COUNTER_READAHEAD_MISS_BYTES, n);
+	}
+
+	file->pos += n;
+
+	return n;
+}
+
+static void readahead_hint(struct io_file *file, int64_t offset, int64_t length, enum io_hint hint)
+{
+	struct readahead *ra = file->ra;
+	int i;
+
+	pthread_mutex_lock(&ra->lock);
+
+	if (hint == IO_HINT_WILLNEED) {
+		/* The oldest request is the least useful one to keep. */
+		if (ra->nr_pending == READAHEAD_MAX_PENDING) {
+			ra->pending_head = (ra->pending_head + 1) % READAHEAD_MAX_PENDING;
+			--ra->nr_pending;
+		}
+
+		i = (ra->pending_head + ra->nr_pending++) % READAHEAD_MAX_PENDING;
+		ra->pending_start[i] = offset;
+		ra->pending_end[i]   = offset + length;
+	} else {
+		for (i = 0; i < 2; ++i)
+			if (ra->slots[i].end <= offset + length)
+				ra->slots[i].wanted = false;
+	}
+
+	pthread_mutex_unlock(&ra->lock);
+	pthread_cond_signal(&ra->wake_loader);
+}
+
+static void readahead_stop(struct readahead *ra)
+{
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = true;
+	pthread_mutex_unlock(&ra->lock);
+	pthread_cond_signal(&ra->wake_loader);
+
+	pthread_join(ra->thread, NULL);
+}
+
+int io_open_readahead_input(struct AVIOContext **pb, const char *filepath, int delay_us)
+{
+	struct io_file *file;
+	struct readahead *ra;
+	unsigned char *buffer = NULL;
+	struct stat st;
+	int i, ret;
+
+	if (!(file = av_mallocz(sizeof(struct io_file))))
+		return AVERROR(ENOMEM);
+
+	file->kind = IO_READAHEAD;
+
+	if (!(ra = file->ra = av_mallocz(sizeof(struct readahead)))) {
+		ret = AVERROR(ENOMEM);
+		goto err_free_file;
+	}
+
+	ra->active   = -1;
+	ra->delay_us = delay_us;
+
+	if ((file->fd = open(filepath, O_RDONLY)) < 0) {
+		ret = AVERROR(errno);
+		goto err_free_file;
+	}
+
+	if (fstat(file->fd, &st) < 0) {
+		ret = AVERROR(errno);
+		goto err_close_fd;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		ret = AVERROR(ENOTSUP);
+		goto err_close_fd;
+	}
+
+	file->size = st.st_size;
+
+	for (i = 0; i < 2; ++i) {
+		if (!(ra->slots[i].data = av_malloc(READAHEAD_SLOT_SIZE))) {
+			ret = AVERROR(ENOMEM);
+			goto err_free_slots;
+		}
+	}
+
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->wake_loader, NULL);
+	pthread_cond_init(&ra->wake_reader, NULL);
+
+	if ((ret = pthread_create(&ra->thread, NULL, readahead_loader, file)) != 0) {
+		ret = AVERROR(ret);
+		goto err_destroy_sync;
+	}
+
+	if (!(buffer = av_malloc(IO_BUFFER_SIZE))
+	    || !(*pb = avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, file, readahead_read, NULL, file_seek))) {
+		av_free(buffer);
+		readahead_stop(ra);
+		ret = AVERROR(ENOMEM);
+		goto err_destroy_sync;
+	}
+
+	return 0;
+
+err_destroy_sync:
+	pthread_cond_destroy(&ra->wake_reader);
+	pthread_cond_destroy(&ra->wake_loader);
+	pthread_mutex_destroy(&ra->lock);
+err_free_slots:
+	for (i = 0; i < 2; ++i)
+		av_free(ra->slots[i].data);
+err_close_fd:
+	close(file->fd);
+err_free_file:
+	av_free(file->ra);
+	av_free(file);
+
+	return ret;
+}
+
+void io_hint(struct AVIOContext *pb, int64_t offset, int64_t length, enum io_hint hint)
+{
+	struct io_file *file = pb->opaque;
+
+	switch (file->kind) {
+	case IO_PIPE:
+	case IO_WRITER:
+		break;
+	case IO_MMAP:
+		mmap_hint(file, offset, length, hint);
+		break;
+	case IO_READAHEAD:
+		readahead_hint(file, offset, length, hint);
+		break;
+	}
+}
+
+static int pwrite_all(int fd, const uint8_t *buf, int64_t size, int64_t offset)
+{
+	while (size > 0) {
+		ssize_t n = pwrite(fd, buf, size, offset);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return AVERROR(errno);
+		}
+
+		buf    += n;
+		size   -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+static void *writer_thread(void *opaque)
+{
+	struct io_file *file = opaque;
+	struct writer *wr = file->wr;
+
+	pthread_mutex_lock(&wr->lock);
+
+	for (;;) {
+		struct write_buffer *b = &wr->buffers[wr->next];
+		int ret;
+
+		if (!b->queued) {
+			if (wr->stop)
+				break;
+			pthread_cond_wait(&wr->wake_writer, &wr->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&wr->lock);
+		ret = pwrite_all(file->fd, b->data, b->len, b->offset);
+		pthread_mutex_lock(&wr->lock);
+
+		if (ret < 0 && !wr->error)
+			wr->error = ret;
+
+		b->queued = false;
+		b->len    = 0;
+		wr->next  = !wr->next;
+		pthread_cond_broadcast(&wr->wake_muxer);
+	}
+
+	pthread_mutex_unlock(&wr->lock);
+
+	return NULL;
+}
+
+/* Hands the buffer being filled to the writer and takes the other one. */
+static int writer_submit(struct io_file *file)
+{
+	struct writer *wr = file->wr;
+	struct write_buffer *b = &wr->buffers[wr->filling];
+	int ret;
+
+	if (!b->len)
+		return 0;
+
+	if (!wr->threaded) {
+		ret = pwrite_all(file->fd, b->data, b->len, b->offset);
+		b->len = 0;
+		return ret;
+	}
+
+	pthread_mutex_lock(&wr->lock);
+
+	b->queued = true;
+	pthread_cond_signal(&wr->wake_writer);
+
+	wr->filling = !wr->filling;
+	while (wr->buffers[wr->filling].queued)
+		pthread_cond_wait(&wr->wake_muxer, &wr->lock);
+
+	ret = wr->error;
+
+	pthread_mutex_unlock(&wr->lock);
+
+	return ret;
+}
+
+static int writer_write(void *opaque, const uint8_t *buf, int size)
+{
+	struct io_file *file = opaque;
+	struct writer *wr = file->wr;
+	int written = 0;
+	int ret;
+
+	while (written < size) {
+		struct write_buffer *b = &wr->buffers[wr->filling];
+		int n = FFMIN(size - written, WRITER_BUFFER_SIZE - b->len);
+
+		if (!b->len)
+			b->offset = file->pos;
+
+		memcpy(b->data + b->len, buf + written, n);
+		b->len    += n;
+		written   += n;
+		file->pos += n;
+
+		if (b->len == WRITER_BUFFER_SIZE && (ret = writer_submit(file)) < 0)
+			return ret;
+	}
+
+	file->size = FFMAX(file->size, file->pos);
+
+	return written;
+}
+
+static int64_t writer_seek(void *opaque, int64_t offset, int whence)
+{
+	struct io_file *file = opaque;
+	int64_t pos;
+	int ret;
+
+	switch (whence & ~AVSEEK_FORCE) {
+	case AVSEEK_SIZE:
+		return file->size;
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = file->pos + offset;
+		break;
+	case SEEK_END:
+		pos = file->size + offset;
+		break;
+	default:
+		return AVERROR(EINVAL);
+	}
+
+	if (pos < 0)
+		return AVERROR(EINVAL);
+
+	/* A buffer covers a single contiguous range of the file. */
+	if (pos != file->pos && (ret = writer_submit(file)) < 0)
+		return ret;
+
+	return file->pos = pos;
+}
+
+/* Waits for everything written so far to reach the file. */
+static int writer_drain(struct io_file *file)
+{
+	struct writer *wr = file->wr;
+	int ret;
+
+	if ((ret = writer_submit(file)) < 0 || !wr->threaded)
+		return ret;
+
+	pthread_mutex_lock(&wr->lock);
+	while (wr->buffers[0].queued || wr->buffers[1].queued)
+		pthread_cond_wait(&wr->wake_muxer, &wr->lock);
+	ret = wr->error;
+	pthread_mutex_unlock(&wr->lock);
+
+	return ret;
+}
+
+static void writer_stop(struct writer *wr)
+{
+	if (!wr->threaded)
+		return;
+
+	pthread_mutex_lock(&wr->lock);
+	wr->stop = true;
+	pthread_mutex_unlock(&wr->lock);
+	pthread_cond_signal(&wr->wake_writer);
+
+	pthread_join(wr->thread, NULL);
+
+	pthread_cond_destroy(&wr->wake_muxer);
+	pthread_cond_destroy(&wr->wake_writer);
+	pthread_mutex_destroy(&wr->lock);
+}
+
+int io_open_file_output(struct AVIOContext **pb, const char *filepath)
+{
+	struct io_file *file;
+	struct writer *wr;
+	unsigned char *buffer = NULL;
+	int i, ret;
+
+	if (!(file = av_mallocz(sizeof(struct io_file))))
+		return AVERROR(ENOMEM);
+
+	file->kind = IO_WRITER;
+
+	if (!(wr = file->wr = av_mallocz(sizeof(struct writer)))) {
+		ret = AVERROR(ENOMEM);
+		goto err_free_file;
+	}
+
+	for (i = 0; i < 2; ++i) {
+		if (!(wr->buffers[i].data = av_malloc(WRITER_BUFFER_SIZE))) {
+			ret = AVERROR(ENOMEM);
+			goto err_free_buffers;
+		}
+	}
+
+	if ((file->fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		ret = AVERROR(errno);
+		goto err_free_buffers;
+	}
+
+	pthread_mutex_init(&wr->lock, NULL);
+	pthread_cond_init(&wr->wake_writer, NULL);
+	pthread_cond_init(&wr->wake_muxer, NULL);
+
+	/* Without a thread the output is still written in large blocks, just not in the background. */
+	wr->threaded = pthread_create(&wr->thread, NULL, writer_thread, file) == 0;
+	if (!wr->threaded) {
+		pthread_cond_destroy(&wr->wake_muxer);
+		pthread_cond_destroy(&wr->wake_writer);
+		pthread_mutex_destroy(&wr->lock);
+	}
+
+	if (!(buffer = av_malloc(IO_BUFFER_SIZE))
+	    || !(*pb = avio_alloc_context(buffer, IO_BUFFER_SIZE, 1, file, NULL, writer_write, writer_seek))) {
+		av_free(buffer);
+		writer_stop(wr);
+		close(file->fd);
+		ret = AVERROR(ENOMEM);
+		goto err_free_buffers;
+	}
+
+	return 0;
+
+err_free_buffers:
+	for (i = 0; i < 2; ++i)
+		av_free(wr->buffers[i].data);
+err_free_file:
+	av_free(file->wr);
+	av_free(file);
+
+	return ret;
+}
+
+int io_open_pipe_input(struct AVIOContext **pb, int fd)
+{
+	return open_pipe(pb, fd, 0);
+}
+
+int io_open_pipe_output(struct AVIOContext **pb, int fd)
+{
+	return open_pipe(pb, fd, 1);
+}
+
+int io_close(struct AVIOContext **pb)
+{
+	struct io_file *file;
+	int ret = 0;
+
+	if (!*pb)
+		return 0;
+
+	file = (*pb)->opaque;
+	avio_flush(*pb);
+
+	switch (file->kind) {
+	case IO_PIPE:
+		/* The descriptor belongs to whoever opened it. */
+		break;
+	case IO_MMAP:
+		if (file->map)
+			munmap(file->map, file->size);
+		close(file->fd);
+		break;
+	case IO_READAHEAD:
+		readahead_stop(file->ra);
+		pthread_cond_destroy(&file->ra->wake_reader);
+		pthread_cond_destroy(&file->ra->wake_loader);
+		pthread_mutex_destroy(&file->ra->lock);
+		av_free(file->ra->slots[0].data);
+		av_free(file->ra->slots[1].data);
+		av_freep(&file->ra);
+		close(file->fd);
+		break;
+	case IO_WRITER:
+		ret = writer_drain(file);
+		writer_stop(file->wr);
+		av_free(file->wr->buffers[0].data);
+		av_free(file->wr->buffers[1].data);
+		av_freep(&file->wr);
+		if (close(file->fd) < 0 && !ret)
+			ret = AVERROR(errno);
+		break;
+	}
+
+	av_freep(&(*pb)->opaque);
+	av_freep(&(*pb)->buffer);
+	avio_context_free(pb);
+
+	return ret;
+}
@@ -0,0 +1,54 @@
+#ifndef SPEECHFUL_IO_H
+#define SPEECHFUL_IO_H
+
+#include <stdint.h>
+
+#include <libavformat/avio.h>
+
+enum io_hint {
+	IO_HINT_WILLNEED,
+	IO_HINT_DONTNEED,
+};
+
+/*
+ * Custom AVIOContexts. Contexts opened here must be released with
+ * `io_close()`, never with `avio_closep()`.
+ */
+
+/* Unseekable streams over an already open descriptor, e.g. stdin or stdout. */
+int io_open_pipe_input(struct AVIOContext **pb, int fd);
+int io_open_pipe_output(struct AVIOContext **pb, int fd);
+
+/*
+ * Maps a local regular file and serves reads from the mapping. Fails with
+ * AVERROR(ENOTSUP) for anything that is not a regular file.
+ */
+int io_open_mmap_input(struct AVIOContext **pb, const char *filepath);
+
+/*
+ * Reads a local regular file with pread() and keeps a loader thread filling
+ * a double buffer from the ranges hinted with IO_HINT_WILLNEED, so network
+ * filesystem round-trips overlap decoding. `delay_us` adds latency to every
+ * read, to reproduce such filesystems locally.
+ */
+int io_open_readahead_input(struct AVIOContext **pb, const char *filepath, int delay_us);
+
+/*
+ * Creates or truncates a file for the muxer. Output is gathered in large
+ * buffers and written by a background thread, so the encoder does not stall
+ * on disk writes; if the thread cannot be started, the same buffers are
+ * written synchronously. Write errors surface on later writes and seeks, and
+ * finally from `io_close()`.
+ */
+int io_open_file_output(struct AVIOContext **pb, const char *filepath);
+
+/*
+ * Tells the backend a byte range will be read soon, or will not be read
+ * again. Backends without a use for hints ignore them.
+ */
+void io_hint(struct AVIOContext *pb, int64_t offset, int64_t length, enum io_hint hint);
+
+/* Returns the first error of a deferred write, if there was one. */
+int io_close(struct AVIOContext **pb);
+
+#endif
@@ -0,0 +1,687 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <math.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/samplefmt.h>
+
+#include "loudness.h"
+#include "pipeline.h"
+#include "stats.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Loudness is measured per 100 ms block, over the last 3 s as EBU R128 short-term loudness. */
+#define BLOCK_MS          100
+#define SHORT_TERM_BLOCKS 30
+
+/* Blocks quieter than this are pauses; the gain holds instead of rising into the noise. */
+#define GATE_LUFS -50.0f
+
+/* How fast the gain may rise per block, so it does not pump after a loud word. */
+#define MAX_RISE_DB 1.0f
+
+/* Strict C99 leaves M_PI out of <math.h>. */
+#define PI 3.14159265358979323846
+
+/* One stage of the K-weighting filter, in transposed direct form II. */
+struct biquad {
+	double b0, b1, b2, a1, a2;
+};
+
+/* Filters two channels' block, returning their K-weighted energy summed. */
+typedef double (*weigh_pair_fn)(const struct biquad *shelf, const struct biquad *highpass,
+                                const float *x0, const float *x1, double *z0, double *z1, int n);
+typedef float  (*peak_fn)(const float *x, int n);
+typedef void   (*ramp_fn)(float *x, int n, float g, float step);
+
+struct block {
+	float *x; /* Planar, `block_size` floats per channel. */
+	int    n;
+	float  peak;
+};
+
+struct loudness {
+	enum AVSampleFormat sample_fmt;
+	int                 channels;
+	int                 block_size;
+	int                 lookahead; /* In blocks. */
+	float               target_lufs;
+	float               max_gain_db;
+	float               ceiling;
+
+	struct biquad       shelf;
+	struct biquad       highpass;
+	double             *state; /* Four per channel, two per stage. */
+
+	struct AVAudioFifo *in;
+	u8                **scratch; /* One block in the stream's format. */
+
+	/* Blocks held back for the lookahead, oldest first. */
+	struct block       *blocks;
+	int                 first;
+	int                 nr_blocks;
+
+	float               energies[SHORT_TERM_BLOCKS];
+	int                 nr_energies;
+	int                 next_energy;
+	float               gain_db;  /* What the loudness asks for. */
+	float               applied;  /* The gain the last emitted block ended at. */
+	bool                started;
+
+	weigh_pair_fn       weigh_pair;
+	peak_fn             peak;
+	ramp_fn             apply_gain_ramp;
+
+	pcm_fn              emit;
+	void               *opaque;
+};
+
+/* The filter of ITU-R BS.1770, its coefficients derived for any rate. */
+static void k_weighting(struct biquad *shelf, struct biquad *highpass, int sample_rate)
+{
+	double f0 = 1681.974450955533;
+	double g  = 3.999843853973347;
+	double q  = 0.7071752369554196;
+	double k  = tan(PI * f0 / sample_rate);
+	double vh = pow(10, g / 20);
+	double vb = pow(vh, 0.4996667741545416);
+	double a0 = 1 + k / q + k * k;
+
+	shelf->b0 = (vh + vb * k / q + k * k) / a0;
+	shelf->b1 = 2 * (k * k - vh) / a0;
+	shelf->b2 = (vh - vb * k / q + k * k) / a0;
+	shelf->a1 = 2 * (k * k - 1) / a0;
+	shelf->a2 = (1 - k / q + k * k) / a0;
+
+	f0 = 38.13547087602444;
+	q  = 0.5003270373238773;
+	k  = tan(PI * f0 / sample_rate);
+	a0 = 1 + k / q + k * k;
+
+	highpass->b0 = 1;
+	highpass->b1 = -2;
+	highpass->b2 = 1;
+	highpass->a1 = 2 * (k * k - 1) / a0;
+	highpass->a2 = (1 - k / q + k * k) / a0;
+}
+
+static double biquad_step(const struct biquad *f, double *z, double x)
+{
+	double y = f->b0 * x + z[0];
+
+	z[0] = f->b1 * x - f->a1 * y + z[1];
+	z[1] = f->b2 * x - f->a2 * y;
+
+	return y;
+}
+
+static double weigh(const struct biquad *shelf, const struct biquad *highpass,
+                    const float *x, double *z, int n)
+{
+	double energy = 0;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		double y = biquad_step(highpass, z + 2, biquad_step(shelf, z, x[i]));
+
+		energy += y * y;
+	}
+
+	return energy;
+}
+
+static double weigh_pair_c(const struct biquad *shelf, const struct biquad *highpass,
+                           const float *x0, const float *x1, double *z0, double *z1, int n)
+{
+	return weigh(shelf, highpass, x0, z0, n) + weigh(shelf, highpass, x1, z1, n);
+}
+
+static float peak_c(const float *x, int n)
+{
+	float peak = 0;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		float a = fabsf(x[i]);
+
+		peak = a > peak ? a : peak;
+	}
+
+	return peak;
+}
+
+/* `x[i] *= g + step * (i + 1)` */
+static void apply_gain_ramp_c(float *x, int n, float g, float step)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		x[i] *= g + step * (i + 1);
+}
+
+#ifdef HAVE_X86
+/*
+ * The filter is recursive along the samples, so the vector runs along the
+ * channels: one double lane each, two channels a register.
+ */
+static double weigh_pair_sse2(const struct biquad *shelf, const struct biquad *highpass,
+                              const float *x0, const float *x1, double *z0, double *z1, int n)
+{
+	__m128d sb0 = _mm_set1_pd(shelf->b0), sb1 = _mm_set1_pd(shelf->b1), sb2 = _mm_set1_pd(shelf->b2);
+	__m128d sa1 = _mm_set1_pd(shelf->a1), sa2 = _mm_set1_pd(shelf->a2);
+	__m128d hb0 = _mm_set1_pd(highpass->b0), hb1 = _mm_set1_pd(highpass->b1);
+	__m128d hb2 = _mm_set1_pd(highpass->b2);
+	__m128d ha1 = _mm_set1_pd(highpass->a1), ha2 = _mm_set1_pd(highpass->a2);
+	__m128d s0 = _mm_set_pd(z1[0], z0[0]), s1 = _mm_set_pd(z1[1], z0[1]);
+	__m128d h0 = _mm_set_pd(z1[2], z0[2]), h1 = _mm_set_pd(z1[3], z0[3]);
+	__m128d energy = _mm_setzero_pd();
+	double lanes[2];
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		__m128d x = _mm_set_pd(x1[i], x0[i]);
+		__m128d y = _mm_add_pd(_mm_mul_pd(sb0, x), s0);
+		__m128d w;
+
+		s0 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(sb1, x), _mm_mul_pd(sa1, y)), s1);
+		s1 = _mm_sub_pd(_mm_mul_pd(sb2, x), _mm_mul_pd(sa2, y));
+
+		w  = _mm_add_pd(_mm_mul_pd(hb0, y), h0);
+		h0 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(hb1, y), _mm_mul_pd(ha1, w)), h1);
+		h1 = _mm_sub_pd(_mm_mul_pd(hb2, y), _mm_mul_pd(ha2, w));
+
+		energy = _mm_add_pd(energy, _mm_mul_pd(w, w));
+	}
+
+	_mm_storel_pd(&z0[0], s0);
+	_mm_storeh_pd(&z1[0], s0);
+	_mm_storel_pd(&z0[1], s1);
+	_mm_storeh_pd(&z1[1], s1);
+	_mm_storel_pd(&z0[2], h0);
+	_mm_storeh_pd(&z1[2], h0);
+	_mm_storel_pd(&z0[3], h1);
+	_mm_storeh_pd(&z1[3], h1);
+
+	_mm_storeu_pd(lanes, energy);
+
+	return lanes[0] + lanes[1];
+}
+
+static float peak_sse2(const float *x, int n)
+{
+	__m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 peak = _mm_setzero_ps();
+	float lanes[4], rest;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		peak = _mm_max_ps(peak, _mm_and_ps(_mm_loadu_ps(x + i), mask));
+
+	_mm_storeu_ps(lanes, peak);
+	rest = peak_c(x + i, n - i);
+
+	for (i = 0; i < 4; ++i)
+		rest = lanes[i] > rest ? lanes[i] : rest;
+
+	return rest;
+}
+
+static void apply_gain_ramp_sse2(float *x, int n, float g, float step)
+{
+	__m128 steps = _mm_mul_ps(_mm_set1_ps(step), _mm_set_ps(3, 2, 1, 0));
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128 gain = _mm_add_ps(_mm_set1_ps(g + step * (i + 1)), steps);
+
+		_mm_storeu_ps(x + i, _mm_mul_ps(_mm_loadu_ps(x + i), gain));
+	}
+
+	apply_gain_ramp_c(x + i, n - i, g + step * i, step);
+}
+
+__attribute__((target("avx2")))
+static float peak_avx2(const float *x, int n)
+{
+	__m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	__m256 peak = _mm256_setzero_ps();
+	float lanes[8], rest;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		peak = _mm256_max_ps(peak, _mm256_and_ps(_mm256_loadu_ps(x + i), mask));
+
+	_mm256_storeu_ps(lanes, peak);
+	rest = peak_c(x + i, n - i);
+
+	for (i = 0; i < 8; ++i)
+		rest = lanes[i] > rest ? lanes[i] : rest;
+
+	return rest;
+}
+
+__attribute__((target("avx2")))
+static void apply_gain_ramp_avx2(float *x, int n, float g, float step)
+{
+	__m256 steps = _mm256_mul_ps(_mm256_set1_ps(step), _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0));
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256 gain = _mm256_add_ps(_mm256_set1_ps(g + step * (i + 1)), steps);
+
+		_mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), gain));
+	}
+
+	apply_gain_ramp_c(x + i, n - i, g + step * i, step);
+}
+#endif
+
+#ifdef HAVE_NEON
+static double weigh_pair_neon(const struct biquad *shelf, const struct biquad *highpass,
+                              const float *x0, const float *x1, double *z0, double *z1, int n)
+{
+	float64x2_t s0 = {z0[0], z1[0]}, s1 = {z0[1], z1[1]};
+	float64x2_t h0 = {z0[2], z1[2]}, h1 = {z0[3], z1[3]};
+	float64x2_t energy = vdupq_n_f64(0);
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		float64x2_t x = {x0[i], x1[i]};
+		float64x2_t y = vfmaq_n_f64(s0, x, shelf->b0);
+		float64x2_t w;
+
+		s0 = vfmsq_n_f64(vfmaq_n_f64(s1, x, shelf->b1), y, shelf->a1);
+		s1 = vfmsq_n_f64(vmulq_n_f64(x, shelf->b2), y, shelf->a2);
+
+		w  = vfmaq_n_f64(h0, y, highpass->b0);
+		h0 = vfmsq_n_f64(vfmaq_n_f64(h1, y, highpass->b1), w, highpass->a1);
+		h1 = vfmsq_n_f64(vmulq_n_f64(y, highpass->b2), w, highpass->a2);
+
+		energy = vfmaq_f64(energy, w, w);
+	}
+
+	z0[0] = vgetq_lane_f64(s0, 0);
+	z1[0] = vgetq_lane_f64(s0, 1);
+	z0[1] = vgetq_lane_f64(s1, 0);
+	z1[1] = vgetq_lane_f64(s1, 1);
+	z0[2] = vgetq_lane_f64(h0, 0);
+	z1[2] = vgetq_lane_f64(h0, 1);
+	z0[3] = vgetq_lane_f64(h1, 0);
+	z1[3] = vgetq_lane_f64(h1, 1);
+
+	return vaddvq_f64(energy);
+}
+
+static float peak_neon(const float *x, int n)
+{
+	float32x4_t peak = vdupq_n_f32(0);
+	float lanes, rest;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		peak = vmaxq_f32(peak, vabsq_f32(vld1q_f32(x + i)));
+
+	lanes = vmaxvq_f32(peak);
+	rest  = peak_c(x + i, n - i);
+
+	return lanes > rest ? lanes : rest;
+}
+
+static void apply_gain_ramp_neon(float *x, int n, float g, float step)
+{
+	static const float index[4] = {0, 1, 2, 3};
+	float32x4_t steps = vmulq_n_f32(vld1q_f32(index), step);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		float32x4_t gain = vaddq_f32(vdupq_n_f32(g + step * (i + 1)), steps);
+
+		vst1q_f32(x + i, vmulq_f32(vld1q_f32(x + i), gain));
+	}
+
+	apply_gain_ramp_c(x + i, n - i, g + step * i, step);
+}
+#endif
+
+/* Picked once, from what the machine running us supports. */
+static void pick_kernels(struct loudness *l)
+{
+	l->weigh_pair      = weigh_pair_c;
+	l->peak            = peak_c;
+	l->apply_gain_ramp = apply_gain_ramp_c;
+
+#if defined(HAVE_X86)
+	l->weigh_pair      = weigh_pair_sse2;
+	l->peak            = peak_sse2;
+	l->apply_gain_ramp = apply_gain_ramp_sse2;
+
+	if (__builtin_cpu_supports("avx2")) {
+		l->peak            = peak_avx2;
+		l->apply_gain_ramp = apply_gain_ramp_avx2;
+	}
+#elif defined(HAVE_NEON)
+	l->weigh_pair      = weigh_pair_neon;
+	l->peak            = peak_neon;
+	l->apply_gain_ramp = apply_gain_ramp_neon;
+#endif
+}
+
+int loudness_alloc(struct loudness **norm, const struct speechful_loudness *settings,
+                   enum AVSampleFormat sample_fmt, int channels, int sample_rate,
+                   pcm_fn emit, void *opaque)
+{
+	enum AVSampleFormat packed = av_get_packed_sample_fmt(sample_fmt);
+	struct loudness *l;
+	int i, ret;
+
+	if (packed != AV_SAMPLE_FMT_S16 && packed != AV_SAMPLE_FMT_S32
+	    && packed != AV_SAMPLE_FMT_FLT && packed != AV_SAMPLE_FMT_DBL)
+		return AVERROR(ENOSYS);
+
+	if (!(l = *norm = av_mallocz(sizeof(struct loudness))))
+		return AVERROR(ENOMEM);
+
+	l->sample_fmt  = sample_fmt;
+	l->channels    = channels;
+	l->block_size  = ms2samples(sample_rate, BLOCK_MS);
+	l->lookahead   = (settings->lookahead_ms + BLOCK_MS - 1) / BLOCK_MS;
+	l->target_lufs = settings->target_lufs;
+	l->max_gain_db = settings->max_gain_db;
+	l->ceiling     = pow(10, settings->ceiling_db / 20);
+	l->applied     = 1;
+	l->emit        = emit;
+	l->opaque      = opaque;
+
+	/* The gain of a block is settled while it is held, so at least one is. */
+	if (l->lookahead < 1)
+		l->lookahead = 1;
+
+	k_weighting(&l->shelf, &l->highpass, sample_rate);
+	pick_kernels(l);
+
+	if (!(l->state  = av_calloc(channels * 4, sizeof(double)))
+	    || !(l->blocks = av_calloc(l->lookahead + 1, sizeof(struct block)))
+	    || !(l->in     = av_audio_fifo_alloc(sample_fmt, channels, l->block_size))) {
+		ret = AVERROR(ENOMEM);
+		goto err_free;
+	}
+
+	for (i = 0; i <= l->lookahead; ++i) {
+		if (!(l->blocks[i].x = av_malloc_array(channels * l->block_size, sizeof(float)))) {
+			ret = AVERROR(ENOMEM);
+			goto err_free;
+		}
+	}
+
+	if ((ret = av_samples_alloc_array_and_samples(&l->scratch, NULL, channels, l->block_size,
+	                                              sample_fmt, 0)) < 0)
+		goto err_free;
+
+	return 0;
+
+err_free:
+	loudness_free(norm);
+
+	return ret;
+}
+
+void loudness_free(struct loudness **norm)
+{
+	struct loudness *l = *norm;
+	int i;
+
+	if (!l)
+		return;
+
+	if (l->blocks)
+		for (i = 0; i <= l->lookahead; ++i)
+			av_free(l->blocks[i].x);
+	av_free(l->blocks);
+	av_free(l->state);
+
+	if (l->in)
+		av_audio_fifo_free(l->in);
+	if (l->scratch)
+		av_freep(l->scratch);
+	av_freep(&l->scratch);
+	av_freep(norm);
+}
+
+/* The format is looked at once per channel, the loops within only convert. */
+static void to_float(const struct loudness *l, u8 *const *src, float *dst, int n)
+{
+	enum AVSampleFormat packed = av_get_packed_sample_fmt(l->sample_fmt);
+	bool planar = av_sample_fmt_is_planar(l->sample_fmt);
+	int stride  = planar ? 1 : l->channels;
+	int c, i;
+
+	for (c = 0; c < l->channels; ++c) {
+		const u8 *plane = src[planar ? c : 0];
+		int first = planar ? 0 : c;
+		float *x = dst + c * l->block_size;
+
+		switch (packed) {
+		case AV_SAMPLE_FMT_S16: {
+			const int16_t *in = (const int16_t *)plane + first;
+
+			for (i = 0; i < n; ++i)
+				x[i] = in[i * stride] / 32768.0f;
+			break;
+		}
+		case AV_SAMPLE_FMT_S32: {
+			const int32_t *in = (const int32_t *)plane + first;
+
+			for (i = 0; i < n; ++i)
+				x[i] = in[i * stride] / 2147483648.0f;
+			break;
+		}
+		case AV_SAMPLE_FMT_FLT: {
+			const float *in = (const float *)plane + first;
+
+			for (i = 0; i < n; ++i)
+				x[i] = in[i * stride];
+			break;
+		}
+		default: {
+			const double *in = (const double *)plane + first;
+
+			for (i = 0; i < n; ++i)
+				x[i] = in[i * stride];
+			break;
+		}
+		}
+	}
+}
+
+static inline float clip(float v)
+{
+	return v > 1.0f ? 1.0f : v < -1.0f ? -1.0f : v;
+}
+
+static void from_float(const struct loudness *l, const float *src, u8 *const *dst, int n)
+{
+	enum AVSampleFormat packed = av_get_packed_sample_fmt(l->sample_fmt);
+	bool planar = av_sample_fmt_is_planar(l->sample_fmt);
+	int stride  = planar ? 1 : l->channels;
+	int c, i;
+
+	for (c = 0; c < l->channels; ++c) {
+		u8 *plane = dst[planar ? c : 0];
+		int first = planar ? 0 : c;
+		const float *x = src + c * l->block_size;
+
+		switch (packed) {
+		case AV_SAMPLE_FMT_S16: {
+			int16_t *out = (int16_t *)plane + first;
+
+			for (i = 0; i < n; ++i)
+				out[i * stride] = lrintf(clip(x[i]) * 32767.0f);
+			break;
+		}
+		case AV_SAMPLE_FMT_S32: {
+			int32_t *out = (int32_t *)plane + first;
+
+			for (i = 0; i < n; ++i)
+				out[i * stride] = lrint(clip(x[i]) * 2147483647.0);
+			break;
+		}
+		case AV_SAMPLE_FMT_FLT: {
+			float *out = (float *)plane + first;
+
+			for (i = 0; i < n; ++i)
+				out[i * stride] = x[i];
+			break;
+		}
+		default: {
+			double *out = (double *)plane + first;
+
+			for (i = 0; i < n; ++i)
+				out[i * stride] = x[i];
+			break;
+		}
+		}
+	}
+}
+
+/* Measures the newest block: its K-weighted energy joins the short-term window, its peak is kept. */
+static void measure(struct loudness *l, struct block *b)
+{
+	double energy = 0;
+	float peak = 0;
+	double mean = 0;
+	int c, i;
+
+	for (c = 0; c + 1 < l->channels; c += 2)
+		energy += l->weigh_pair(&l->shelf, &l->highpass,
+		                        b->x + c * l->block_size, b->x + (c + 1) * l->block_size,
+		                        l->state + c * 4, l->state + (c + 1) * 4, b->n);
+	if (c < l->channels)
+		energy += weigh(&l->shelf, &l->highpass, b->x + c * l->block_size,
+		                l->state + c * 4, b->n);
+
+	for (c = 0; c < l->channels; ++c) {
+		float p = l->peak(b->x + c * l->block_size, b->n);
+
+		if (p > peak)
+			peak = p;
+	}
+
+	b->peak = peak;
+
+	l->energies[l->next_energy] = energy / b->n;
+	l->next_energy = (l->next_energy + 1) % SHORT_TERM_BLOCKS;
+	if (l->nr_energies < SHORT_TERM_BLOCKS)
+		l->nr_energies++;
+
+	for (i = 0; i < l->nr_energies; ++i)
+		mean += l->energies[i];
+	mean /= l->nr_energies;
+
+	/* The short-term loudness in LUFS; the gain only follows it out of the pauses. */
+	if (-0.691 + 10 * log10(mean + 1e-12) > GATE_LUFS) {
+		l->gain_db = l->target_lufs - (-0.691 + 10 * log10(mean));
+		if (l->gain_db > l->max_gain_db)
+			l->gain_db = l->max_gain_db;
+	}
+}
+
+/*
+ * Emits the oldest held block. Its gain is what the loudness asks for, but no
+ * more than keeps every held block under the ceiling; since the previous
+ * block already respected this one, ramping between the two never clips.
+ */
+static int emit_oldest(struct loudness *l)
+{
+	struct block *b = &l->blocks[l->first];
+	struct stage_clock clock;
+	float gain = pow(10, l->gain_db / 20);
+	int c, i;
+
+	stats_stage_begin(&clock, STAGE_LOUDNESS);
+
+	for (i = 0; i < l->nr_blocks; ++i) {
+		const struct block *held = &l->blocks[(l->first + i) % (l->lookahead + 1)];
+
+		if (held->peak * gain > l->ceiling)
+			gain = l->ceiling / held->peak;
+	}
+
+	if (!l->started) {
+		l->applied = gain;
+		l->started = true;
+	} else if (gain > l->applied * pow(10, MAX_RISE_DB / 20)) {
+		gain = l->applied * pow(10, MAX_RISE_DB / 20);
+	}
+
+	for (c = 0; c < l->channels; ++c)
+		l->apply_gain_ramp(b->x + c * l->block_size, b->n, l->applied, (gain - l->applied) / b->n);
+
+	from_float(l, b->x, l->scratch, b->n);
+
+	stats_stage_end(&clock);
+
+	l->applied   = gain;
+	l->first     = (l->first + 1) % (l->lookahead + 1);
+	l->nr_blocks--;
+
+	return l->emit(l->opaque, (const u8 *const *)l->scratch, b->n);
+}
+
+static int push_block(struct loudness *l, int n)
+{
+	struct block *b = &l->blocks[(l->first + l->nr_blocks) % (l->lookahead + 1)];
+	struct stage_clock clock;
+	int ret;
+
+	if ((ret = av_audio_fifo_read(l->in, (void **)l->scratch, n)) < 0)
+		return ret;
+
+	stats_stage_begin(&clock, STAGE_LOUDNESS);
+	to_float(l, l->scratch, b->x, n);
+	b->n = n;
+	measure(l, b);
+	stats_stage_end(&clock);
+
+	if (++l->nr_blocks > l->lookahead)
+		return emit_oldest(l);
+
+	return 0;
+}
+
+int loudness_write(struct loudness *l, const u8 *const *buf, int samples)
+{
+	int ret;
+
+	if (av_audio_fifo_write(l->in, (void **)buf, samples) < samples)
+		return AVERROR(ENOMEM);
+
+	while (av_audio_fifo_size(l->in) >= l->block_size)
+		if ((ret = push_block(l, l->block_size)) < 0)
+			return ret;
+
+	return 0;
+}
+
+int loudness_flush(struct loudness *l)
+{
+	int ret;
+
+	if (av_audio_fifo_size(l->in) && (ret = push_block(l, av_audio_fifo_size(l->in))) < 0)
+		return ret;
+
+	while (l->nr_blocks)
+		if ((ret = emit_oldest(l)) < 0)
+			return ret;
+
+	return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef SPEECHFUL_LOUDNESS_H
+#define SPEECHFUL_LOUDNESS_H
+
+#include <libavutil/samplefmt.h>
+
+#include "pipeline.h"
+#include "speechful.h"
+
+/*
+ * Normalises a stream of PCM in one pass, see `struct speechful_loudness`.
+ * Audio is handled in 100 ms blocks and held back for the lookahead, so
+ * memory stays bounded whatever the length of the stream. Takes s16, s32,
+ * float and double samples, planar or not.
+ */
+struct loudness;
+
+int  loudness_alloc(struct loudness **norm, const struct speechful_loudness *settings,
+                    enum AVSampleFormat sample_fmt, int channels, int sample_rate,
+                    pcm_fn emit, void *opaque);
+void loudness_free(struct loudness **norm);
+
+int  loudness_write(struct loudness *norm, const u8 *const *buf, int samples);
+/* Emits whatever is held back, as if the stream ended here. */
+int  loudness_flush(struct loudness *norm);
+
+#endif
@@ -1,46 +1,74 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
-#include <libswresample/swresample.h>
 #include <libavutil/avutil.h>
-#include <libavutil/audio_fifo.h>
+
+#include "alloc.h"
+#include "daemon.h"
+#include "gen.h"
+#include "speechful.h"
+#include "stats.h"
+#include "trace.h"
+
+typedef int64_t i64;
 
 #define AUDIO_QUALITY_LOW    1
 #define AUDIO_QUALITY_MEDIUM 2
 #define AUDIO_QUALITY_HIGH   3
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define codec_supports(c, what) ((c)->capabilities & (what))
-
-typedef uint8_t u8;
-typedef int64_t i64;
-
 struct parsed_argv {
 	const char *src_audio_filepath;
 	const char *dst_audio_filepath;
 	const char *sub_filepath;
 	i64 sub_padding_left_in_ms;
 	i64 sub_padding_right_in_ms;
+	i64 refine_edges_in_ms;
 	int audio_quality;
-};
-
-struct range {
-	i64 start;
-	i64 end;
-};
-
-struct audio_encoder_settings {
-	int                 channels;
-	int                 sample_rate;
-	int                 bit_rate;
-	enum AVSampleFormat sample_fmt;
+	bool stats;
+	const char *stats_filepath;
+	const char *trace_filepath;
+	bool alloc_stats;
+	const char *alloc_stats_filepath;
+	i64 alloc_limit;
+	bool streaming;
+	bool mmap;
+	bool readahead;
+	int io_delay_ms;
+	bool fast_probe;
+	bool vad;
+	bool trim_silence;
+	bool loudnorm;
+	double loudnorm_lufs;
+	bool segment;
+	int segment_max_in_ms;
+	int segment_target_in_ms;
+	int segment_bucket_in_ms;
+	const char *manifest_filepath;
+	const char *mel_dir;
+	int mel_bins;
+	int mel_window_in_ms;
+	int mel_hop_in_ms;
+	const char *raw_filepath;
+	bool raw_s16;
+	const char *peaks_filepath;
+	int peaks_bucket;
+	int peaks_levels;
+	bool no_audio;
+	AVDictionary *demux_opts;
+	AVDictionary *dec_opts;
+	AVDictionary *enc_opts;
+	AVDictionary *mux_opts;
 };
 
 static void error(const char *msg, ...)
@@ -62,6 +90,26 @@ static void warn(const char *msg, ...)
 /* TODO: make the docs. */
 static void usage(void) {}
 
+/* Adds the `key=value` that follows the `--*-opt=` prefix of `arg`. */
+static void parse_option(AVDictionary **opts, const char *arg)
+{
+	const char *kv = strchr(arg, '=') + 1;
+	const char *eq = strchr(kv, '=');
+	char *key;
+
+	if (!eq || eq == kv) {
+		error("Invalid argument: %s\n", arg);
+		error("Options are given as key=value.\n");
+		exit(1);
+	}
+
+	if (!(key = av_strndup(kv, eq - kv))
+	    || av_dict_set(opts, key, eq + 1, AV_DICT_DONT_STRDUP_KEY) < 0) {
+		error("Out of memory.\n");
+		exit(1);
+	}
+}
+
 static int parse_argv(struct parsed_argv *parsed, const char *const *argv, int n)
 {
 	int i;
@@ -101,6 +149,15 @@ static int parse_argv(struct parsed_argv *parsed, const char *const *argv, int n
 				error("Invalid argument: %s\n", arg);
 				exit(1);
 			}
+		} else if (strncmp(arg, "--refine-edges=", 15) == 0
+		           && !parsed->refine_edges_in_ms) {
+			double n;
+			if (sscanf(arg, "--refine-edges=%lf", &n) == 1 && n >= 0) {
+				parsed->refine_edges_in_ms = n * 1000;
+			} else {
+				error("Invalid argument: %s\n", arg);
+				exit(1);
+			}
 		} else if (strncmp(arg, "--audio-quality=", 16) == 0
 		           && !parsed->audio_quality) {
 			char choice[6];
@@ -125,12 +182,165 @@ static int parse_argv(struct parsed_argv *parsed, const char *const *argv, int n
 				error("Invalid argument: %s\n", arg);
 				exit(1);
 			}
+		} else if (strcmp(arg, "--stats") == 0) {
+			parsed->stats = true;
+		} else if (strncmp(arg, "--stats=", 8) == 0 && !parsed->stats_filepath) {
+			parsed->stats = true;
+			parsed->stats_filepath = arg + 8;
+		} else if (strncmp(arg, "--trace=", 8) == 0 && !parsed->trace_filepath) {
+			parsed->trace_filepath = arg + 8;
+		} else if (strcmp(arg, "--mmap") == 0) {
+			parsed->mmap = true;
+		} else if (strncmp(arg, "--demux-opt=", 12) == 0) {
+			parse_option(&parsed->demux_opts, arg);
+		} else if (strncmp(arg, "--dec-opt=", 10) == 0) {
+			parse_option(&parsed->dec_opts, arg);
+		} else if (strncmp(arg, "--enc-opt=", 10) == 0) {
+			parse_option(&parsed->enc_opts, arg);
+		} else if (strncmp(arg, "--mux-opt=", 10) == 0) {
+			parse_option(&parsed->mux_opts, arg);
+		} else if (strcmp(arg, "--fast-probe") == 0) {
+			parsed->fast_probe = true;
+		} else if (strcmp(arg, "--vad") == 0) {
+			parsed->vad = true;
+		} else if (strcmp(arg, "--trim-silence") == 0) {
+			parsed->trim_silence = true;
+		} else if (strcmp(arg, "--loudnorm") == 0) {
+			parsed->loudnorm = true;
+		} else if (strncmp(arg, "--loudnorm=", 11) == 0 && !parsed->loudnorm_lufs) {
+			if (sscanf(arg, "--loudnorm=%lf", &parsed->loudnorm_lufs) != 1
+			    || parsed->loudnorm_lufs >= 0) {
+				error("Invalid argument: %s\n", arg);
+				error("The target loudness is given in LUFS, e.g. --loudnorm=-16.\n");
+				exit(1);
+			}
+			parsed->loudnorm = true;
+		} else if (strcmp(arg, "--segment") == 0) {
+			parsed->segment = true;
+		} else if (strncmp(arg, "--segment-max=", 14) == 0 && !parsed->segment_max_in_ms) {
+			if (sscanf(arg, "--segment-max=%d", &parsed->segment_max_in_ms) != 1
+			    || parsed->segment_max_in_ms <= 0) {
+				error("Invalid argument: %s\n", arg);
+				error("The length is given in ms, e.g. --segment-max=20000.\n");
+				exit(1);
+			}
+			parsed->segment = true;
+		} else if (strncmp(arg, "--segment-target=", 17) == 0 && !parsed->segment_target_in_ms) {
+			if (sscanf(arg, "--segment-target=%d", &parsed->segment_target_in_ms) != 1
+			    || parsed->segment_target_in_ms <= 0) {
+				error("Invalid argument: %s\n", arg);
+				error("The length is given in ms, e.g. --segment-target=10000.\n");
+				exit(1);
+			}
+			parsed->segment = true;
+		} else if (strncmp(arg, "--segment-bucket=", 17) == 0 && !parsed->segment_bucket_in_ms) {
+			if (sscanf(arg, "--segment-bucket=%d", &parsed->segment_bucket_in_ms) != 1
+			    || parsed->segment_bucket_in_ms <= 0) {
+				error("Invalid argument: %s\n", arg);
+				error("The width is given in ms, e.g. --segment-bucket=2000.\n");
+				exit(1);
+			}
+			parsed->segment = true;
+		} else if (strncmp(arg, "--manifest=", 11) == 0 && !parsed->manifest_filepath) {
+			parsed->manifest_filepath = arg + 11;
+			parsed->segment = true;
+		} else if (strncmp(arg, "--mel=", 6) == 0 && !parsed->mel_dir) {
+			parsed->mel_dir = arg + 6;
+		} else if (strncmp(arg, "--mel-bins=", 11) == 0 && !parsed->mel_bins) {
+			if (sscanf(arg, "--mel-bins=%d", &parsed->mel_bins) != 1 || parsed->mel_bins <= 0) {
+				error("Invalid argument: %s\n", arg);
+				exit(1);
+			}
+		} else if (strncmp(arg, "--mel-window=", 13) == 0 && !parsed->mel_window_in_ms) {
+			if (sscanf(arg, "--mel-window=%d", &parsed->mel_window_in_ms) != 1
+			    || parsed->mel_window_in_ms <= 0) {
+				error("Invalid argument: %s\n", arg);
+				error("The window is given in ms, e.g. --mel-window=25.\n");
+				exit(1);
+			}
+		} else if (strncmp(arg, "--mel-hop=", 10) == 0 && !parsed->mel_hop_in_ms) {
+			if (sscanf(arg, "--mel-hop=%d", &parsed->mel_hop_in_ms) != 1
+			    || parsed->mel_hop_in_ms <= 0) {
+				error("Invalid argument: %s\n", arg);
+				error("The hop is given in ms, e.g. --mel-hop=10.\n");
+				exit(1);
+			}
+		} else if (strncmp(arg, "--raw=", 6) == 0 && !parsed->raw_filepath) {
+			parsed->raw_filepath = arg + 6;
+		} else if (strcmp(arg, "--raw-s16") == 0) {
+			parsed->raw_s16 = true;
+		} else if (strncmp(arg, "--peaks=", 8) == 0 && !parsed->peaks_filepath) {
+			parsed->peaks_filepath = arg + 8;
+		} else if (strncmp(arg, "--peaks-bucket=", 15) == 0 && !parsed->peaks_bucket) {
+			if (sscanf(arg, "--peaks-bucket=%d", &parsed->peaks_bucket) != 1
+			    || parsed->peaks_bucket <= 0) {
+				error("Invalid argument: %s\n", arg);
+				error("The bucket is given in samples, e.g. --peaks-bucket=64.\n");
+				exit(1);
+			}
+		} else if (strncmp(arg, "--peaks-levels=", 15) == 0 && !parsed->peaks_levels) {
+			if (sscanf(arg, "--peaks-levels=%d", &parsed->peaks_levels) != 1
+			    || parsed->peaks_levels <= 0) {
+				error("Invalid argument: %s\n", arg);
+				exit(1);
+			}
+		} else if (strcmp(arg, "--no-audio") == 0) {
+			parsed->no_audio = true;
+		} else if (strcmp(arg, "--readahead") == 0) {
+			parsed->readahead = true;
+		} else if (strncmp(arg, "--io-delay-ms=", 14) == 0 && !parsed->io_delay_ms) {
+			if (sscanf(arg, "--io-delay-ms=%d", &parsed->io_delay_ms) != 1
+			    || parsed->io_delay_ms < 0) {
+				error("Invalid argument: %s\n", arg);
+				exit(1);
+			}
+		} else if (strcmp(arg, "--alloc-stats") == 0) {
+			parsed->alloc_stats = true;
+		} else if (strncmp(arg, "--alloc-stats=", 14) == 0 && !parsed->alloc_stats_filepath) {
+			parsed->alloc_stats = true;
+			parsed->alloc_stats_filepath = arg + 14;
+		} else if (strncmp(arg, "--alloc-limit=", 14) == 0 && !parsed->alloc_limit) {
+			if (sscanf(arg, "--alloc-limit=%" SCNd64, &parsed->alloc_limit) != 1
+			    || parsed->alloc_limit <= 0) {
+				error("Invalid argument: %s\n", arg);
+				exit(1);
+			}
 		} else {
 			error("Invalid argument: %s\n", arg);
 			exit(1);
 		}
 	}
 
+	if (parsed->mmap && parsed->readahead) {
+		error("--mmap and --readahead cannot be used together.\n");
+		exit(1);
+	}
+
+	if (parsed->vad && parsed->sub_filepath) {
+		error("--vad and --sub cannot be used together.\n");
+		exit(1);
+	}
+
+	if (parsed->no_audio
+	    && ((!parsed->mel_dir && !parsed->raw_filepath && !parsed->peaks_filepath)
+	        || parsed->dst_audio_filepath)) {
+		error("--no-audio needs --mel, --raw or --peaks, and no --out.\n");
+		exit(1);
+	}
+
+	/* Reading stdin means a single forward pass, there is no seeking in a pipe. */
+	parsed->streaming = parsed->src_audio_filepath && strcmp(parsed->src_audio_filepath, "-") == 0;
+
+	/* A report on stdout would land in the middle of the audio. */
+	if (!parsed->no_audio
+	    && (parsed->dst_audio_filepath ? strcmp(parsed->dst_audio_filepath, "-") == 0
+	                                   : parsed->streaming)
+	    && ((parsed->stats_filepath && strcmp(parsed->stats_filepath, "-") == 0)
+	        || (parsed->alloc_stats_filepath && strcmp(parsed->alloc_stats_filepath, "-") == 0))) {
+		error("--stats=- and --alloc-stats=- cannot be used while the audio goes to stdout.\n");
+		exit(1);
+	}
+
 	return 0;
 }
 
@@ -165,303 +375,7 @@ static char *new_filename_extension(const char *filename, int filename_len,
 	return new_filename;
 }
 
-static int extract_audio_region(u8 ***dst, const u8 *const *src, int samples,
-                                int channels, enum AVSampleFormat sample_fmt,
-                                struct range length, struct range region)
-{
-	int skip, extract;
-	int ret;
-
-	assert(length.end - length.start > 0);
-	assert(region.end - region.start > 0);
-	assert(region.start >= length.start && region.end <= length.end);
-
-	{
-		i64 whole = length.end - length.start;
-		double fraction;
-
-		/* The offset of the region mark from the beginning. */
-		fraction = (double)(region.start - length.start) / whole;
-		skip = fraction * samples;
-
-		fraction = (double)(region.end - region.start) / whole;
-		extract = fraction * samples;
-	}
-
-	if ((ret = av_samples_alloc_array_and_samples(dst, NULL, channels, extract, sample_fmt, 0)) < 0)
-		return ret;
-
-	if ((ret = av_samples_copy(*dst, (u8 *const *)src, 0, skip, extract, channels, sample_fmt)) < 0) {
-		av_freep(*dst);
-		av_freep(dst);
-		return ret;
-	}
-
-	return extract;
-}
-
-static inline i64 tb2ms(struct AVRational timebase, i64 n)
-{
-	i64 ret = av_rescale_q(n, timebase, (struct AVRational){1, 1000});
-	return ret;
-}
-
-static inline i64 ms2tb(struct AVRational timebase, i64 ms)
-{
-	i64 ret = av_rescale_q(ms, (struct AVRational){1, 1000}, timebase);
-	return ret;
-}
-
-static struct range get_overlapped_region(struct range a, struct range b)
-{
-	struct range ret;
-
-	assert(!(a.end <= b.start) && !(a.start >= b.end));
-
-	ret.start = (a.start - b.start < 0) ? b.start : a.start;
-	ret.end   = (a.end   - b.end   < 0) ? a.end   : b.end;
-
-	return ret;
-}
-
-static int prepare_audio_frame_for_encoding(struct AVFrame* frame, int samples,
-                                            const struct AVCodecContext *enc)
-{
-	int ret;
-
-	if ((ret = av_channel_layout_copy(&frame->ch_layout, &enc->ch_layout)) < 0)
-		return ret;
-
-	frame->format      = enc->sample_fmt;
-	frame->sample_rate = enc->sample_rate;
-	frame->time_base   = enc->time_base;
-	frame->nb_samples  = samples;
-
-	if ((ret = av_frame_get_buffer(frame, 0)) < 0)
-		av_frame_unref(frame);
-
-	return ret;
-}
-
-/* TODO: Add the optional options for the underlying FFmpeg. */
-static int format_open_input(struct AVFormatContext **fmt_ctx, const char *filepath)
-{
-	int ret;
-
-	if ((ret = avformat_open_input(fmt_ctx, filepath, NULL, NULL)) < 0)
-		return ret;
-	if ((ret = avformat_find_stream_info(*fmt_ctx, NULL)) < 0)
-		avformat_close_input(fmt_ctx);
-
-	return ret;
-}
-
-static int format_write_audio_data(struct AVFormatContext *fmt,
-                                   struct AVCodecContext *enc,
-                                   struct AVAudioFifo *queue,
-                                   const u8 *const *buf, int samples,
-                                   i64 *next_pts)
-{
-	struct AVPacket *pkt;
-	struct AVFrame *frame;
-	bool eof_received = !buf || !samples;
-	int ret = 0;
-
-	if (!(pkt = av_packet_alloc()))
-		return AVERROR(ENOMEM);
-
-	if (!(frame = av_frame_alloc())) {
-		av_packet_free(&pkt);
-		return AVERROR(ENOMEM);
-	}
-
-	if (buf) {
-		if (queue) {
-			if ((ret = av_audio_fifo_write(queue, (void *const *)buf, samples)) < 0)
-				goto end;
-		}
-	}
-
-	/* TODO: Handle encoders that doesn't accept variable frame sizes. */
-	for (;;) {
-		if (queue) {
-			int dequeued = MIN(av_audio_fifo_size(queue), enc->frame_size);
-
-			if (!dequeued) {
-				if (!eof_received) {
-					ret = AVERROR(EAGAIN);
-					goto end;
-				}
-
-				if ((ret = avcodec_send_frame(enc, NULL)) < 0)
-					goto end;
-			} else {
-				if (dequeued < enc->frame_size && !eof_received)
-					break;
-
-				if ((ret = prepare_audio_frame_for_encoding(frame, dequeued, enc)) < 0)
-					goto end;
-
-				/* WARNING: This is wrong! Use `av_rescale_q()`. */
-				frame->pts = *next_pts;
-				*next_pts += dequeued;
-
-				if ((ret = av_audio_fifo_read(queue, (void *const *)frame->extended_data, dequeued)) < 0)
-					goto end;
-
-				if ((ret = avcodec_send_frame(enc, frame)) < 0)
-					goto end;
-
-				av_frame_unref(frame);
-			}
-		}
-
-		while ((ret = avcodec_receive_packet(enc, pkt)) == 0) {
-			ret = av_write_frame(fmt, pkt);
-			av_packet_unref(pkt);
-			if (ret < 0)
-				goto end;
-		}
-
-		if (ret == AVERROR_EOF) {
-			ret = av_write_trailer(fmt);
-			break;
-		}
-
-		if (ret != AVERROR(EAGAIN))
-			break;
-	}
-
-end:
-	av_packet_free(&pkt);
-	av_frame_free(&frame);
-	return ret;
-}
-
-static int read_packet(struct AVFormatContext *fmt_ctx, int stream_idx,
-                       struct AVPacket *pkt)
-{
-	int ret;
-
-	while ((ret = av_read_frame(fmt_ctx, pkt)) == 0) {
-		if (pkt->stream_index == stream_idx)
-			break;
-		av_packet_unref(pkt);
-	}
-
-	return ret;
-}
-
-static int codec_open_decoder(struct AVCodecContext **dec_ctx, struct AVCodecParameters *decpar)
-{
-	const struct AVCodec *dec;
-	int ret;
-
-	if (!(dec = avcodec_find_decoder(decpar->codec_id)))
-		return AVERROR_DECODER_NOT_FOUND;
-
-	if (!(*dec_ctx = avcodec_alloc_context3(dec)))
-		return AVERROR(ENOMEM);
-
-	if ((ret = avcodec_parameters_to_context(*dec_ctx, decpar)) < 0)
-		goto err_free_dec_ctx;
-
-	if ((ret = avcodec_open2(*dec_ctx, dec, NULL)) < 0)
-		goto err_free_dec_ctx;
-
-	return 0;
-
-err_free_dec_ctx:
-	avcodec_free_context(dec_ctx);
-
-	return ret;
-}
-
-static int codec_open_audio_encoder(struct AVCodecContext **enc_ctx, enum AVCodecID id,
-                                    struct audio_encoder_settings settings)
-{
-	const struct AVCodec *enc;
-	int ret;
-
-	if (!(enc = avcodec_find_encoder(id)))
-		return AVERROR_ENCODER_NOT_FOUND;
-
-	if (!(*enc_ctx = avcodec_alloc_context3(enc)))
-		return AVERROR(ENOMEM);
-
-	av_channel_layout_default(&(*enc_ctx)->ch_layout, settings.channels);
-	(*enc_ctx)->sample_rate   = settings.sample_rate;
-	(*enc_ctx)->bit_rate      = settings.bit_rate;
-	(*enc_ctx)->sample_fmt    = settings.sample_fmt;
-	(*enc_ctx)->time_base.num = 1;
-	(*enc_ctx)->time_base.den = settings.sample_rate;
-
-	if ((ret = avcodec_open2(*enc_ctx, enc, NULL)) < 0)
-		avcodec_free_context(enc_ctx);
-
-	return ret;
-}
-
-static int resampler_open(struct SwrContext          **resampler,
-                          const struct AVCodecContext *enc,
-                          const struct AVCodecContext *dec)
-{
-	int ret;
-
-	if ((ret = swr_alloc_set_opts2(resampler,
-	                               &enc->ch_layout,
-	                                enc->sample_fmt,
-	                                enc->sample_rate,
-	                               &dec->ch_layout,
-	                                dec->sample_fmt,
-	                                dec->sample_rate,
-	                               0, NULL)) < 0)
-	        return ret;
-
-	if ((ret = swr_init(*resampler)) < 0)
-		swr_free(resampler);
-
-	return ret;
-}
-
-static int resample(struct SwrContext *resampler, u8 ***dst, const u8 *const *src,
-                    int samples, int dst_channels, enum AVSampleFormat dst_sample_fmt)
-{
-	int ret;
-
-	if ((ret = av_samples_alloc_array_and_samples(dst, NULL, dst_channels, samples, dst_sample_fmt, 0)) < 0)
-		return ret;
-
-	if ((ret = swr_convert(resampler, *dst, samples, src, samples)) < 0) {
-		av_freep(*dst);
-		av_freep(dst);
-	}
-
-	return ret;
-}
-
-static int filter_streams(struct AVStream ***dst, struct AVStream **src, int n,
-                          enum AVMediaType which)
-{
-	int i, filtered;
-
-	if (!(*dst = malloc(n * sizeof(struct AVStream *))))
-		return -1; /* No memory. */
-
-	for (i = filtered = 0; i < n; ++i) {
-		if (which == src[i]->codecpar->codec_type)
-			(*dst)[filtered++] = src[i];
-	}
-
-	if (!filtered) {
-		free(*dst);
-		*dst = NULL;
-	}
-
-	return filtered;
-}
-
-static void show_streams_info(struct AVStream **s, int n)
+static void show_streams_info(struct AVStream *const *s, int n)
 {
 	int i;
 
@@ -477,416 +391,225 @@ static void show_streams_info(struct AVStream **s, int n)
 	}
 }
 
-static int choose_stream(struct AVStream **streams, int nr_streams,
-                         enum AVMediaType which)
+/* Asks the user which of the candidate streams to use. */
+static int ask_stream(void *opaque, struct AVStream *const *candidates, int nr_candidates)
 {
-	struct AVStream **filtered, *chosen = NULL;
-	int            nr_filtered;
-
-	if ((nr_filtered = filter_streams(&filtered, streams, nr_streams, which)) == -1)
-		return AVERROR(ENOMEM);
-
-	if (nr_filtered == 0)
-		return AVERROR_STREAM_NOT_FOUND;
+	enum AVMediaType which = candidates[0]->codecpar->codec_type;
+	int chosen = -1;
 
-	if (nr_filtered == 1) {
-		chosen = filtered[0];
-		goto end;
-	}
+	(void)opaque;
 
-	show_streams_info(filtered, nr_filtered);
+	show_streams_info(candidates, nr_candidates);
 
 	printf("> Choose the %s stream you wish: ", av_get_media_type_string(which));
-	while (!chosen) {
+	while (chosen < 0) {
 		int n;
 		if (scanf("%d", &n) == 1
-		    && n >= 1 && n <= nr_filtered) {
-			chosen = filtered[n-1];
+		    && n >= 1 && n <= nr_candidates) {
+			chosen = n - 1;
 		} else {
 			int c;
-			warn("> Please, enter a number between [1] and [%d]: ", nr_filtered);
+			warn("> Please, enter a number between [1] and [%d]: ", nr_candidates);
 			do {
 				/* Clear the stdin. */
 				c = getc(stdin);
-			} while (c != EOF && c != '\n');
+				if (c == EOF)
+					return AVERROR_EOF;
+			} while (c != '\n');
 		}
 	}
 
-end:
-	free(filtered);
-	return chosen->index;
+	return chosen;
 }
 
 int main(int argc, const char **argv)
 {
 	struct parsed_argv parsed_argv;
-	struct AVFormatContext *sub_fmt_ctx = NULL, *in_audio_fmt_ctx = NULL, *out_audio_fmt_ctx = NULL;
-	struct AVStream *sub_st = NULL, *in_audio_st = NULL, *out_audio_st = NULL;
-	struct AVCodecContext *audio_dec = NULL, *audio_enc = NULL;
-	struct SwrContext *resampler = NULL;
-	struct AVAudioFifo *resampled_queue = NULL;
-	struct AVPacket *pkt = NULL;
-	struct AVFrame *frame = NULL;
-	i64 prev_sub_ended_at = 0;
-	i64 next_audio_pts = 0;
-	int ret;
-
-	parse_argv(&parsed_argv, argv, argc);
-
-	if ((ret = format_open_input(&in_audio_fmt_ctx, parsed_argv.src_audio_filepath)) < 0) {
-		error("%s: failed to open media file: %s\n", parsed_argv.src_audio_filepath, av_err2str(ret));
-		goto end;
-	}
-
-	if ((ret = choose_stream(in_audio_fmt_ctx->streams, in_audio_fmt_ctx->nb_streams,
-	                         AVMEDIA_TYPE_AUDIO)) < 0) {
-	        if (ret == AVERROR_STREAM_NOT_FOUND)
-	        	error("%s: no audio streams found.\n", in_audio_fmt_ctx->url);
-		else
-			error("%s: failed to choose audio stream: %s\n", parsed_argv.src_audio_filepath, av_err2str(ret));
-		goto end;
-	}
-
-	in_audio_st = in_audio_fmt_ctx->streams[ret];
-
-	if (parsed_argv.sub_filepath) {
-		if ((ret = format_open_input(&sub_fmt_ctx, parsed_argv.sub_filepath)) < 0) {
-			error("%s: failed to open media file: %s\n", parsed_argv.sub_filepath, av_err2str(ret));
-			goto end;
-		}
-
-		if (sub_fmt_ctx->nb_streams != 1) {
-			error("%s: inavalid subtitle media file.\n");
-			error("Expected only one stream but got %d.\n", sub_fmt_ctx->nb_streams);
-			goto end;
-		}
-
-		if (sub_fmt_ctx->streams[0]->codecpar->codec_type != AVMEDIA_TYPE_SUBTITLE) {
-			error("%s: inavalid subtitle media file.\n");
-			error("Found only one stream of type %s\n",
-			      av_get_media_type_string(sub_fmt_ctx->streams[0]->codecpar->codec_type));
-			goto end;
-		}
-
-		sub_st = sub_fmt_ctx->streams[0];
-	} else {
-		warn("No subtitle file was provided.\n");
-		warn("Using file '%s' instead.\n", parsed_argv.src_audio_filepath);
-
-		if ((ret = choose_stream(in_audio_fmt_ctx->streams, in_audio_fmt_ctx->nb_streams,
-		                         AVMEDIA_TYPE_SUBTITLE)) < 0) {
-			if (ret == AVERROR_STREAM_NOT_FOUND)
-				error("%s: no subtitle streams found.\n", parsed_argv.src_audio_filepath);
-			else
-				error("%s: failed to choose subtitle stream: %s\n", parsed_argv.src_audio_filepath, av_err2str(ret));
-			goto end;
-		}
-
-		sub_st = in_audio_fmt_ctx->streams[ret];
-
-		/*
-		 * Processing audio and subtitle from the same container sucks.
-		 * For that reason, we will always have a different context for the subtitle,
-		 * even if it was found inside the same container as the input audio.
-		 */
-		if ((ret = format_open_input(&sub_fmt_ctx, parsed_argv.src_audio_filepath)) < 0) {
-			error("%s: failed to open media file: %s\n", parsed_argv.src_audio_filepath, av_err2str(ret));
-			goto end;
-		}
-	}
-
-	if ((ret = codec_open_decoder(&audio_dec, in_audio_st->codecpar)) < 0) {
-		error("%s: failed to open decoder: %s\n",
-		      avcodec_get_name(in_audio_st->codecpar->codec_id),
-		      av_err2str(ret));
-	}
-
-	{
-		struct audio_encoder_settings settings = {0};
-
-		settings.channels   = 2;
-		settings.sample_fmt = AV_SAMPLE_FMT_S16P;
-
-		switch (parsed_argv.audio_quality) {
-		default:
-		case AUDIO_QUALITY_LOW:
-			settings.sample_rate = 44100;
-			settings.bit_rate    = 64000;
-			break;
-		case AUDIO_QUALITY_MEDIUM:
-			settings.sample_rate = 44100;
-			settings.bit_rate    = 128000;
-			break;
-		case AUDIO_QUALITY_HIGH:
-			settings.sample_rate = 48000;
-			settings.bit_rate    = 256000;
-			break;
-		}
-
-		if ((ret = codec_open_audio_encoder(&audio_enc, AV_CODEC_ID_MP3, settings)) < 0) {
-			error("%s: failed to open encoder: %s\n", avcodec_get_name(AV_CODEC_ID_MP3), av_err2str(ret));
-			goto end;
-		}
-	}
-
-	if (!parsed_argv.dst_audio_filepath)
-		parsed_argv.dst_audio_filepath = parsed_argv.src_audio_filepath;
+	struct speechful_config config;
+	struct speechful *sf = NULL;
+	struct speechful_job *job = NULL;
+	char *dst_filepath = NULL;
+	int ret = 0, err;
 
-	parsed_argv.dst_audio_filepath = new_filename_extension(parsed_argv.dst_audio_filepath,
-	                                                        strlen(parsed_argv.dst_audio_filepath),
-	                                                        "mp3", 3);
-	if (!parsed_argv.dst_audio_filepath) {
-		error("Out of memory.\n");
-		goto end;
-	}
-
-	if ((ret = avformat_alloc_output_context2(&out_audio_fmt_ctx, NULL, NULL, parsed_argv.dst_audio_filepath)) < 0) {
-		error("%s: failed to open media file: %s\n", out_audio_fmt_ctx->url, av_err2str(ret));
-		goto end;
-	}
+	if (argc > 1 && strcmp(argv[1], "generate") == 0)
+		return generate_main(argc - 1, argv + 1);
 
-	/* The function above performs `av_strdup()`, so we can safely free the string. */
-	av_freep(&parsed_argv.dst_audio_filepath);
+	/* Jobs run on several threads there, so stats stay disabled. */
+	if (argc > 1 && strcmp(argv[1], "serve") == 0)
+		return serve_main(argc - 1, argv + 1);
 
-	if (!(out_audio_fmt_ctx->oformat->flags & AVFMT_NOFILE)
-	    && (ret = avio_open(&out_audio_fmt_ctx->pb, out_audio_fmt_ctx->url, AVIO_FLAG_WRITE)) < 0) {
-		error("%s: failed to open media file: %s\n", out_audio_fmt_ctx->url, av_err2str(ret));
-		goto end;
-	}
-
-	if (!(out_audio_st = avformat_new_stream(out_audio_fmt_ctx, NULL))) {
-		error("%s: failed to attach audio track: out of memory.\n", out_audio_fmt_ctx->url);
-		goto end;
-	}
+	parse_argv(&parsed_argv, argv, argc);
 
-	if ((ret = avcodec_parameters_from_context(out_audio_st->codecpar, audio_enc)) < 0) {
-		error("%s: failed to record encoder settings: %s\n",
-		       avcodec_get_name(audio_enc->codec->id), av_err2str(ret));
-		goto end;
+	/* Counting has to start before main(), so the process starts over with it asked for. */
+	if (parsed_argv.alloc_stats && !alloc_accounting_init(true)) {
+		if (!getenv(ALLOC_STATS_ENV) && setenv(ALLOC_STATS_ENV, "1", 1) == 0)
+			execv("/proc/self/exe", (char *const *)argv);
+		warn("Allocation accounting is not supported on this platform.\n");
 	}
 
-	out_audio_st->time_base.num = 1;
-	out_audio_st->time_base.den = audio_enc->sample_rate;
+	/* Caps every single av_malloc(), so a runaway allocation fails instead of swapping. */
+	if (parsed_argv.alloc_limit)
+		av_max_alloc(parsed_argv.alloc_limit);
 
-	if ((ret = avformat_write_header(out_audio_fmt_ctx, NULL)) < 0) {
-		error("%s: failed to open media file: %s\n", out_audio_fmt_ctx->url, av_err2str(ret));
-		goto end;
-	}
+	stats_init(parsed_argv.stats);
 
-	if ((ret = resampler_open(&resampler, audio_enc, audio_dec)) < 0) {
-		error("Failed to initialize audio resampler: %s\n", av_err2str(ret));
+	if (parsed_argv.trace_filepath && (ret = trace_init()) < 0) {
+		error("Failed to initialize tracing: %s\n", av_err2str(ret));
 		goto end;
 	}
 
-	/*
-	 * Some encoders doesn't accept variable frame sizes, in such case it
-	 * is pretty convenient to use a queue in order to keep track of desired encoder
-	 * frame size.
-	 */
-	if (!codec_supports(audio_enc->codec, AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
-	    && !(resampled_queue = av_audio_fifo_alloc(audio_enc->sample_fmt,
-	    	                                      audio_enc->ch_layout.nb_channels,
-	    	                                      1))) {
-		error("Failed to alloc queue: out of memory.\n");
+	if (!parsed_argv.src_audio_filepath) {
+		error("No input media file was provided.\n");
+		ret = AVERROR(EINVAL);
 		goto end;
 	}
 
-	if (!(pkt = av_packet_alloc()) || !(frame = av_frame_alloc())) {
-		error("Failed to alloc packet or frame: out of memory.\n");
-		goto end;
-	}
-
-	/* NOTE: It seems that this code is leaking the memory somewhere. */
-	while ((ret = read_packet(sub_fmt_ctx, sub_st->index, pkt)) == 0) {
-		struct range sub_time_in_ms = {0};
-
-		sub_time_in_ms.start = tb2ms(sub_st->time_base, pkt->pts) - parsed_argv.sub_padding_left_in_ms;
-		sub_time_in_ms.end   = tb2ms(sub_st->time_base, pkt->pts + pkt->duration) + parsed_argv.sub_padding_right_in_ms;
-
-		av_packet_unref(pkt);
-
-		if (sub_time_in_ms.start < prev_sub_ended_at)
-			sub_time_in_ms.start = prev_sub_ended_at;
-
-		prev_sub_ended_at = sub_time_in_ms.end;
-
-		if ((ret = av_seek_frame(
-		               in_audio_fmt_ctx,
-		               in_audio_st->index,
-		               ms2tb(in_audio_st->time_base, sub_time_in_ms.start),
-		               AVSEEK_FLAG_BACKWARD)) < 0) {
-			error("Failed to sync audio with subtitle: %s\n", av_err2str(ret));
+	speechful_config_init(&config);
+
+	config.subtitles        = parsed_argv.sub_filepath;
+	config.padding_left_ms  = parsed_argv.sub_padding_left_in_ms;
+	config.padding_right_ms = parsed_argv.sub_padding_right_in_ms;
+	config.refine_ms        = parsed_argv.refine_edges_in_ms;
+	config.fast_probe       = parsed_argv.fast_probe;
+	config.vad.enabled      = parsed_argv.vad;
+	config.trim.enabled     = parsed_argv.trim_silence;
+	config.loudness.enabled = parsed_argv.loudnorm;
+	if (parsed_argv.loudnorm_lufs)
+		config.loudness.target_lufs = parsed_argv.loudnorm_lufs;
+	config.segment.enabled  = parsed_argv.segment;
+	config.segment.manifest = parsed_argv.manifest_filepath;
+	if (parsed_argv.segment_max_in_ms)
+		config.segment.max_ms = parsed_argv.segment_max_in_ms;
+	if (parsed_argv.segment_target_in_ms)
+		config.segment.target_ms = parsed_argv.segment_target_in_ms;
+	if (parsed_argv.segment_bucket_in_ms)
+		config.segment.bucket_ms = parsed_argv.segment_bucket_in_ms;
+	config.mel.dir          = parsed_argv.mel_dir;
+	if (parsed_argv.mel_bins)
+		config.mel.bins = parsed_argv.mel_bins;
+	if (parsed_argv.mel_window_in_ms)
+		config.mel.window_ms = parsed_argv.mel_window_in_ms;
+	if (parsed_argv.mel_hop_in_ms)
+		config.mel.hop_ms = parsed_argv.mel_hop_in_ms;
+	config.raw.path         = parsed_argv.raw_filepath;
+	if (parsed_argv.raw_s16)
+		config.raw.sample_fmt = AV_SAMPLE_FMT_S16;
+	config.peaks.path       = parsed_argv.peaks_filepath;
+	if (parsed_argv.peaks_bucket)
+		config.peaks.bucket = parsed_argv.peaks_bucket;
+	if (parsed_argv.peaks_levels)
+		config.peaks.levels = parsed_argv.peaks_levels;
+	config.io_delay_ms      = parsed_argv.io_delay_ms;
+	config.demux_opts       = parsed_argv.demux_opts;
+	config.dec_opts         = parsed_argv.dec_opts;
+	config.enc_opts         = parsed_argv.enc_opts;
+	config.mux_opts         = parsed_argv.mux_opts;
+
+	if (parsed_argv.mmap)
+		config.input_backend = SPEECHFUL_INPUT_MMAP;
+	else if (parsed_argv.readahead || parsed_argv.io_delay_ms)
+		config.input_backend = SPEECHFUL_INPUT_READAHEAD;
+
+	if (parsed_argv.streaming) {
+		if (parsed_argv.vad || parsed_argv.refine_edges_in_ms || parsed_argv.segment) {
+			error("--vad, --refine-edges and --segment cannot read the media from stdin.\n");
+			ret = AVERROR(EINVAL);
 			goto end;
 		}
 
-		while ((ret = read_packet(in_audio_fmt_ctx, in_audio_st->index, pkt)) == 0) {
-			struct range audio_time_in_ms = {0};
-
-			audio_time_in_ms.start = tb2ms(in_audio_st->time_base, pkt->pts);
-			audio_time_in_ms.end   = tb2ms(in_audio_st->time_base, pkt->pts + pkt->duration);
-
-			if (audio_time_in_ms.end <= sub_time_in_ms.start) {
-				av_packet_unref(pkt);
-				continue;
-			}
-
-			if (audio_time_in_ms.start >= sub_time_in_ms.end) {
-				av_packet_unref(pkt);
-				break;
-			}
-
-			if ((ret = avcodec_send_packet(audio_dec, pkt)) < 0) {
-				error("Failed to decode audio data: %s\n", av_err2str(ret));
-				goto end;
-			}
-
-			av_packet_unref(pkt);
-
-			while ((ret = avcodec_receive_frame(audio_dec, frame)) == 0) {
-				struct range region;
-				u8         **speech_buf, **resampled_buf;
-				int          speech_samples;
-
-				audio_time_in_ms.start = tb2ms(in_audio_st->time_base, frame->pts);
-				audio_time_in_ms.end   = tb2ms(in_audio_st->time_base, frame->pts + frame->duration);
-
-				if (audio_time_in_ms.end <= sub_time_in_ms.start) {
-					av_frame_unref(frame);
-					continue;
-				}
-
-				if (audio_time_in_ms.start >= sub_time_in_ms.end) {
-					av_frame_unref(frame);
-					avcodec_flush_buffers(audio_dec);
-					break;
-				}
-
-				region = get_overlapped_region(audio_time_in_ms, sub_time_in_ms);
-
-				ret = speech_samples =
-					extract_audio_region(&speech_buf, (const u8 *const *)frame->extended_data,
-					                     frame->nb_samples, audio_dec->ch_layout.nb_channels,
-					                     audio_dec->sample_fmt, audio_time_in_ms, region);
-
-				av_frame_unref(frame);
-
-				if (ret < 0) {
-					error("Failed to extract audio region: %s\n", av_err2str(ret));
-					goto end;
-				}
-
-				ret = speech_samples =
-					resample(resampler, &resampled_buf, (const u8 *const *)speech_buf,
-					         speech_samples, audio_enc->ch_layout.nb_channels, audio_enc->sample_fmt);
-
-				av_freep(speech_buf);
-				av_freep(&speech_buf);
-
-				if (ret < 0) {
-					error("Failed to resample audio samples: %s\n", av_err2str(ret));
-					goto end;
-				}
-
-				ret = format_write_audio_data(out_audio_fmt_ctx, audio_enc, resampled_queue,
-				                               (const u8 *const *)resampled_buf, speech_samples,
-				                               &next_audio_pts);
-
-				av_freep(resampled_buf);
-				av_freep(&resampled_buf);
-
-				if (ret < 0 && ret != AVERROR(EAGAIN)) {
-					error("%s: failed to write audio data: %s\n", out_audio_fmt_ctx->url, av_err2str(ret));
-					goto end;
-				}
-			}
-
-			if (ret < 0 && ret != AVERROR(EAGAIN)) {
-				error("Failed to decode audio data: %s\n", av_err2str(ret));
-				goto end;
-			}
-		}
-
-		if (ret < 0) {
-			if (ret == AVERROR_EOF)
-				break;
-			error("%s: failed to read audio data: %s\n", parsed_argv.src_audio_filepath, av_err2str(ret));
+		if (!parsed_argv.sub_filepath) {
+			error("Reading the media from stdin requires a subtitle file (--sub).\n");
+			ret = AVERROR(EINVAL);
 			goto end;
 		}
-	}
 
-	if (ret != AVERROR_EOF) {
-		error("%s: failed to read subtitle data: %s\n", parsed_argv.sub_filepath, av_err2str(ret));
-		goto end;
+		config.input_fd = STDIN_FILENO;
+	} else {
+		config.input = parsed_argv.src_audio_filepath;
+		/* Stdin is free to ask which stream to use. */
+		config.choose_stream = ask_stream;
 	}
 
-	if ((ret = avcodec_send_packet(audio_dec, NULL)) < 0) {
-		error("Failed to flush audio decoder: %s\n", av_err2str(ret));
-		goto end;
+	if (!parsed_argv.sub_filepath && !parsed_argv.vad) {
+		warn("No subtitle file was provided.\n");
+		warn("Using file '%s' instead.\n", parsed_argv.src_audio_filepath);
 	}
 
-	while ((ret = avcodec_receive_frame(audio_dec, frame)) == 0) {
-		u8 **resampled_buf;
-		int  resampled_samples;
-
-		ret = resampled_samples =
-			resample(resampler, &resampled_buf, (const u8 *const *)frame->extended_data,
-			         frame->nb_samples, audio_enc->ch_layout.nb_channels, audio_enc->sample_fmt);
-
-		av_frame_unref(frame);
+	if (parsed_argv.no_audio) {
+		/* The features, raw PCM and peaks are the only outputs. */
+	} else if (parsed_argv.dst_audio_filepath ? strcmp(parsed_argv.dst_audio_filepath, "-") == 0
+	                                          : parsed_argv.streaming) {
+		config.output_fd = STDOUT_FILENO;
+	} else {
+		const char *dst = parsed_argv.dst_audio_filepath ? parsed_argv.dst_audio_filepath
+		                                                 : parsed_argv.src_audio_filepath;
 
-		if (ret < 0) {
-			error("Failed to resample audio samples: %s\n", av_err2str(ret));
+		if (!(dst_filepath = new_filename_extension(dst, strlen(dst), "mp3", 3))) {
+			error("Out of memory.\n");
+			ret = AVERROR(ENOMEM);
 			goto end;
 		}
 
-		ret = format_write_audio_data(out_audio_fmt_ctx, audio_enc, resampled_queue,
-		            (const u8 *const *)resampled_buf, resampled_samples, &next_audio_pts);
-
-		av_freep(resampled_buf);
-		av_freep(&resampled_buf);
+		config.output = dst_filepath;
+	}
 
-		if (ret < 0 && ret != AVERROR(EAGAIN)) {
-			error("%s: failed to write audio data: %s\n", out_audio_fmt_ctx->url, av_err2str(ret));
-			goto end;
-		}
+	switch (parsed_argv.audio_quality) {
+	default:
+	case AUDIO_QUALITY_LOW:
+		config.sample_rate = 44100;
+		config.bit_rate    = 64000;
+		break;
+	case AUDIO_QUALITY_MEDIUM:
+		config.sample_rate = 44100;
+		config.bit_rate    = 128000;
+		break;
+	case AUDIO_QUALITY_HIGH:
+		config.sample_rate = 48000;
+		config.bit_rate    = 256000;
+		break;
 	}
 
-	if (ret != AVERROR_EOF) {
-		error("Failed to flush audio decoder: %s\n", av_err2str(ret));
+	if ((ret = speechful_alloc(&sf)) < 0) {
+		error("Failed to initialize: %s\n", av_err2str(ret));
 		goto end;
 	}
 
-	/* Flush the encoder and the container format. */
-	if ((ret = format_write_audio_data(out_audio_fmt_ctx, audio_enc, resampled_queue, NULL, 0,
-	                                    &next_audio_pts)) < 0) {
-	        error("%s: failed to write audio data: %s\n", out_audio_fmt_ctx->url, av_err2str(ret));
+	/* The library describes its own failures. */
+	if ((ret = speechful_job_open(&job, sf, &config)) < 0)
 		goto end;
-	}
+
+	ret = speechful_job_run(job);
 
 end:
-	if (in_audio_fmt_ctx)
-		avformat_close_input(&in_audio_fmt_ctx);
+	/* Before the reports, so they take in the final writes, which can still fail. */
+	if ((err = speechful_job_close(&job)) < 0 && ret >= 0)
+		ret = err;
 
-	if (out_audio_fmt_ctx) {
-		if (out_audio_fmt_ctx->pb)
-			avio_closep(&out_audio_fmt_ctx->pb);
-		avformat_free_context(out_audio_fmt_ctx);
+	if (parsed_argv.stats) {
+		stats_report_summary(stderr);
+		if (parsed_argv.stats_filepath && (err = stats_report_json(parsed_argv.stats_filepath)) < 0)
+			error("%s: failed to write stats report: %s\n", parsed_argv.stats_filepath, av_err2str(err));
 	}
 
-	if (sub_fmt_ctx)
-		avformat_close_input(&sub_fmt_ctx);
-
-	if (audio_dec)
-		avcodec_free_context(&audio_dec);
+	if (parsed_argv.trace_filepath && (err = trace_flush(parsed_argv.trace_filepath)) < 0)
+		error("%s: failed to write trace: %s\n", parsed_argv.trace_filepath, av_err2str(err));
 
-	if (audio_enc)
-		avcodec_free_context(&audio_enc);
+	speechful_free(&sf);
 
-	if (resampler)
-		swr_free(&resampler);
+	av_freep(&dst_filepath);
+	av_dict_free(&parsed_argv.demux_opts);
+	av_dict_free(&parsed_argv.dec_opts);
+	av_dict_free(&parsed_argv.enc_opts);
+	av_dict_free(&parsed_argv.mux_opts);
 
-	if (resampled_queue)
-		av_audio_fifo_free(resampled_queue);
+	/* Reported last, so whatever is still live here has leaked. */
+	if (parsed_argv.alloc_stats) {
+		alloc_report_summary(stderr);
+		if (parsed_argv.alloc_stats_filepath
+		    && (err = alloc_report_json(parsed_argv.alloc_stats_filepath)) < 0)
+			error("%s: failed to write allocation report: %s\n",
+			      parsed_argv.alloc_stats_filepath, av_err2str(err));
+	}
 
-	return 0;
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/avstring.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/tx.h>
+
+#include "mel.h"
+#include "stats.h"
+
+/* Strict C99 leaves M_PI out of <math.h>. */
+#define PI 3.14159265358979323846
+
+/* The log of silence, rather than minus infinity. */
+#define MIN_ENERGY 1e-10f
+
+/* The FFT bins one mel band weighs, `weights + offset` holding their weights. */
+struct mel_band {
+	int first;
+	int length;
+	int offset;
+};
+
+struct log_mel {
+	char               *dir;
+	enum AVSampleFormat sample_fmt;
+	int                 channels;
+	int                 window;
+	int                 hop;
+	int                 nr_bands;
+	int                 fft_size;
+
+	float              *hann;
+	struct mel_band    *bands;
+	float              *weights;
+	struct AVTXContext *fft;
+	av_tx_fn            tx;
+	AVComplexFloat     *spectrum_in;
+	AVComplexFloat     *spectrum;
+	float              *power;
+
+	float              *x;        /* The cue's mono samples not framed yet. */
+	int                 len;
+	int                 capacity;
+	float              *frames;   /* The cue's features so far, `nr_bands` per frame. */
+	int                 nr_frames;
+	int                 frames_capacity;
+};
+
+static double hz2mel(double hz)
+{
+	return 2595 * log10(1 + hz / 700);
+}
+
+static double mel2hz(double mel)
+{
+	return 700 * (pow(10, mel / 2595) - 1);
+}
+
+/* Triangles evenly spaced on the mel scale from 0 Hz to the Nyquist rate, peaking at 1. */
+static int build_bands(struct log_mel *m, int sample_rate)
+{
+	double top = hz2mel(sample_rate / 2.0);
+	int nr_bins = m->fft_size / 2 + 1;
+	int b, k, n = 0;
+
+	if (!(m->bands = av_calloc(m->nr_bands, sizeof(struct mel_band)))
+	    || !(m->weights = av_malloc_array(m->nr_bands, nr_bins * sizeof(float))))
+		return AVERROR(ENOMEM);
+
+	for (b = 0; b < m->nr_bands; ++b) {
+		double lo     = mel2hz(top * b / (m->nr_bands + 1));
+		double centre = mel2hz(top * (b + 1) / (m->nr_bands + 1));
+		double hi     = mel2hz(top * (b + 2) / (m->nr_bands + 1));
+		struct mel_band *band = &m->bands[b];
+
+		band->offset = n;
+		band->first  = -1;
+
+		for (k = 0; k < nr_bins; ++k) {
+			double f = (double)k * sample_rate / m->fft_size;
+			double w = f <= lo || f >= hi ? 0
+			           : f <= centre ? (f - lo) / (centre - lo) : (hi - f) / (hi - centre);
+
+			if (w <= 0)
+				continue;
+
+			if (band->first < 0)
+				band->first = k;
+			band->length = k - band->first + 1;
+			m->weights[band->offset + band->length - 1] = w;
+		}
+
+		/* A band narrower than an FFT bin weighs nothing and stays at MIN_ENERGY. */
+		if (band->first < 0)
+			band->first = 0;
+		n += band->length;
+	}
+
+	return 0;
+}
+
+int log_mel_alloc(struct log_mel **mel, const struct speechful_mel *settings,
+                  enum AVSampleFormat sample_fmt, int channels, int sample_rate)
+{
+	enum AVSampleFormat packed = av_get_packed_sample_fmt(sample_fmt);
+	struct log_mel *m;
+	float scale = 1;
+	int ret, i;
+
+	if (packed != AV_SAMPLE_FMT_S16 && packed != AV_SAMPLE_FMT_S32
+	    && packed != AV_SAMPLE_FMT_FLT && packed != AV_SAMPLE_FMT_DBL)
+		return AVERROR(ENOSYS);
+
+	if (!(m = *mel = av_mallocz(sizeof(struct log_mel))))
+		return AVERROR(ENOMEM);
+
+	m->sample_fmt = sample_fmt;
+	m->channels   = channels;
+	m->window     = ms2samples(sample_rate, settings->window_ms);
+	m->hop        = ms2samples(sample_rate, settings->hop_ms);
+	m->nr_bands   = settings->bins;
+
+	if (m->window < 2 || m->hop < 1 || m->nr_bands < 1) {
+		ret = AVERROR(EINVAL);
+		goto err_free;
+	}
+
+	for (m->fft_size = 2; m->fft_size < m->window; m->fft_size *= 2)
+		;
+
+	if (!(m->dir = av_strdup(settings->dir))
+	    || !(m->hann = av_malloc_array(m->window, sizeof(float)))
+	    || !(m->spectrum_in = av_calloc(m->fft_size, sizeof(AVComplexFloat)))
+	    || !(m->spectrum = av_malloc_array(m->fft_size, sizeof(AVComplexFloat)))
+	    || !(m->power = av_malloc_array(m->fft_size / 2 + 1, sizeof(float)))) {
+		ret = AVERROR(ENOMEM);
+		goto err_free;
+	}
+
+	for (i = 0; i < m->window; ++i)
+		m->hann[i] = 0.5 - 0.5 * cos(2 * PI * i / (m->window - 1));
+
+	if ((ret = build_bands(m, sample_rate)) < 0)
+		goto err_free;
+
+	/* FFmpeg's own FFT, with the SIMD versions it picks for the machine. */
+	if ((ret = av_tx_init(&m->fft, &m->tx, AV_TX_FLOAT_FFT, 0, m->fft_size, &scale, 0)) < 0)
+		goto err_free;
+
+	if (mkdir(m->dir, 0777) < 0 && errno != EEXIST) {
+		ret = AVERROR(errno);
+		goto err_free;
+	}
+
+	return 0;
+
+err_free:
+	log_mel_free(mel);
+
+	return ret;
+}
+
+void log_mel_free(struct log_mel **mel)
+{
+	struct log_mel *m = *mel;
+
+	if (!m)
+		return;
+
+	av_tx_uninit(&m->fft);
+	av_freep(&m->dir);
+	av_freep(&m->hann);
+	av_freep(&m->bands);
+	av_freep(&m->weights);
+	av_freep(&m->spectrum_in);
+	av_freep(&m->spectrum);
+	av_freep(&m->power);
+	av_freep(&m->x);
+	av_freep(&m->frames);
+	av_freep(mel);
+}
+
+static float sample_at(const u8 *plane, enum AVSampleFormat packed, int i)
+{
+	switch (packed) {
+	case AV_SAMPLE_FMT_S16: return ((const int16_t *)plane)[i] / 32768.0f;
+	case AV_SAMPLE_FMT_S32: return ((const int32_t *)plane)[i] / 2147483648.0f;
+	case AV_SAMPLE_FMT_FLT: return ((const float *)plane)[i];
+	case AV_SAMPLE_FMT_DBL: return ((const double *)plane)[i];
+	default:                return 0;
+	}
+}
+
+/* Appends the channels of `buf`, averaged. */
+static void append_mono(struct log_mel *m, const u8 *const *buf, int samples)
+{
+	enum AVSampleFormat packed = av_get_packed_sample_fmt(m->sample_fmt);
+	bool planar = av_sample_fmt_is_planar(m->sample_fmt);
+	float *x = m->x + m->len;
+	int c, i;
+
+	memset(x, 0, samples * sizeof(float));
+
+	for (c = 0; c < m->channels; ++c)
+		for (i = 0; i < samples; ++i)
+			x[i] += planar ? sample_at(buf[c], packed, i)
+			               : sample_at(buf[0], packed, i * m->channels + c);
+
+	if (m->channels > 1)
+		for (i = 0; i < samples; ++i)
+			x[i] /= m->channels;
+
+	m->len += samples;
+}
+
+static void compute_frame(struct log_mel *m, const float *x, float *features)
+{
+	int nr_bins = m->fft_size / 2 + 1;
+	int i, b;
+
+	for (i = 0; i < m->window; ++i)
+		m->spectrum_in[i].re = x[i] * m->hann[i];
+
+	m->tx(m->fft, m->spectrum, m->spectrum_in, sizeof(AVComplexFloat));
+
+	for (i = 0; i < nr_bins; ++i)
+		m->power[i] = m->spectrum[i].re * m->spectrum[i].re + m->spectrum[i].im * m->spectrum[i].im;
+
+	for (b = 0; b < m->nr_bands; ++b) {
+		const struct mel_band *band = &m->bands[b];
+		const float *w = m->weights + band->offset;
+		const float *p = m->power + band->first;
+		float e = 0;
+
+		for (i = 0; i < band->length; ++i)
+			e += w[i] * p[i];
+
+		features[b] = logf(e > MIN_ENERGY ? e : MIN_ENERGY);
+	}
+}
+
+static int reserve(void **buf, int *capacity, int needed, size_t size)
+{
+	void *grown;
+
+	if (needed <= *capacity)
+		return 0;
+
+	if (!(grown = av_realloc_array(*buf, needed * 2, size)))
+		return AVERROR(ENOMEM);
+
+	*buf      = grown;
+	*capacity = needed * 2;
+
+	return 0;
+}
+
+int log_mel_write(void *opaque, const u8 *const *buf, int samples)
+{
+	struct log_mel *m = opaque;
+	struct stage_clock clock;
+	int frames = 0, pos, ret;
+
+	if ((ret = reserve((void **)&m->x, &m->capacity, m->len + samples, sizeof(float))) < 0)
+		return ret;
+
+	if (m->len + samples >= m->window)
+		frames = (m->len + samples - m->window) / m->hop + 1;
+
+	if ((ret = reserve((void **)&m->frames, &m->frames_capacity, m->nr_frames + frames,
+	                   m->nr_bands * sizeof(float))) < 0)
+		return ret;
+
+	stats_stage_begin(&clock, STAGE_FEATURES);
+
+	append_mono(m, buf, samples);
+
+	for (pos = 0; pos + m->window <= m->len; pos += m->hop)
+		compute_frame(m, m->x + pos, m->frames + (size_t)m->nr_frames++ * m->nr_bands);
+
+	memmove(m->x, m->x + pos, (m->len - pos) * sizeof(float));
+	m->len -= pos;
+
+	stats_stage_end(&clock);
+
+	return 0;
+}
+
+/*
+ * A version 1.0 .npy file: its magic, the length of the header, then the
+ * header, a Python dict literal padded with spaces to a multiple of 64
+ * bytes, then the data in C order.
+ */
+static int write_npy(const char *path, const float *data, int rows, int cols)
+{
+	const union { uint16_t n; u8 first; } order = {1};
+	char header[128];
+	u8 preamble[10] = {0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0};
+	FILE *out;
+	int len, ret = 0;
+
+	len = snprintf(header, sizeof(header), "{'descr': '%cf4', 'fortran_order': False, 'shape': (%d, %d), }",
+	               order.first ? '<' : '>', rows, cols);
+	while ((sizeof(preamble) + len + 1) % 64)
+		header[len++] = ' ';
+	header[len++] = '\n';
+
+	preamble[8] = len & 0xff;
+	preamble[9] = len >> 8;
+
+	if (!(out = fopen(path, "wb")))
+		return AVERROR(errno);
+
+	if (fwrite(preamble, 1, sizeof(preamble), out) != sizeof(preamble)
+	    || fwrite(header, 1, len, out) != (size_t)len
+	    || fwrite(data, sizeof(float) * cols, rows, out) != (size_t)rows)
+		ret = AVERROR(errno);
+
+	if (fclose(out) != 0 && !ret)
+		ret = AVERROR(errno);
+
+	return ret;
+}
+
+int log_mel_end_cue(void *opaque, int cue)
+{
+	struct log_mel *m = opaque;
+	char *path;
+	int ret;
+
+	if (!(path = av_asprintf("%s/%06d.npy", m->dir, cue)))
+		return AVERROR(ENOMEM);
+
+	if ((ret = write_npy(path, m->frames, m->nr_frames, m->nr_bands)) < 0)
+		av_log(NULL, AV_LOG_ERROR, "%s: failed to write features: %s\n", path, av_err2str(ret));
+
+	av_free(path);
+
+	/* The next cue starts framing afresh. */
+	m->len       = 0;
+	m->nr_frames = 0;
+
+	return ret;
+}
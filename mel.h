@@ -0,0 +1,24 @@
+#ifndef SPEECHFUL_MEL_H
+#define SPEECHFUL_MEL_H
+
+#include <libavutil/samplefmt.h>
+
+#include "pipeline.h"
+#include "speechful.h"
+
+/*
+ * Computes the log-mel features of the output, see `struct speechful_mel`,
+ * as a `struct cue_output`: frames are taken within a cue, never across
+ * two, and the cue's file is written when it ends. Takes s16, s32, float
+ * and double samples, planar or not.
+ */
+struct log_mel;
+
+int  log_mel_alloc(struct log_mel **mel, const struct speechful_mel *settings,
+                   enum AVSampleFormat sample_fmt, int channels, int sample_rate);
+void log_mel_free(struct log_mel **mel);
+
+int  log_mel_write(void *mel, const u8 *const *buf, int samples);
+int  log_mel_end_cue(void *mel, int cue);
+
+#endif
@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/samplefmt.h>
+
+#include "peaks.h"
+#include "stats.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define PEAKS_VERSION 1
+
+/* Each level's buckets span this many of the level before. */
+#define ZOOM 4
+
+#define MAX_LEVELS 16
+
+/* The layout of the file, see `struct speechful_peaks`; neither has padding. */
+struct peaks_header {
+	char     magic[4];
+	uint16_t version;
+	uint16_t nr_levels;
+	uint32_t sample_rate;
+	uint32_t channels;
+	uint64_t samples;
+};
+
+struct peaks_level {
+	uint32_t bucket;
+	uint32_t reserved;
+	uint64_t nr_buckets;
+};
+
+/* A bucket being filled. `samples` counts per channel. */
+struct acc {
+	float  min;
+	float  max;
+	double sum_sq;
+	i64    samples;
+};
+
+struct level {
+	i64         bucket;       /* Samples per channel in a full bucket. */
+	int16_t    *buckets;      /* Min, max and RMS of each bucket finished. */
+	i64         nr_buckets;
+	i64         capacity;
+	struct acc  acc;
+};
+
+/* Folds `n` floats into `*min`, `*max` and `*sum_sq`, which start out at whatever they hold. */
+typedef void (*reduce_fn)(const float *x, int n, float *min, float *max, float *sum_sq);
+
+struct peaks {
+	char               *path;
+	enum AVSampleFormat sample_fmt;
+	int                 channels;
+	int                 sample_rate;
+	i64                 samples;
+	reduce_fn           reduce;
+
+	struct level        levels[MAX_LEVELS];
+	int                 nr_levels;
+
+	float              *scratch;   /* Samples converted to float, planes one after another. */
+	int                 capacity;
+};
+
+static void reduce_c(const float *x, int n, float *min, float *max, float *sum_sq)
+{
+	float mn = *min, mx = *max, sq = 0;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		mn  = x[i] < mn ? x[i] : mn;
+		mx  = x[i] > mx ? x[i] : mx;
+		sq += x[i] * x[i];
+	}
+
+	*min     = mn;
+	*max     = mx;
+	*sum_sq += sq;
+}
+
+#ifdef HAVE_X86
+static inline float hmin_sse2(__m128 v)
+{
+	v = _mm_min_ps(v, _mm_movehl_ps(v, v));
+	v = _mm_min_ss(v, _mm_shuffle_ps(v, v, 1));
+
+	return _mm_cvtss_f32(v);
+}
+
+static inline float hmax_sse2(__m128 v)
+{
+	v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+	v = _mm_max_ss(v, _mm_shuffle_ps(v, v, 1));
+
+	return _mm_cvtss_f32(v);
+}
+
+static inline float hsum_sse2(__m128 v)
+{
+	v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+
+	return _mm_cvtss_f32(v);
+}
+
+static void reduce_sse2(const float *x, int n, float *min, float *max, float *sum_sq)
+{
+	__m128 mn = _mm_set1_ps(*min), mx = _mm_set1_ps(*max), sq = _mm_setzero_ps();
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128 v = _mm_loadu_ps(x + i);
+
+		mn = _mm_min_ps(mn, v);
+		mx = _mm_max_ps(mx, v);
+		sq = _mm_add_ps(sq, _mm_mul_ps(v, v));
+	}
+
+	*min     = hmin_sse2(mn);
+	*max     = hmax_sse2(mx);
+	*sum_sq += hsum_sse2(sq);
+
+	reduce_c(x + i, n - i, min, max, sum_sq);
+}
+
+__attribute__((target("avx2")))
+static void reduce_avx2(const float *x, int n, float *min, float *max, float *sum_sq)
+{
+	__m256 mn = _mm256_set1_ps(*min), mx = _mm256_set1_ps(*max), sq = _mm256_setzero_ps();
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256 v = _mm256_loadu_ps(x + i);
+
+		mn = _mm256_min_ps(mn, v);
+		mx = _mm256_max_ps(mx, v);
+		sq = _mm256_add_ps(sq, _mm256_mul_ps(v, v));
+	}
+
+	*min     = hmin_sse2(_mm_min_ps(_mm256_castps256_ps128(mn), _mm256_extractf128_ps(mn, 1)));
+	*max     = hmax_sse2(_mm_max_ps(_mm256_castps256_ps128(mx), _mm256_extractf128_ps(mx, 1)));
+	*sum_sq += hsum_sse2(_mm_add_ps(_mm256_castps256_ps128(sq), _mm256_extractf128_ps(sq, 1)));
+
+	reduce_c(x + i, n - i, min, max, sum_sq);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void reduce_neon(const float *x, int n, float *min, float *max, float *sum_sq)
+{
+	float32x4_t mn = vdupq_n_f32(*min), mx = vdupq_n_f32(*max), sq = vdupq_n_f32(0);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		float32x4_t v = vld1q_f32(x + i);
+
+		mn = vminq_f32(mn, v);
+		mx = vmaxq_f32(mx, v);
+		sq = vfmaq_f32(sq, v, v);
+	}
+
+	*min     = vminvq_f32(mn);
+	*max     = vmaxvq_f32(mx);
+	*sum_sq += vaddvq_f32(sq);
+
+	reduce_c(x + i, n - i, min, max, sum_sq);
+}
+#endif
+
+/* Picked once, from what the machine running us supports. */
+static reduce_fn pick_reduce(void)
+{
+	reduce_fn reduce = reduce_c;
+
+#if defined(HAVE_X86)
+	reduce = reduce_sse2;
+
+	if (__builtin_cpu_supports("avx2"))
+		reduce = reduce_avx2;
+#elif defined(HAVE_NEON)
+	reduce = reduce_neon;
+#endif
+
+	return reduce;
+}
+
+static void acc_reset(struct acc *acc)
+{
+	acc->min     = FLT_MAX;
+	acc->max     = -FLT_MAX;
+	acc->sum_sq  = 0;
+	acc->samples = 0;
+}
+
+int peaks_alloc(struct peaks **peaks, const struct speechful_peaks *settings,
+                enum AVSampleFormat sample_fmt, int channels, int sample_rate)
+{
+	enum AVSampleFormat packed = av_get_packed_sample_fmt(sample_fmt);
+	struct peaks *p;
+	i64 widest;
+	int i;
+
+	if (packed != AV_SAMPLE_FMT_S16 && packed != AV_SAMPLE_FMT_S32
+	    && packed != AV_SAMPLE_FMT_FLT && packed != AV_SAMPLE_FMT_DBL)
+		return AVERROR(ENOSYS);
+
+	if (settings->bucket < 1 || settings->levels < 1 || settings->levels > MAX_LEVELS)
+		return AVERROR(EINVAL);
+
+	/* The file has 32 bits for a bucket's width. */
+	for (widest = settings->bucket, i = 1; i < settings->levels; ++i)
+		widest *= ZOOM;
+	if (widest > UINT32_MAX)
+		return AVERROR(EINVAL);
+
+	if (!(p = *peaks = av_mallocz(sizeof(struct peaks))))
+		return AVERROR(ENOMEM);
+
+	if (!(p->path = av_strdup(settings->path))) {
+		av_freep(peaks);
+		return AVERROR(ENOMEM);
+	}
+
+	p->sample_fmt  = sample_fmt;
+	p->channels    = channels;
+	p->sample_rate = sample_rate;
+	p->nr_levels   = settings->levels;
+	p->reduce      = pick_reduce();
+
+	for (i = 0; i < p->nr_levels; ++i) {
+		p->levels[i].bucket = i ? p->levels[i - 1].bucket * ZOOM : settings->bucket;
+		acc_reset(&p->levels[i].acc);
+	}
+
+	return 0;
+}
+
+void peaks_free(struct peaks **peaks)
+{
+	struct peaks *p = *peaks;
+	int i;
+
+	if (!p)
+		return;
+
+	for (i = 0; i < p->nr_levels; ++i)
+		av_freep(&p->levels[i].buckets);
+	av_freep(&p->scratch);
+	av_freep(&p->path);
+	av_freep(peaks);
+}
+
+static int16_t quantise(double v)
+{
+	v *= 32767;
+
+	return v < -32767 ? -32767 : v > 32767 ? 32767 : (int16_t)lrint(v);
+}
+
+/* Stores level `l`'s bucket, full or not, and adds it to the one it is part of. */
+static int end_bucket(struct peaks *p, int l)
+{
+	struct level *level = &p->levels[l];
+	struct acc *acc = &level->acc;
+	int16_t *b;
+
+	if (level->nr_buckets == level->capacity) {
+		i64 capacity = level->capacity ? level->capacity * 2 : 1024;
+
+		if (!(b = av_realloc_array(level->buckets, capacity, 3 * sizeof(int16_t))))
+			return AVERROR(ENOMEM);
+
+		level->buckets  = b;
+		level->capacity = capacity;
+	}
+
+	b = level->buckets + level->nr_buckets++ * 3;
+	b[0] = quantise(acc->min);
+	b[1] = quantise(acc->max);
+	b[2] = quantise(sqrt(acc->sum_sq / (acc->samples * p->channels)));
+
+	if (l + 1 < p->nr_levels) {
+		struct acc *up = &p->levels[l + 1].acc;
+
+		up->min      = FFMIN(up->min, acc->min);
+		up->max      = FFMAX(up->max, acc->max);
+		up->sum_sq  += acc->sum_sq;
+		up->samples += acc->samples;
+	}
+
+	acc_reset(acc);
+
+	return 0;
+}
+
+static int reserve_scratch(struct peaks *p, int samples)
+{
+	int needed = samples * p->channels;
+	float *grown;
+
+	if (needed <= p->capacity)
+		return 0;
+
+	if (!(grown = av_realloc_array(p->scratch, needed, sizeof(float))))
+		return AVERROR(ENOMEM);
+
+	p->scratch  = grown;
+	p->capacity = needed;
+
+	return 0;
+}
+
+static void to_float(float *dst, const u8 *src, enum AVSampleFormat packed, int n)
+{
+	int i;
+
+	switch (packed) {
+	case AV_SAMPLE_FMT_S16:
+		for (i = 0; i < n; ++i)
+			dst[i] = ((const int16_t *)src)[i] / 32768.0f;
+		break;
+	case AV_SAMPLE_FMT_S32:
+		for (i = 0; i < n; ++i)
+			dst[i] = ((const int32_t *)src)[i] / 2147483648.0f;
+		break;
+	case AV_SAMPLE_FMT_DBL:
+		for (i = 0; i < n; ++i)
+			dst[i] = ((const double *)src)[i];
+		break;
+	default:
+		break;
+	}
+}
+
+int peaks_write(struct peaks *p, const u8 *const *buf, int samples)
+{
+	enum AVSampleFormat packed = av_get_packed_sample_fmt(p->sample_fmt);
+	int nr_planes = av_sample_fmt_is_planar(p->sample_fmt) ? p->channels : 1;
+	int stride = p->channels / nr_planes;
+	struct level *level = &p->levels[0];
+	struct stage_clock clock;
+	int pos, c, l, ret;
+
+	/* Float is reduced where it lies; anything else is converted first. */
+	if (packed != AV_SAMPLE_FMT_FLT && (ret = reserve_scratch(p, samples)) < 0)
+		return ret;
+
+	stats_stage_begin(&clock, STAGE_PEAKS);
+
+	if (packed != AV_SAMPLE_FMT_FLT)
+		for (c = 0; c < nr_planes; ++c)
+			to_float(p->scratch + (size_t)c * samples * stride, buf[c], packed, samples * stride);
+
+	for (pos = 0; pos < samples; ) {
+		int n = FFMIN(samples - pos, level->bucket - level->acc.samples);
+		float sum_sq = 0;
+
+		for (c = 0; c < nr_planes; ++c) {
+			const float *x = packed == AV_SAMPLE_FMT_FLT ? (const float *)buf[c]
+			                 : p->scratch + (size_t)c * samples * stride;
+
+			p->reduce(x + (size_t)pos * stride, n * stride,
+			          &level->acc.min, &level->acc.max, &sum_sq);
+		}
+
+		level->acc.sum_sq  += sum_sq;
+		level->acc.samples += n;
+		pos                += n;
+
+		for (l = 0; l < p->nr_levels && p->levels[l].acc.samples == p->levels[l].bucket; ++l) {
+			if ((ret = end_bucket(p, l)) < 0)
+				goto end;
+		}
+	}
+
+	p->samples += samples;
+	ret = 0;
+
+end:
+	stats_stage_end(&clock);
+
+	return ret;
+}
+
+int peaks_finish(struct peaks *p)
+{
+	struct peaks_header header = {
+		.magic       = {'S', 'P', 'K', 'S'},
+		.version     = PEAKS_VERSION,
+		.nr_levels   = p->nr_levels,
+		.sample_rate = p->sample_rate,
+		.channels    = p->channels,
+		.samples     = p->samples,
+	};
+	FILE *out;
+	int l, ret = 0;
+
+	for (l = 0; l < p->nr_levels; ++l)
+		if (p->levels[l].acc.samples && (ret = end_bucket(p, l)) < 0)
+			return ret;
+
+	if (!(out = fopen(p->path, "wb")))
+		return AVERROR(errno);
+
+	if (fwrite(&header, sizeof(header), 1, out) != 1)
+		ret = AVERROR(errno);
+
+	for (l = 0; l < p->nr_levels && !ret; ++l) {
+		struct peaks_level level = {p->levels[l].bucket, 0, p->levels[l].nr_buckets};
+
+		if (fwrite(&level, sizeof(level), 1, out) != 1)
+			ret = AVERROR(errno);
+	}
+
+	for (l = 0; l < p->nr_levels && !ret; ++l) {
+		const struct level *level = &p->levels[l];
+
+		if (fwrite(level->buckets, 3 * sizeof(int16_t), level->nr_buckets, out)
+		    != (size_t)level->nr_buckets)
+			ret = AVERROR(errno);
+	}
+
+	if (fclose(out) != 0 && !ret)
+		ret = AVERROR(errno);
+
+	return ret;
+}
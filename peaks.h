@@ -0,0 +1,25 @@
+#ifndef SPEECHFUL_PEAKS_H
+#define SPEECHFUL_PEAKS_H
+
+#include <libavutil/samplefmt.h>
+
+#include "pipeline.h"
+#include "speechful.h"
+
+/*
+ * Collects the waveform peaks of a stream of PCM, see `struct
+ * speechful_peaks`. Only the buckets being filled are kept at full
+ * precision; finished ones are stored as they go in the file. Takes s16,
+ * s32, float and double samples, planar or not.
+ */
+struct peaks;
+
+int  peaks_alloc(struct peaks **peaks, const struct speechful_peaks *settings,
+                 enum AVSampleFormat sample_fmt, int channels, int sample_rate);
+void peaks_free(struct peaks **peaks);
+
+int  peaks_write(struct peaks *peaks, const u8 *const *buf, int samples);
+/* Ends the buckets left partly filled and writes the file. */
+int  peaks_finish(struct peaks *peaks);
+
+#endif
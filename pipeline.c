@@ -0,0 +1,1026 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "downmix.h"
+#include "io.h"
+#include "loudness.h"
+#include "peaks.h"
+#include "pipeline.h"
+#include "polyphase.h"
+#include "stats.h"
+#include "trim.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* How many cues ahead of the current one get prefetched. */
+#define CUE_PLAN_LOOKAHEAD 2
+
+/* Demuxers read a bit around the exact position, and estimates are rough. */
+#define CUE_PLAN_SLACK (64 * 1024)
+
+/* Probing limits of the fast open. */
+#define FAST_PROBESIZE           (256 * 1024)
+#define FAST_ANALYZEDURATION     (AV_TIME_BASE / 2)
+
+/*
+ * Both `length` and `region` are expressed in samples of the same timeline, so
+ * the region boundaries map straight into offsets of `src`.
+ */
+int extract_audio_region(u8 ***dst, const u8 *const *src, int samples,
+                         int channels, enum AVSampleFormat sample_fmt,
+                         struct range length, struct range region)
+{
+	struct stage_clock clock;
+	int skip, extract;
+	int ret;
+
+	assert(length.end - length.start == samples);
+	assert(region.end - region.start > 0);
+	assert(region.start >= length.start && region.end <= length.end);
+
+	/* The offset of the region mark from the beginning. */
+	skip    = region.start - length.start;
+	extract = region.end   - region.start;
+
+	stats_stage_begin(&clock, STAGE_EXTRACT);
+
+	if ((ret = av_samples_alloc_array_and_samples(dst, NULL, channels, extract, sample_fmt, 0)) < 0)
+		goto end;
+
+	if ((ret = av_samples_copy(*dst, (u8 *const *)src, 0, skip, extract, channels, sample_fmt)) < 0) {
+		av_freep(*dst);
+		av_freep(dst);
+		goto end;
+	}
+
+	ret = extract;
+
+end:
+	stats_stage_end(&clock);
+	return ret;
+}
+
+struct range get_overlapped_region(struct range a, struct range b)
+{
+	struct range ret;
+
+	assert(!(a.end <= b.start) && !(a.start >= b.end));
+
+	ret.start = (a.start - b.start < 0) ? b.start : a.start;
+	ret.end   = (a.end   - b.end   < 0) ? a.end   : b.end;
+
+	return ret;
+}
+
+int prepare_audio_frame_for_encoding(struct AVFrame* frame, int samples,
+                                     const struct AVCodecContext *enc)
+{
+	int ret;
+
+	if ((ret = av_channel_layout_copy(&frame->ch_layout, &enc->ch_layout)) < 0)
+		return ret;
+
+	frame->format      = enc->sample_fmt;
+	frame->sample_rate = enc->sample_rate;
+	frame->time_base   = enc->time_base;
+	frame->nb_samples  = samples;
+
+	if ((ret = av_frame_get_buffer(frame, 0)) < 0)
+		av_frame_unref(frame);
+
+	return ret;
+}
+
+/*
+ * Whether the streams we may pick carry enough parameters to be decoded. The
+ * duration is only demanded before probing, afterwards it may be unknowable.
+ */
+static bool stream_info_complete(const struct AVFormatContext *fmt_ctx, bool need_duration)
+{
+	unsigned i;
+
+	if (!fmt_ctx->nb_streams || (fmt_ctx->ctx_flags & AVFMTCTX_NOHEADER))
+		return false;
+
+	for (i = 0; i < fmt_ctx->nb_streams; ++i) {
+		const struct AVCodecParameters *par = fmt_ctx->streams[i]->codecpar;
+
+		switch (par->codec_type) {
+		case AVMEDIA_TYPE_AUDIO:
+			if (par->codec_id == AV_CODEC_ID_NONE || par->sample_rate <= 0
+			    || par->ch_layout.nb_channels <= 0)
+				return false;
+			if (need_duration && fmt_ctx->duration == AV_NOPTS_VALUE)
+				return false;
+			break;
+		case AVMEDIA_TYPE_SUBTITLE:
+			if (par->codec_id == AV_CODEC_ID_NONE)
+				return false;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return true;
+}
+
+int format_open_input(struct AVFormatContext **fmt_ctx, const char *filepath,
+                      struct AVIOContext *pb, bool fast, struct AVDictionary **opts)
+{
+	struct stage_clock clock;
+	i64 probesize, analyzeduration;
+	int ret;
+
+	stats_stage_begin(&clock, STAGE_PROBE);
+
+	if (!(*fmt_ctx = avformat_alloc_context())) {
+		ret = AVERROR(ENOMEM);
+		goto end;
+	}
+
+	(*fmt_ctx)->pb = pb;
+	probesize       = (*fmt_ctx)->probesize;
+	analyzeduration = (*fmt_ctx)->max_analyze_duration;
+
+	/* Limits the user asked for are theirs to keep, for the whole probe. */
+	if (opts && (av_dict_get(*opts, "probesize", NULL, 0)
+	             || av_dict_get(*opts, "analyzeduration", NULL, 0)))
+		fast = false;
+
+	if (fast) {
+		(*fmt_ctx)->probesize            = FAST_PROBESIZE;
+		(*fmt_ctx)->max_analyze_duration = FAST_ANALYZEDURATION;
+	}
+
+	/* On failure the context is freed, but a custom `pb` stays with the caller. */
+	if ((ret = avformat_open_input(fmt_ctx, filepath, NULL, opts)) < 0)
+		goto end;
+
+	/* Containers such as MKV and MP4 describe their streams in the header. */
+	if (fast && stream_info_complete(*fmt_ctx, true))
+		goto probed;
+
+	if ((ret = avformat_find_stream_info(*fmt_ctx, NULL)) < 0)
+		goto err_close;
+
+	if (fast && !stream_info_complete(*fmt_ctx, false)) {
+		(*fmt_ctx)->probesize            = probesize;
+		(*fmt_ctx)->max_analyze_duration = analyzeduration;
+
+		stats_count(COUNTER_PROBE_FALLBACKS, 1);
+		if ((ret = avformat_find_stream_info(*fmt_ctx, NULL)) < 0)
+			goto err_close;
+	}
+
+probed:
+	if ((*fmt_ctx)->pb)
+		stats_count(COUNTER_PROBE_BYTES, (*fmt_ctx)->pb->bytes_read);
+	goto end;
+
+err_close:
+	avformat_close_input(fmt_ctx);
+end:
+	stats_stage_end(&clock);
+
+	return ret;
+}
+
+static int encoder_receive_packet(struct AVCodecContext *enc, struct AVPacket *pkt)
+{
+	struct stage_clock clock;
+	int ret;
+
+	stats_stage_begin(&clock, STAGE_ENCODE);
+	ret = avcodec_receive_packet(enc, pkt);
+	stats_stage_end(&clock);
+
+	return ret;
+}
+
+int decoder_send_packet(struct AVCodecContext *dec, const struct AVPacket *pkt)
+{
+	struct stage_clock clock;
+	int ret;
+
+	stats_stage_begin(&clock, STAGE_DECODE);
+	ret = avcodec_send_packet(dec, pkt);
+	stats_stage_end(&clock);
+
+	return ret;
+}
+
+int decoder_receive_frame(struct AVCodecContext *dec, struct AVFrame *frame)
+{
+	struct stage_clock clock;
+	int ret;
+
+	stats_stage_begin(&clock, STAGE_DECODE);
+	ret = avcodec_receive_frame(dec, frame);
+	stats_stage_end(&clock);
+
+	if (ret == 0) {
+		stats_count(COUNTER_FRAMES_DECODED, 1);
+		stats_count(COUNTER_SAMPLES_IN, frame->nb_samples);
+	}
+
+	return ret;
+}
+
+static void copy_samples(u8 *const *dst, const u8 *const *src, int samples,
+                         int channels, enum AVSampleFormat sample_fmt)
+{
+	bool planar = av_sample_fmt_is_planar(sample_fmt);
+	int size = samples * av_get_bytes_per_sample(sample_fmt) * (planar ? 1 : channels);
+	int i;
+
+	for (i = 0; i < (planar ? channels : 1); ++i)
+		memcpy(dst[i], src[i], size);
+}
+
+int format_write_audio_data(struct AVFormatContext *fmt,
+                            const struct speechful_sink *sink,
+                            struct AVCodecContext *enc,
+                            struct AVAudioFifo *queue,
+                            const u8 *const *buf, int samples,
+                            i64 *next_pts)
+{
+	struct AVPacket *pkt;
+	struct AVFrame *frame;
+	struct stage_clock clock;
+	bool eof_received = !buf || !samples;
+	int ret = 0;
+
+	if (!(pkt = av_packet_alloc()))
+		return AVERROR(ENOMEM);
+
+	if (!(frame = av_frame_alloc())) {
+		av_packet_free(&pkt);
+		return AVERROR(ENOMEM);
+	}
+
+	if (buf && queue) {
+		if ((ret = av_audio_fifo_write(queue, (void *const *)buf, samples)) < 0)
+			goto end;
+	} else if (!queue) {
+		/* An encoder taking frames of any size gets `buf` as it is. */
+		if (!eof_received) {
+			if ((ret = prepare_audio_frame_for_encoding(frame, samples, enc)) < 0)
+				goto end;
+
+			copy_samples(frame->extended_data, buf, samples,
+			             enc->ch_layout.nb_channels, enc->sample_fmt);
+
+			frame->pts = *next_pts;
+			*next_pts += samples;
+		}
+
+		stats_stage_begin(&clock, STAGE_ENCODE);
+		ret = avcodec_send_frame(enc, eof_received ? NULL : frame);
+		stats_stage_end(&clock);
+		av_frame_unref(frame);
+		if (ret < 0)
+			goto end;
+
+		if (!eof_received)
+			stats_count(COUNTER_SAMPLES_OUT, samples);
+	}
+
+	for (;;) {
+		if (queue) {
+			int dequeued = MIN(av_audio_fifo_size(queue), enc->frame_size);
+
+			if (!dequeued) {
+				if (!eof_received) {
+					ret = AVERROR(EAGAIN);
+					goto end;
+				}
+
+				stats_stage_begin(&clock, STAGE_ENCODE);
+				ret = avcodec_send_frame(enc, NULL);
+				stats_stage_end(&clock);
+				if (ret < 0)
+					goto end;
+			} else {
+				if (dequeued < enc->frame_size && !eof_received)
+					break;
+
+				if ((ret = prepare_audio_frame_for_encoding(frame, dequeued, enc)) < 0)
+					goto end;
+
+				/* The encoder time base is 1/sample_rate, so the pts is a sample index. */
+				frame->pts = *next_pts;
+				*next_pts += dequeued;
+
+				if ((ret = av_audio_fifo_read(queue, (void *const *)frame->extended_data, dequeued)) < 0)
+					goto end;
+
+				stats_stage_begin(&clock, STAGE_ENCODE);
+				ret = avcodec_send_frame(enc, frame);
+				stats_stage_end(&clock);
+				if (ret < 0)
+					goto end;
+
+				stats_count(COUNTER_SAMPLES_OUT, dequeued);
+				av_frame_unref(frame);
+			}
+		}
+
+		while ((ret = encoder_receive_packet(enc, pkt)) == 0) {
+			stats_count(COUNTER_BYTES_WRITTEN, pkt->size);
+			stats_stage_begin(&clock, STAGE_WRITE);
+
+			if (sink && sink->packet)
+				ret = sink->packet(sink->opaque, pkt);
+
+			if (ret >= 0 && fmt) {
+				av_packet_rescale_ts(pkt, enc->time_base, fmt->streams[0]->time_base);
+				ret = av_write_frame(fmt, pkt);
+			}
+
+			stats_stage_end(&clock);
+
+			av_packet_unref(pkt);
+			if (ret < 0)
+				goto end;
+		}
+
+		if (ret == AVERROR_EOF) {
+			ret = 0;
+			if (fmt) {
+				stats_stage_begin(&clock, STAGE_WRITE);
+				ret = av_write_trailer(fmt);
+				stats_stage_end(&clock);
+			}
+			break;
+		}
+
+		/* Without a queue there is nothing more to send until the next call. */
+		if (ret != AVERROR(EAGAIN) || !queue)
+			break;
+	}
+
+end:
+	av_packet_free(&pkt);
+	av_frame_free(&frame);
+	return ret;
+}
+
+int read_packet(struct AVFormatContext *fmt_ctx, int stream_idx,
+                struct AVPacket *pkt)
+{
+	struct stage_clock clock;
+	int ret;
+
+	stats_stage_begin(&clock, STAGE_READ);
+
+	while ((ret = av_read_frame(fmt_ctx, pkt)) == 0) {
+		stats_count(COUNTER_PACKETS_READ, 1);
+		if (pkt->stream_index == stream_idx)
+			break;
+		stats_count(COUNTER_PACKETS_DISCARDED, 1);
+		av_packet_unref(pkt);
+	}
+
+	stats_stage_end(&clock);
+
+	return ret;
+}
+
+int cue_table_append(struct cue_table *table, struct range cue)
+{
+	if (table->nr_cues == table->capacity) {
+		int capacity = table->capacity ? table->capacity * 2 : 64;
+		struct range *cues;
+
+		if (!(cues = av_realloc_array(table->cues, capacity, sizeof(struct range))))
+			return AVERROR(ENOMEM);
+
+		table->cues     = cues;
+		table->capacity = capacity;
+	}
+
+	table->cues[table->nr_cues++] = cue;
+	return 0;
+}
+
+void cue_table_free(struct cue_table *table)
+{
+	av_freep(&table->cues);
+	table->nr_cues = table->capacity = 0;
+}
+
+static int compare_cues(const void *a, const void *b)
+{
+	const struct range *x = a, *y = b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+void cue_table_settle(struct cue_table *table)
+{
+	i64 prev_cue_ended_at = 0;
+	int i, kept;
+
+	qsort(table->cues, table->nr_cues, sizeof(struct range), compare_cues);
+
+	for (i = kept = 0; i < table->nr_cues; ++i) {
+		struct range cue = table->cues[i];
+
+		if (cue.start < prev_cue_ended_at)
+			cue.start = prev_cue_ended_at;
+
+		if (cue.end <= cue.start)
+			continue;
+
+		prev_cue_ended_at = cue.end;
+		table->cues[kept++] = cue;
+	}
+
+	table->nr_cues = kept;
+}
+
+/*
+ * Reads every subtitle packet of `st` and records its (padded) time span as a
+ * range of samples at `sample_rate`, then settles the table.
+ */
+int cue_table_load(struct cue_table *table, struct AVFormatContext *fmt_ctx,
+                   struct AVStream *st, int sample_rate,
+                   i64 padding_left_in_ms, i64 padding_right_in_ms)
+{
+	struct AVPacket *pkt;
+	i64 padding_left  = ms2samples(sample_rate, padding_left_in_ms);
+	i64 padding_right = ms2samples(sample_rate, padding_right_in_ms);
+	int ret;
+
+	if (!(pkt = av_packet_alloc()))
+		return AVERROR(ENOMEM);
+
+	while ((ret = read_packet(fmt_ctx, st->index, pkt)) == 0) {
+		struct range cue;
+
+		cue.start = tb2samples(st->time_base, sample_rate, pkt->pts) - padding_left;
+		cue.end   = tb2samples(st->time_base, sample_rate, pkt->pts + pkt->duration) + padding_right;
+
+		av_packet_unref(pkt);
+
+		if ((ret = cue_table_append(table, cue)) < 0)
+			break;
+	}
+
+	av_packet_free(&pkt);
+
+	if (ret != AVERROR_EOF)
+		return ret;
+
+	cue_table_settle(table);
+
+	return 0;
+}
+
+/*
+ * Finds the byte offset of `sample` through the stream index, or estimates it
+ * from the bitrate when the container has none. Returns -1 when unknown.
+ */
+static i64 byte_position(struct AVFormatContext *fmt_ctx, struct AVStream *st,
+                         int sample_rate, i64 sample, int flags)
+{
+	const struct AVIndexEntry *entry;
+	i64 ts = samples2tb(st->time_base, sample_rate, FFMAX(sample, 0));
+
+	if ((entry = avformat_index_get_entry_from_timestamp(st, ts, flags)))
+		return entry->pos;
+
+	if (fmt_ctx->bit_rate > 0)
+		return av_rescale(FFMAX(sample, 0), fmt_ctx->bit_rate, sample_rate * 8LL);
+
+	return -1;
+}
+
+int cue_plan_init(struct cue_plan *plan, struct AVIOContext *pb,
+                  struct AVFormatContext *fmt_ctx, struct AVStream *st, int sample_rate,
+                  const struct cue_table *cues)
+{
+	int i;
+
+	memset(plan, 0, sizeof(struct cue_plan));
+
+	if (!pb || !cues->nr_cues)
+		return 0;
+
+	if (!(plan->bytes = av_malloc_array(cues->nr_cues, sizeof(struct range))))
+		return AVERROR(ENOMEM);
+
+	for (i = 0; i < cues->nr_cues; ++i) {
+		i64 start = byte_position(fmt_ctx, st, sample_rate, cues->cues[i].start, AVSEEK_FLAG_BACKWARD);
+		i64 end   = byte_position(fmt_ctx, st, sample_rate, cues->cues[i].end, 0);
+
+		if (start < 0 || end < 0) {
+			plan->bytes[i].start = plan->bytes[i].end = 0;
+			continue;
+		}
+
+		plan->bytes[i].start = FFMAX(start - CUE_PLAN_SLACK, 0);
+		plan->bytes[i].end   = end + CUE_PLAN_SLACK;
+	}
+
+	plan->pb      = pb;
+	plan->nr_cues = cues->nr_cues;
+
+	return 0;
+}
+
+void cue_plan_enter(struct cue_plan *plan, int cue)
+{
+	if (!plan->pb)
+		return;
+
+	for (; plan->hinted < MIN(cue + 1 + CUE_PLAN_LOOKAHEAD, plan->nr_cues); ++plan->hinted) {
+		const struct range *r = &plan->bytes[plan->hinted];
+		if (r->end > r->start)
+			io_hint(plan->pb, r->start, r->end - r->start, IO_HINT_WILLNEED);
+	}
+
+	if (cue > 0 && cue <= plan->nr_cues) {
+		struct range done = plan->bytes[cue - 1];
+
+		/* Keep whatever the next cue still shares with this one. */
+		if (cue < plan->nr_cues)
+			done.end = MIN(done.end, plan->bytes[cue].start);
+
+		if (done.end > done.start)
+			io_hint(plan->pb, done.start, done.end - done.start, IO_HINT_DONTNEED);
+	}
+}
+
+void cue_plan_free(struct cue_plan *plan)
+{
+	av_freep(&plan->bytes);
+	plan->pb = NULL;
+}
+
+int codec_open_decoder(struct AVCodecContext **dec_ctx, const struct AVCodec *dec,
+                       struct AVCodecParameters *decpar, struct AVDictionary **opts)
+{
+	int ret;
+
+	if (!dec)
+		return AVERROR_DECODER_NOT_FOUND;
+
+	if (!(*dec_ctx = avcodec_alloc_context3(dec)))
+		return AVERROR(ENOMEM);
+
+	if ((ret = avcodec_parameters_to_context(*dec_ctx, decpar)) < 0)
+		goto err_free_dec_ctx;
+
+	if ((ret = avcodec_open2(*dec_ctx, dec, opts)) < 0)
+		goto err_free_dec_ctx;
+
+	return 0;
+
+err_free_dec_ctx:
+	avcodec_free_context(dec_ctx);
+
+	return ret;
+}
+
+int codec_open_audio_encoder(struct AVCodecContext **enc_ctx, const struct AVCodec *enc,
+                             struct audio_encoder_settings settings, struct AVDictionary **opts)
+{
+	int ret;
+
+	if (!enc)
+		return AVERROR_ENCODER_NOT_FOUND;
+
+	if (!(*enc_ctx = avcodec_alloc_context3(enc)))
+		return AVERROR(ENOMEM);
+
+	av_channel_layout_default(&(*enc_ctx)->ch_layout, settings.channels);
+	(*enc_ctx)->sample_rate   = settings.sample_rate;
+	(*enc_ctx)->bit_rate      = settings.bit_rate;
+	(*enc_ctx)->sample_fmt    = settings.sample_fmt;
+	(*enc_ctx)->time_base.num = 1;
+	(*enc_ctx)->time_base.den = settings.sample_rate;
+
+	if ((ret = avcodec_open2(*enc_ctx, enc, opts)) < 0)
+		avcodec_free_context(enc_ctx);
+
+	return ret;
+}
+
+/*
+ * swr, unless our own stages cover the conversion: the downmix alone at an
+ * unchanged rate, or the polyphase filter first with the downmix after it
+ * at the new rate, `mid` holding what passes between them.
+ */
+struct resampler {
+	struct SwrContext *swr;
+	struct polyphase  *polyphase;
+	struct downmix    *downmix;
+	u8               **mid;
+	int                mid_capacity;
+	int                mid_channels;
+};
+
+static int resampler_open_own(struct resampler                    *r,
+                              const struct audio_encoder_settings *dst,
+                              const struct AVCodecContext         *dec)
+{
+	int ret;
+
+	ret = downmix_open(&r->downmix, &dec->ch_layout, dec->sample_fmt, dec->sample_rate,
+	                   dst->channels, dst->sample_fmt, dst->sample_rate);
+	if (ret != AVERROR(ENOSYS))
+		return ret;
+
+	if ((ret = polyphase_open(&r->polyphase, dec->ch_layout.nb_channels, dec->sample_fmt,
+	                          dec->sample_rate, dst->sample_rate)) < 0)
+		return ret;
+
+	r->mid_channels = dec->ch_layout.nb_channels;
+
+	if ((ret = downmix_open(&r->downmix, &dec->ch_layout, AV_SAMPLE_FMT_FLTP, dst->sample_rate,
+	                        dst->channels, dst->sample_fmt, dst->sample_rate)) < 0)
+		polyphase_free(&r->polyphase);
+
+	return ret;
+}
+
+int resampler_open(struct resampler                    **resampler,
+                   const struct audio_encoder_settings *dst,
+                   const struct AVCodecContext         *dec)
+{
+	struct AVChannelLayout dst_layout;
+	struct resampler *r;
+	int ret;
+
+	if (!(r = *resampler = av_mallocz(sizeof(struct resampler))))
+		return AVERROR(ENOMEM);
+
+	if ((ret = resampler_open_own(r, dst, dec)) != AVERROR(ENOSYS))
+		goto end;
+
+	av_channel_layout_default(&dst_layout, dst->channels);
+
+	if ((ret = swr_alloc_set_opts2(&r->swr,
+	                               &dst_layout,
+	                                dst->sample_fmt,
+	                                dst->sample_rate,
+	                               &dec->ch_layout,
+	                                dec->sample_fmt,
+	                                dec->sample_rate,
+	                               0, NULL)) < 0)
+	        goto end;
+
+	ret = swr_init(r->swr);
+
+end:
+	if (ret < 0)
+		resampler_free(resampler);
+
+	return ret;
+}
+
+int resampler_reset(struct resampler *resampler)
+{
+	if (resampler->polyphase)
+		polyphase_reset(resampler->polyphase);
+
+	return resampler->swr ? swr_init(resampler->swr) : 0;
+}
+
+static void free_mid(struct resampler *resampler)
+{
+	if (resampler->mid)
+		av_freep(resampler->mid);
+	av_freep(&resampler->mid);
+	resampler->mid_capacity = 0;
+}
+
+void resampler_free(struct resampler **resampler)
+{
+	if (!*resampler)
+		return;
+
+	swr_free(&(*resampler)->swr);
+	polyphase_free(&(*resampler)->polyphase);
+	downmix_free(&(*resampler)->downmix);
+	free_mid(*resampler);
+	av_freep(resampler);
+}
+
+static int reserve_mid(struct resampler *resampler, int samples)
+{
+	int ret;
+
+	if (samples <= resampler->mid_capacity)
+		return 0;
+
+	free_mid(resampler);
+
+	if ((ret = av_samples_alloc_array_and_samples(&resampler->mid, NULL, resampler->mid_channels,
+	                                              samples, AV_SAMPLE_FMT_FLTP, 0)) < 0)
+		return ret;
+
+	resampler->mid_capacity = samples;
+
+	return 0;
+}
+
+int resample(struct resampler *resampler, u8 ***dst, const u8 *const *src,
+             int samples, int dst_channels, enum AVSampleFormat dst_sample_fmt)
+{
+	struct stage_clock clock;
+	int capacity, ret;
+
+	/* Rate conversion may yield more samples than it was given, plus its own delay. */
+	if (resampler->polyphase)
+		capacity = polyphase_out_samples(resampler->polyphase, samples);
+	else if (resampler->downmix)
+		capacity = samples;
+	else if ((capacity = swr_get_out_samples(resampler->swr, samples)) < 0)
+		return capacity;
+
+	if (resampler->polyphase && (ret = reserve_mid(resampler, capacity)) < 0)
+		return ret;
+
+	if ((ret = av_samples_alloc_array_and_samples(dst, NULL, dst_channels, capacity, dst_sample_fmt, 0)) < 0)
+		return ret;
+
+	stats_stage_begin(&clock, STAGE_RESAMPLE);
+	if (resampler->polyphase) {
+		if ((ret = polyphase_run(resampler->polyphase, resampler->mid, src, samples)) > 0)
+			downmix_run(resampler->downmix, *dst, (const u8 *const *)resampler->mid, ret);
+	} else if (resampler->downmix) {
+		downmix_run(resampler->downmix, *dst, src, samples);
+		ret = samples;
+	} else {
+		ret = swr_convert(resampler->swr, *dst, capacity, src, samples);
+	}
+	stats_stage_end(&clock);
+
+	if (ret < 0) {
+		av_freep(*dst);
+		av_freep(dst);
+	}
+
+	return ret;
+}
+
+static int split_end_cue(struct cue_split *split)
+{
+	int i, ret;
+
+	for (i = 0; i < split->nr_outputs; ++i)
+		if ((ret = split->outputs[i].end(split->outputs[i].opaque, split->nr_delivered)) < 0)
+			return ret;
+
+	split->nr_delivered++;
+
+	return 0;
+}
+
+/* Planes a split output can take, as many as swr does. */
+#define MAX_SPLIT_PLANES 64
+
+/* Hands `buf` to the outputs split by cue, ending each cue where its last sample went. */
+static int split_write(struct audio_output *out, const u8 *const *buf, int samples)
+{
+	struct cue_split *split = &out->split;
+	bool planar = av_sample_fmt_is_planar(out->settings.sample_fmt);
+	int planes  = planar ? out->settings.channels : 1;
+	int stride  = av_get_bytes_per_sample(out->settings.sample_fmt) * (planar ? 1 : out->settings.channels);
+	const u8 *at[MAX_SPLIT_PLANES];
+	int done = 0, n, i, ret;
+
+	for (;;) {
+		while (split->nr_delivered < split->nr_ends
+		       && split->ends[split->nr_delivered] <= split->delivered)
+			if ((ret = split_end_cue(split)) < 0)
+				return ret;
+
+		if (done == samples)
+			return 0;
+
+		n = samples - done;
+		if (split->nr_delivered < split->nr_ends
+		    && split->ends[split->nr_delivered] - split->delivered < n)
+			n = split->ends[split->nr_delivered] - split->delivered;
+
+		for (i = 0; i < planes; ++i)
+			at[i] = buf[i] + (size_t)done * stride;
+
+		for (i = 0; i < split->nr_outputs; ++i)
+			if ((ret = split->outputs[i].write(split->outputs[i].opaque, at, n)) < 0)
+				return ret;
+
+		done             += n;
+		split->delivered += n;
+	}
+}
+
+static int audio_output_encode(void *opaque, const u8 *const *buf, int samples)
+{
+	struct audio_output *out = opaque;
+	struct speechful_sink *sink = &out->sink;
+	int ret;
+
+	if (sink->pcm && samples && (ret = sink->pcm(sink->opaque, buf, samples)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "PCM sink failed: %s\n", av_err2str(ret));
+		return ret;
+	}
+
+	if (out->peaks && (ret = peaks_write(out->peaks, buf, samples)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "Failed to collect waveform peaks: %s\n", av_err2str(ret));
+		return ret;
+	}
+
+	if (out->split.nr_outputs && (ret = split_write(out, buf, samples)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "Failed to write the output of a cue: %s\n", av_err2str(ret));
+		return ret;
+	}
+
+	/*
+	 * Without an encoder the PCM sink is the only output. No samples, as
+	 * resampling may leave, would read as the end of the stream.
+	 */
+	if (out->enc && samples) {
+		ret = format_write_audio_data(out->fmt, sink, out->enc, out->queue,
+		                              buf, samples, &out->next_pts);
+		if (ret < 0 && ret != AVERROR(EAGAIN)) {
+			av_log(NULL, AV_LOG_ERROR, "%s: failed to write audio data: %s\n",
+			       out->fmt ? out->fmt->url : "packet sink", av_err2str(ret));
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int audio_output_emit(void *opaque, const u8 *const *buf, int samples)
+{
+	struct audio_output *out = opaque;
+	u8 **resampled_buf;
+	int ret;
+
+	out->split.emitted += samples;
+
+	ret = samples = resample(out->resampler, &resampled_buf, buf, samples,
+	                         out->settings.channels, out->settings.sample_fmt);
+	if (ret < 0) {
+		av_log(NULL, AV_LOG_ERROR, "Failed to resample audio samples: %s\n", av_err2str(ret));
+		return ret;
+	}
+
+	if (!out->loudness)
+		ret = audio_output_encode(out, (const u8 *const *)resampled_buf, samples);
+	else if ((ret = loudness_write(out->loudness, (const u8 *const *)resampled_buf, samples)) < 0)
+		av_log(NULL, AV_LOG_ERROR, "Failed to normalise loudness: %s\n", av_err2str(ret));
+
+	av_freep(resampled_buf);
+	av_freep(&resampled_buf);
+
+	return ret;
+}
+
+int audio_output_write(struct audio_output *out, const u8 *const *buf, int samples)
+{
+	int ret;
+
+	if (!out->trim)
+		return audio_output_emit(out, buf, samples);
+
+	if ((ret = trim_write(out->trim, buf, samples)) < 0)
+		av_log(NULL, AV_LOG_ERROR, "Failed to trim silence: %s\n", av_err2str(ret));
+
+	return ret;
+}
+
+int audio_output_trim(struct audio_output *out, const struct speechful_trim *settings,
+                      const struct AVCodecContext *dec)
+{
+	return trim_alloc(&out->trim, settings, dec->sample_fmt, dec->ch_layout.nb_channels,
+	                  dec->sample_rate, audio_output_emit, out);
+}
+
+int audio_output_normalise(struct audio_output *out, const struct speechful_loudness *settings)
+{
+	return loudness_alloc(&out->loudness, settings, out->settings.sample_fmt,
+	                      out->settings.channels, out->settings.sample_rate,
+	                      audio_output_encode, out);
+}
+
+int audio_output_peaks(struct audio_output *out, const struct speechful_peaks *settings)
+{
+	return peaks_alloc(&out->peaks, settings, out->settings.sample_fmt,
+	                   out->settings.channels, out->settings.sample_rate);
+}
+
+int audio_output_flush(struct audio_output *out)
+{
+	int ret;
+
+	if (out->trim && (ret = trim_flush(out->trim)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "Failed to trim silence: %s\n", av_err2str(ret));
+		return ret;
+	}
+
+	if (out->loudness && (ret = loudness_flush(out->loudness)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "Failed to normalise loudness: %s\n", av_err2str(ret));
+		return ret;
+	}
+
+	/* Whatever the resampler still holds is never flushed, so the last cues may end short. */
+	while (out->split.nr_delivered < out->split.nr_ends) {
+		if ((ret = split_end_cue(&out->split)) < 0) {
+			av_log(NULL, AV_LOG_ERROR, "Failed to write the output of a cue: %s\n", av_err2str(ret));
+			return ret;
+		}
+	}
+
+	if (out->peaks && (ret = peaks_finish(out->peaks)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "Failed to write waveform peaks: %s\n", av_err2str(ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+int audio_output_split(struct audio_output *out, const struct cue_output *output,
+                       const struct AVCodecContext *dec)
+{
+	struct cue_split *split = &out->split;
+
+	if (split->nr_outputs == MAX_CUE_OUTPUTS)
+		return AVERROR(ENOSPC);
+
+	if (av_sample_fmt_is_planar(out->settings.sample_fmt)
+	    && out->settings.channels > MAX_SPLIT_PLANES) {
+		av_log(NULL, AV_LOG_ERROR, "Outputs split by cue take at most %d channels.\n",
+		       MAX_SPLIT_PLANES);
+		return AVERROR(ENOSYS);
+	}
+
+	split->outputs[split->nr_outputs++] = *output;
+	split->in_rate = dec->sample_rate;
+
+	return 0;
+}
+
+int audio_output_begin_cue(struct audio_output *out, int cue)
+{
+	struct cue_split *split = &out->split;
+	int ret;
+
+	if (!split->nr_outputs || cue <= split->cue)
+		return 0;
+
+	if (out->trim && (ret = trim_flush(out->trim)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "Failed to trim silence: %s\n", av_err2str(ret));
+		return ret;
+	}
+
+	if (split->nr_ends + cue - split->cue > split->capacity) {
+		int capacity = (split->nr_ends + cue - split->cue) * 2;
+		i64 *ends;
+
+		if (!(ends = av_realloc_array(split->ends, capacity, sizeof(i64))))
+			return AVERROR(ENOMEM);
+
+		split->ends     = ends;
+		split->capacity = capacity;
+	}
+
+	for (; split->cue < cue; ++split->cue)
+		split->ends[split->nr_ends++] = av_rescale(split->emitted, out->settings.sample_rate,
+		                                           split->in_rate);
+
+	return 0;
+}
+
+int audio_output_write_region(struct audio_output *out, const struct AVFrame *frame,
+                              struct range frame_samples, struct range region)
+{
+	u8 **speech_buf;
+	int channels = frame->ch_layout.nb_channels;
+	int speech_samples;
+	int ret;
+
+	ret = speech_samples =
+		extract_audio_region(&speech_buf, (const u8 *const *)frame->extended_data,
+		                     frame->nb_samples, channels, frame->format,
+		                     frame_samples, region);
+	if (ret < 0) {
+		av_log(NULL, AV_LOG_ERROR, "Failed to extract audio region: %s\n", av_err2str(ret));
+		return ret;
+	}
+
+	ret = audio_output_write(out, (const u8 *const *)speech_buf, speech_samples);
+
+	av_freep(speech_buf);
+	av_freep(&speech_buf);
+
+	return ret;
+}
@@ -0,0 +1,247 @@
+#ifndef SPEECHFUL_PIPELINE_H
+#define SPEECHFUL_PIPELINE_H
+
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+#include <libavutil/avutil.h>
+#include <libavutil/audio_fifo.h>
+
+#include "speechful.h"
+
+typedef uint8_t u8;
+typedef int64_t i64;
+
+struct range {
+	i64 start;
+	i64 end;
+};
+
+/*
+ * The speech regions that will be extracted, in samples of the input audio
+ * stream's sample rate, ordered and free of overlaps.
+ */
+struct cue_table {
+	struct range *cues;
+	int           nr_cues;
+	int           capacity;
+};
+
+/*
+ * The byte ranges of the input each cue is expected to read, so the input
+ * backend can be told ahead of time. Without a `pb` the plan does nothing.
+ */
+struct cue_plan {
+	struct AVIOContext *pb;
+	struct range       *bytes;
+	int                 nr_cues;
+	int                 hinted;
+};
+
+struct audio_encoder_settings {
+	int                 channels;
+	int                 sample_rate;
+	int                 bit_rate;
+	enum AVSampleFormat sample_fmt;
+};
+
+/* Receives PCM from one of the stages of `struct audio_output`. */
+typedef int (*pcm_fn)(void *opaque, const u8 *const *buf, int samples);
+
+/* Told that cue `cue` is over; everything it made has been written. */
+typedef int (*cue_fn)(void *opaque, int cue);
+
+/* An output that takes the PCM cut at cue boundaries, see `audio_output_begin_cue()`. */
+struct cue_output {
+	void  *opaque;
+	pcm_fn write;
+	cue_fn end;
+};
+
+#define MAX_CUE_OUTPUTS 4
+
+/*
+ * Where the cues end in the output: the decoded samples passed on to
+ * resampling, scaled to the output rate. Resampling keeps the first sample
+ * in place, and the stages after it only delay, so that is where the
+ * resampled ones end too.
+ */
+struct cue_split {
+	struct cue_output outputs[MAX_CUE_OUTPUTS];
+	int               nr_outputs;
+	int               in_rate;
+	int               cue;            /* The one being written. */
+	i64               emitted;        /* Decoded samples passed on to resampling. */
+	i64              *ends;           /* In output samples, one per cue begun since. */
+	int               nr_ends;
+	int               capacity;
+	int               nr_delivered;   /* Cues the outputs were told the end of. */
+	i64               delivered;      /* Samples the outputs were given. */
+};
+
+struct silence_trim;
+struct loudness;
+struct peaks;
+struct resampler;
+
+/*
+ * Everything after decoding: silence trimming, resampling to `settings`,
+ * loudness normalisation, then the PCM sink, the peaks and the outputs
+ * split by cue, encoder frame queueing, encoding, and the packet sink and
+ * muxer. `trim`, `loudness`, `peaks`, `enc` and `fmt` are optional.
+ */
+struct audio_output {
+	struct audio_encoder_settings settings;
+	struct speechful_sink         sink;
+	struct cue_split              split;
+	struct silence_trim          *trim;
+	struct loudness              *loudness;
+	struct peaks                 *peaks;
+	struct AVFormatContext       *fmt;
+	struct AVCodecContext        *enc;
+	struct resampler             *resampler;
+	struct AVAudioFifo           *queue;
+	i64                           next_pts;
+};
+
+/* Converts a timestamp in `timebase` units into a sample index at `sample_rate`. */
+static inline i64 tb2samples(struct AVRational timebase, int sample_rate, i64 n)
+{
+	i64 ret = av_rescale_q(n, timebase, (struct AVRational){1, sample_rate});
+	return ret;
+}
+
+static inline i64 samples2tb(struct AVRational timebase, int sample_rate, i64 n)
+{
+	i64 ret = av_rescale_q(n, (struct AVRational){1, sample_rate}, timebase);
+	return ret;
+}
+
+static inline i64 ms2samples(int sample_rate, i64 ms)
+{
+	i64 ret = av_rescale(ms, sample_rate, 1000);
+	return ret;
+}
+
+/*
+ * Copies the samples of `region` out of `src`, whose samples span `length`.
+ * Returns the number of samples extracted into the newly allocated `*dst`.
+ */
+int extract_audio_region(u8 ***dst, const u8 *const *src, int samples,
+                         int channels, enum AVSampleFormat sample_fmt,
+                         struct range length, struct range region);
+
+struct range get_overlapped_region(struct range a, struct range b);
+
+int prepare_audio_frame_for_encoding(struct AVFrame *frame, int samples,
+                                     const struct AVCodecContext *enc);
+
+/*
+ * Opens `filepath`, or reads through `pb` instead when it is not NULL. With
+ * `fast`, stream parameters are taken from the container header when it has
+ * them all, and are otherwise probed with small limits first; a full probe
+ * only runs when that still leaves streams undescribed. A `probesize` or
+ * `analyzeduration` in `opts` turns `fast` off.
+ */
+int format_open_input(struct AVFormatContext **fmt_ctx, const char *filepath,
+                      struct AVIOContext *pb, bool fast, struct AVDictionary **opts);
+
+/*
+ * Queues `samples` of `buf` and encodes them whenever a full encoder frame is
+ * available, handing the packets to `sink` and `fmt`, either of which may be
+ * NULL. Without a `queue`, for encoders taking frames of any size, `buf` is
+ * encoded as one frame. A NULL `buf` flushes the encoder and writes the
+ * trailer. Returns AVERROR(EAGAIN) while waiting for more samples.
+ */
+int format_write_audio_data(struct AVFormatContext *fmt,
+                            const struct speechful_sink *sink,
+                            struct AVCodecContext *enc,
+                            struct AVAudioFifo *queue,
+                            const u8 *const *buf, int samples,
+                            i64 *next_pts);
+
+/* Reads the next packet that belongs to `stream_idx`. */
+int read_packet(struct AVFormatContext *fmt_ctx, int stream_idx, struct AVPacket *pkt);
+
+int decoder_send_packet(struct AVCodecContext *dec, const struct AVPacket *pkt);
+int decoder_receive_frame(struct AVCodecContext *dec, struct AVFrame *frame);
+
+int  cue_table_load(struct cue_table *table, struct AVFormatContext *fmt_ctx,
+                    struct AVStream *st, int sample_rate,
+                    i64 padding_left_in_ms, i64 padding_right_in_ms);
+void cue_table_free(struct cue_table *table);
+int  cue_table_append(struct cue_table *table, struct range cue);
+/* Sorts the cues by start, clips the ones overlapping their predecessor and drops the empty ones. */
+void cue_table_settle(struct cue_table *table);
+
+int  cue_plan_init(struct cue_plan *plan, struct AVIOContext *pb,
+                   struct AVFormatContext *fmt_ctx, struct AVStream *st, int sample_rate,
+                   const struct cue_table *cues);
+/* Called when cue `cue` starts: prefetches the cues ahead and drops the one behind. */
+void cue_plan_enter(struct cue_plan *plan, int cue);
+void cue_plan_free(struct cue_plan *plan);
+
+/*
+ * `opts` may be NULL. As with the FFmpeg open calls they wrap, options that
+ * were applied are removed from it and the unknown ones are left behind.
+ */
+int codec_open_decoder(struct AVCodecContext **dec_ctx, const struct AVCodec *dec,
+                       struct AVCodecParameters *decpar, struct AVDictionary **opts);
+int codec_open_audio_encoder(struct AVCodecContext **enc_ctx, const struct AVCodec *enc,
+                             struct audio_encoder_settings settings, struct AVDictionary **opts);
+
+/*
+ * Converts decoded audio to `dst`. Conversions our own stages cover, see
+ * downmix.h and polyphase.h, skip swr; the rest go through it.
+ */
+int  resampler_open(struct resampler                    **resampler,
+                    const struct audio_encoder_settings *dst,
+                    const struct AVCodecContext         *dec);
+/* Starts over as if just opened. */
+int  resampler_reset(struct resampler *resampler);
+void resampler_free(struct resampler **resampler);
+int  resample(struct resampler *resampler, u8 ***dst, const u8 *const *src,
+              int samples, int dst_channels, enum AVSampleFormat dst_sample_fmt);
+
+/*
+ * Resamples decoded audio and hands it to the encoder. Waiting for a full
+ * encoder frame is not an error; failures are logged.
+ */
+int audio_output_write(struct audio_output *out, const u8 *const *buf, int samples);
+
+/* Trims the silence of the decoded audio `dec` produces before resampling it. */
+int audio_output_trim(struct audio_output *out, const struct speechful_trim *settings,
+                      const struct AVCodecContext *dec);
+
+/* Normalises the loudness of the resampled audio before it is encoded. */
+int audio_output_normalise(struct audio_output *out, const struct speechful_loudness *settings);
+
+/* Collects the waveform peaks of the audio as it is encoded. */
+int audio_output_peaks(struct audio_output *out, const struct speechful_peaks *settings);
+
+/*
+ * Passes on the samples held back by the trimmer and normaliser, ends the
+ * cues still open at the outputs and writes the peaks; call before
+ * flushing the encoder.
+ */
+int audio_output_flush(struct audio_output *out);
+
+/* Adds an output that takes the PCM cue by cue, of the audio `dec` decodes. */
+int audio_output_split(struct audio_output *out, const struct cue_output *output,
+                       const struct AVCodecContext *dec);
+
+/*
+ * Tells the output that the audio written next belongs to cue `cue`, so
+ * every cue before it is over; pass the number of cues once all are done.
+ * Cues skipped over end empty. With outputs split by cue, silence held by
+ * the trimmer is passed on here, so a pause is never trimmed across cues.
+ */
+int audio_output_begin_cue(struct audio_output *out, int cue);
+
+/* Same as above, for the `region` of a decoded frame spanning `frame_samples`. */
+int audio_output_write_region(struct audio_output *out, const struct AVFrame *frame,
+                              struct range frame_samples, struct range region);
+
+#endif
@@ -0,0 +1,347 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <math.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/samplefmt.h>
+
+#include "polyphase.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Strict C99 leaves M_PI out of <math.h>. */
+#define PI 3.14159265358979323846
+
+/*
+ * The passband ends where the transition band is centred, as a fraction of
+ * the output's Nyquist rate; the Kaiser window's beta puts the stopband
+ * near -80 dB. Both, with the filter lengths below, are picked so nothing
+ * above the output's Nyquist rate folds back below 7.9 kHz at 16 kHz.
+ */
+#define CUTOFF 0.9
+#define BETA   8.0
+
+#define LANES 8
+
+/*
+ * The conversions covered. `up / down` is `out_rate / in_rate` in lowest
+ * terms, so there are `up` phases; `taps` is the length of each, a multiple
+ * of LANES so the kernels have no tail to finish.
+ */
+static const struct ratio {
+	int in_rate;
+	int out_rate;
+	int up;
+	int down;
+	int taps;
+} ratios[] = {
+	{48000, 16000,   1,   3, 144},
+	{48000, 24000,   1,   2,  96},
+	{44100, 16000, 160, 441, 144},
+	{44100, 24000,  80, 147,  96},
+};
+
+typedef float (*dot_fn)(const float *h, const float *x, int n);
+
+struct polyphase {
+	const struct ratio *ratio;
+	float              *bank;  /* `up` rows of `taps`, each reversed to run along the input. */
+	dot_fn              dot;
+
+	int                 channels;
+	float             **x;     /* Input not yet entirely used, per channel. */
+	int                 len;
+	int                 capacity;
+	int                 pos;   /* The newest input sample the next output sample reads. */
+	int                 phase; /* Its row of `bank`. */
+};
+
+static float dot_c(const float *h, const float *x, int n)
+{
+	float acc[LANES] = {0}, s = 0;
+	int i, j;
+
+	for (i = 0; i < n; i += LANES)
+		for (j = 0; j < LANES; ++j)
+			acc[j] += h[i + j] * x[i + j];
+
+	for (j = 0; j < LANES; ++j)
+		s += acc[j];
+
+	return s;
+}
+
+#ifdef HAVE_X86
+static inline float hsum_sse2(__m128 v)
+{
+	v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+
+	return _mm_cvtss_f32(v);
+}
+
+static float dot_sse2(const float *h, const float *x, int n)
+{
+	__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+	int i;
+
+	for (i = 0; i < n; i += 8) {
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(h + i), _mm_loadu_ps(x + i)));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(h + i + 4), _mm_loadu_ps(x + i + 4)));
+	}
+
+	return hsum_sse2(_mm_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *h, const float *x, int n)
+{
+	__m256 acc = _mm256_setzero_ps();
+	int i;
+
+	for (i = 0; i < n; i += 8)
+		acc = _mm256_fmadd_ps(_mm256_loadu_ps(h + i), _mm256_loadu_ps(x + i), acc);
+
+	return hsum_sse2(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+}
+#endif
+
+#ifdef HAVE_NEON
+static float dot_neon(const float *h, const float *x, int n)
+{
+	float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+	int i;
+
+	for (i = 0; i < n; i += 8) {
+		acc0 = vfmaq_f32(acc0, vld1q_f32(h + i), vld1q_f32(x + i));
+		acc1 = vfmaq_f32(acc1, vld1q_f32(h + i + 4), vld1q_f32(x + i + 4));
+	}
+
+	return vaddvq_f32(vaddq_f32(acc0, acc1));
+}
+#endif
+
+/* Picked once, from what the machine running us supports. */
+static dot_fn pick_dot(void)
+{
+	dot_fn dot = dot_c;
+
+#if defined(HAVE_X86)
+	dot = dot_sse2;
+
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		dot = dot_avx2;
+#elif defined(HAVE_NEON)
+	dot = dot_neon;
+#endif
+
+	return dot;
+}
+
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	int k;
+
+	for (k = 1; term > sum * 1e-12; ++k) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum  += term;
+	}
+
+	return sum;
+}
+
+/*
+ * A Kaiser-windowed sinc at `up` times the input rate, centred on the
+ * middle of its `up * taps` coefficients, dealt out into one row per phase.
+ * Each row is scaled to a gain of exactly 1 at DC.
+ */
+static int build_bank(struct polyphase *pp)
+{
+	const struct ratio *r = pp->ratio;
+	double centre = r->up * r->taps / 2.0;
+	double fc     = CUTOFF * r->out_rate / 2 / ((double)r->in_rate * r->up);
+	int p, k;
+
+	if (!(pp->bank = av_malloc_array(r->up * r->taps, sizeof(float))))
+		return AVERROR(ENOMEM);
+
+	for (p = 0; p < r->up; ++p) {
+		float *row = pp->bank + p * r->taps;
+		double sum = 0;
+
+		for (k = 0; k < r->taps; ++k) {
+			double t = p + k * r->up - centre;
+			double u = t / centre;
+			double h = t == 0 ? 2 * fc : sin(2 * PI * fc * t) / (PI * t);
+
+			h *= bessel_i0(BETA * sqrt(u * u < 1 ? 1 - u * u : 0)) / bessel_i0(BETA);
+			row[r->taps - 1 - k] = h;
+			sum += h;
+		}
+
+		for (k = 0; k < r->taps; ++k)
+			row[k] /= sum;
+	}
+
+	return 0;
+}
+
+int polyphase_open(struct polyphase **pp, int channels, enum AVSampleFormat in_fmt,
+                   int in_rate, int out_rate)
+{
+	const struct ratio *ratio = NULL;
+	struct polyphase *p;
+	int ret, i;
+
+	*pp = NULL;
+
+	for (i = 0; i < (int)(sizeof(ratios) / sizeof(ratios[0])); ++i)
+		if (ratios[i].in_rate == in_rate && ratios[i].out_rate == out_rate)
+			ratio = &ratios[i];
+
+	if (!ratio || in_fmt != AV_SAMPLE_FMT_FLTP || channels < 1)
+		return AVERROR(ENOSYS);
+
+	if (!(p = *pp = av_mallocz(sizeof(struct polyphase))))
+		return AVERROR(ENOMEM);
+
+	p->ratio    = ratio;
+	p->channels = channels;
+	p->dot      = pick_dot();
+	p->capacity = ratio->taps * 2;
+
+	if ((ret = build_bank(p)) < 0)
+		goto err_free;
+
+	if (!(p->x = av_calloc(channels, sizeof(float *)))) {
+		ret = AVERROR(ENOMEM);
+		goto err_free;
+	}
+
+	for (i = 0; i < channels; ++i) {
+		if (!(p->x[i] = av_malloc_array(p->capacity, sizeof(float)))) {
+			ret = AVERROR(ENOMEM);
+			goto err_free;
+		}
+	}
+
+	polyphase_reset(p);
+
+	return 0;
+
+err_free:
+	polyphase_free(pp);
+
+	return ret;
+}
+
+void polyphase_free(struct polyphase **pp)
+{
+	struct polyphase *p = *pp;
+	int i;
+
+	if (!p)
+		return;
+
+	if (p->x)
+		for (i = 0; i < p->channels; ++i)
+			av_freep(&p->x[i]);
+	av_freep(&p->x);
+	av_freep(&p->bank);
+	av_freep(pp);
+}
+
+/*
+ * The input before the first sample is taken as silence, just enough of it
+ * for the first output sample to line up with the first input sample.
+ */
+void polyphase_reset(struct polyphase *pp)
+{
+	int i;
+
+	pp->len   = pp->ratio->taps / 2 - 1;
+	pp->pos   = pp->ratio->taps - 1;
+	pp->phase = 0;
+
+	for (i = 0; i < pp->channels; ++i)
+		memset(pp->x[i], 0, pp->len * sizeof(float));
+}
+
+int polyphase_out_samples(const struct polyphase *pp, int in_samples)
+{
+	return (int)((i64)in_samples * pp->ratio->up / pp->ratio->down) + 1;
+}
+
+static int reserve(struct polyphase *pp, int samples)
+{
+	int capacity = pp->len + samples, i;
+
+	if (capacity <= pp->capacity)
+		return 0;
+
+	for (i = 0; i < pp->channels; ++i) {
+		float *x;
+
+		if (!(x = av_realloc_array(pp->x[i], capacity, sizeof(float))))
+			return AVERROR(ENOMEM);
+		pp->x[i] = x;
+	}
+
+	pp->capacity = capacity;
+
+	return 0;
+}
+
+int polyphase_run(struct polyphase *pp, u8 *const *dst, const u8 *const *src, int samples)
+{
+	const struct ratio *r = pp->ratio;
+	int n = 0, pos = 0, phase = 0, c, drop, ret;
+
+	if ((ret = reserve(pp, samples)) < 0)
+		return ret;
+
+	for (c = 0; c < pp->channels; ++c)
+		memcpy(pp->x[c] + pp->len, src[c], samples * sizeof(float));
+	pp->len += samples;
+
+	for (c = 0; c < pp->channels; ++c) {
+		const float *x = pp->x[c];
+		float *y = (float *)dst[c];
+
+		pos   = pp->pos;
+		phase = pp->phase;
+
+		for (n = 0; pos < pp->len; ++n) {
+			y[n] = pp->dot(pp->bank + phase * r->taps, x + pos - r->taps + 1, r->taps);
+
+			phase += r->down;
+			pos   += phase / r->up;
+			phase %= r->up;
+		}
+	}
+
+	/* Every channel walked the same way, where the last one stopped holds for all. */
+	pp->pos   = pos;
+	pp->phase = phase;
+
+	/* Only what the next output sample reads onwards is kept. */
+	drop = pp->pos - r->taps + 1;
+	if (drop > pp->len)
+		drop = pp->len;
+
+	for (c = 0; c < pp->channels; ++c)
+		memmove(pp->x[c], pp->x[c] + drop, (pp->len - drop) * sizeof(float));
+	pp->len -= drop;
+	pp->pos -= drop;
+
+	return n;
+}
@@ -0,0 +1,27 @@
+#ifndef SPEECHFUL_POLYPHASE_H
+#define SPEECHFUL_POLYPHASE_H
+
+#include <libavutil/samplefmt.h>
+
+#include "pipeline.h"
+
+/*
+ * Converts planar float between the few rates speech output uses, 48 and
+ * 44.1 kHz down to 16 and 24 kHz, with a windowed sinc filter split into
+ * one phase per output position. Channels are left as they are, and any
+ * other conversion is AVERROR(ENOSYS), left to swr.
+ */
+struct polyphase;
+
+int  polyphase_open(struct polyphase **pp, int channels, enum AVSampleFormat in_fmt,
+                    int in_rate, int out_rate);
+void polyphase_free(struct polyphase **pp);
+/* Starts over as if just opened. */
+void polyphase_reset(struct polyphase *pp);
+
+/* The most samples `polyphase_run()` can return for `in_samples` more. */
+int  polyphase_out_samples(const struct polyphase *pp, int in_samples);
+/* Returns how many samples were written to `dst`, or an AVERROR. */
+int  polyphase_run(struct polyphase *pp, u8 *const *dst, const u8 *const *src, int samples);
+
+#endif
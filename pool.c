@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+#include <libavutil/avutil.h>
+#include <libavutil/mem.h>
+
+#include "pipeline.h"
+#include "pool.h"
+#include "speechful.h"
+
+/* Enough for the few formats a worker sees in practice. */
+#define POOL_SIZE 16
+
+/* Encoders to open again between jobs, see `speechful_pool_refill()`. */
+#define MAX_SPARES 4
+
+enum context_kind {
+	CONTEXT_DECODER,
+	CONTEXT_ENCODER,
+	CONTEXT_RESAMPLER,
+};
+
+/* Fields a kind does not use stay zeroed. Lookup keys borrow their pointers. */
+struct context_key {
+	enum context_kind      kind;
+	enum AVCodecID         codec;
+	int                    in_rate;
+	int                    in_format;
+	struct AVChannelLayout in_layout;
+	int                    out_rate;
+	int                    out_format;
+	struct AVChannelLayout out_layout;
+	i64                    bit_rate;
+	const u8              *extradata;
+	int                    extradata_size;
+};
+
+struct pool_entry {
+	struct context_key key;
+	void              *ctx; /* NULL for a free slot. */
+	i64                last_used;
+};
+
+/* An encoder that could not be restarted, to be replaced by a fresh one. */
+struct spare {
+	const struct AVCodec         *codec;
+	struct audio_encoder_settings settings;
+};
+
+struct speechful_pool {
+	struct pool_entry entries[POOL_SIZE];
+	i64               clock;
+	struct spare      spares[MAX_SPARES];
+	int               nr_spares;
+};
+
+int speechful_pool_alloc(struct speechful_pool **pool)
+{
+	if (!(*pool = av_mallocz(sizeof(struct speechful_pool))))
+		return AVERROR(ENOMEM);
+
+	return 0;
+}
+
+static void free_context(enum context_kind kind, void **ctx)
+{
+	if (kind == CONTEXT_RESAMPLER)
+		resampler_free((struct resampler **)ctx);
+	else
+		avcodec_free_context((struct AVCodecContext **)ctx);
+}
+
+static void entry_clear(struct pool_entry *e)
+{
+	if (e->ctx)
+		free_context(e->key.kind, &e->ctx);
+
+	av_channel_layout_uninit(&e->key.in_layout);
+	av_channel_layout_uninit(&e->key.out_layout);
+	av_freep(&e->key.extradata);
+	memset(e, 0, sizeof(struct pool_entry));
+}
+
+void speechful_pool_free(struct speechful_pool **pool)
+{
+	int i;
+
+	if (!*pool)
+		return;
+
+	for (i = 0; i < POOL_SIZE; ++i)
+		entry_clear(&(*pool)->entries[i]);
+
+	av_freep(pool);
+}
+
+static bool key_equal(const struct context_key *a, const struct context_key *b)
+{
+	return a->kind == b->kind && a->codec == b->codec
+	    && a->in_rate == b->in_rate && a->in_format == b->in_format
+	    && a->out_rate == b->out_rate && a->out_format == b->out_format
+	    && a->bit_rate == b->bit_rate
+	    && !av_channel_layout_compare(&a->in_layout, &b->in_layout)
+	    && !av_channel_layout_compare(&a->out_layout, &b->out_layout)
+	    && a->extradata_size == b->extradata_size
+	    && (!a->extradata_size || !memcmp(a->extradata, b->extradata, a->extradata_size));
+}
+
+static void *take(struct speechful_pool *pool, const struct context_key *key)
+{
+	int i;
+
+	for (i = 0; i < POOL_SIZE; ++i) {
+		struct pool_entry *e = &pool->entries[i];
+		void *ctx;
+
+		if (!e->ctx || !key_equal(&e->key, key))
+			continue;
+
+		ctx = e->ctx;
+		e->ctx = NULL;
+		entry_clear(e);
+
+		return ctx;
+	}
+
+	return NULL;
+}
+
+/* Stores `*ctx` under a deep copy of `key`, evicting the least recently given one if full. */
+static void give(struct speechful_pool *pool, const struct context_key *key, void **ctx)
+{
+	struct pool_entry *e = NULL;
+	int i;
+
+	for (i = 0; i < POOL_SIZE; ++i) {
+		struct pool_entry *candidate = &pool->entries[i];
+
+		if (!candidate->ctx) {
+			e = candidate;
+			break;
+		}
+		if (!e || candidate->last_used < e->last_used)
+			e = candidate;
+	}
+
+	entry_clear(e);
+
+	e->key = *key;
+	e->key.extradata = NULL;
+	memset(&e->key.in_layout,  0, sizeof(e->key.in_layout));
+	memset(&e->key.out_layout, 0, sizeof(e->key.out_layout));
+
+	if (av_channel_layout_copy(&e->key.in_layout, &key->in_layout) < 0
+	    || av_channel_layout_copy(&e->key.out_layout, &key->out_layout) < 0
+	    || (key->extradata_size
+	        && !(e->key.extradata = av_memdup(key->extradata, key->extradata_size)))) {
+		entry_clear(e);
+		free_context(key->kind, ctx);
+		return;
+	}
+
+	e->ctx       = *ctx;
+	e->last_used = ++pool->clock;
+	*ctx = NULL;
+}
+
+static void decoder_key(struct context_key *key, const struct AVCodecParameters *par)
+{
+	memset(key, 0, sizeof(struct context_key));
+	key->kind           = CONTEXT_DECODER;
+	key->codec          = par->codec_id;
+	key->in_rate        = par->sample_rate;
+	key->in_format      = par->format;
+	key->in_layout      = par->ch_layout;
+	key->extradata      = par->extradata;
+	key->extradata_size = par->extradata_size;
+}
+
+static void encoder_key(struct context_key *key, enum AVCodecID id,
+                        const struct audio_encoder_settings *settings)
+{
+	memset(key, 0, sizeof(struct context_key));
+	key->kind       = CONTEXT_ENCODER;
+	key->codec      = id;
+	key->out_rate   = settings->sample_rate;
+	key->out_format = settings->sample_fmt;
+	key->bit_rate   = settings->bit_rate;
+	av_channel_layout_default(&key->out_layout, settings->channels);
+}
+
+static void resampler_key(struct context_key *key, const struct audio_encoder_settings *dst,
+                          const struct AVCodecContext *dec)
+{
+	memset(key, 0, sizeof(struct context_key));
+	key->kind       = CONTEXT_RESAMPLER;
+	key->in_rate    = dec->sample_rate;
+	key->in_format  = dec->sample_fmt;
+	key->in_layout  = dec->ch_layout;
+	key->out_rate   = dst->sample_rate;
+	key->out_format = dst->sample_fmt;
+	av_channel_layout_default(&key->out_layout, dst->channels);
+}
+
+struct AVCodecContext *pool_take_decoder(struct speechful_pool *pool,
+                                         const struct AVCodecParameters *par)
+{
+	struct context_key key;
+
+	decoder_key(&key, par);
+	return take(pool, &key);
+}
+
+/* Decoders were flushed on the way in, they start over like new ones. */
+void pool_give_decoder(struct speechful_pool *pool, struct AVCodecContext **dec,
+                       const struct AVCodecParameters *par)
+{
+	struct context_key key;
+
+	avcodec_flush_buffers(*dec);
+
+	decoder_key(&key, par);
+	give(pool, &key, (void **)dec);
+}
+
+struct AVCodecContext *pool_take_encoder(struct speechful_pool *pool, enum AVCodecID id,
+                                         const struct audio_encoder_settings *settings)
+{
+	struct context_key key;
+
+	encoder_key(&key, id, settings);
+	return take(pool, &key);
+}
+
+/* Asks for a fresh encoder like `enc` by the next refill, unless one is asked for already. */
+static void want_spare(struct speechful_pool *pool, const struct AVCodecContext *enc,
+                       const struct audio_encoder_settings *settings)
+{
+	int i;
+
+	for (i = 0; i < pool->nr_spares; ++i)
+		if (pool->spares[i].codec == enc->codec
+		    && !memcmp(&pool->spares[i].settings, settings, sizeof(*settings)))
+			return;
+
+	if (pool->nr_spares == MAX_SPARES)
+		return;
+
+	pool->spares[pool->nr_spares].codec    = enc->codec;
+	pool->spares[pool->nr_spares].settings = *settings;
+	pool->nr_spares++;
+}
+
+/*
+ * A drained encoder can only be started again by codecs that support
+ * flushing. The others, LAME among them, are replaced by a fresh one
+ * opened at the next refill.
+ */
+void pool_give_encoder(struct speechful_pool *pool, struct AVCodecContext **enc,
+                       const struct audio_encoder_settings *settings)
+{
+	struct context_key key;
+
+	if (!((*enc)->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)) {
+		want_spare(pool, *enc, settings);
+		avcodec_free_context(enc);
+		return;
+	}
+
+	avcodec_flush_buffers(*enc);
+
+	encoder_key(&key, (*enc)->codec_id, settings);
+	give(pool, &key, (void **)enc);
+}
+
+int speechful_pool_refill(struct speechful_pool *pool)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < pool->nr_spares && ret >= 0; ++i) {
+		const struct spare *spare = &pool->spares[i];
+		struct AVCodecContext *enc = NULL;
+		struct context_key key;
+
+		if ((ret = codec_open_audio_encoder(&enc, spare->codec, spare->settings, NULL)) < 0)
+			break;
+
+		encoder_key(&key, spare->codec->id, &spare->settings);
+		give(pool, &key, (void **)&enc);
+	}
+
+	/* One that fails to open is not asked for again; the job opening it reports why. */
+	pool->nr_spares = 0;
+
+	return ret;
+}
+
+/*
+ * Resetting runs swr_init(), which starts a context over but keeps its
+ * filter bank when the rates and formats are unchanged, which is where the
+ * cost of opening one goes.
+ */
+struct resampler *pool_take_resampler(struct speechful_pool *pool,
+                                      const struct audio_encoder_settings *dst,
+                                      const struct AVCodecContext *dec)
+{
+	struct resampler *resampler;
+	struct context_key key;
+
+	resampler_key(&key, dst, dec);
+	if (!(resampler = take(pool, &key)))
+		return NULL;
+
+	if (resampler_reset(resampler) < 0)
+		resampler_free(&resampler);
+
+	return resampler;
+}
+
+void pool_give_resampler(struct speechful_pool *pool, struct resampler **resampler,
+                         const struct audio_encoder_settings *dst,
+                         const struct AVCodecContext *dec)
+{
+	struct context_key key;
+
+	resampler_key(&key, dst, dec);
+	give(pool, &key, (void **)resampler);
+}
@@ -0,0 +1,34 @@
+#ifndef SPEECHFUL_POOL_H
+#define SPEECHFUL_POOL_H
+
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+
+#include "pipeline.h"
+#include "speechful.h"
+
+/*
+ * Opened codec and resampler contexts kept between the jobs of one thread,
+ * keyed by everything that went into opening them. A context is taken out
+ * already reset and given back when the job is done with it; whatever the
+ * pool cannot reuse safely is freed on the way in.
+ */
+
+struct AVCodecContext *pool_take_decoder(struct speechful_pool *pool,
+                                         const struct AVCodecParameters *par);
+void pool_give_decoder(struct speechful_pool *pool, struct AVCodecContext **dec,
+                       const struct AVCodecParameters *par);
+
+struct AVCodecContext *pool_take_encoder(struct speechful_pool *pool, enum AVCodecID id,
+                                         const struct audio_encoder_settings *settings);
+void pool_give_encoder(struct speechful_pool *pool, struct AVCodecContext **enc,
+                       const struct audio_encoder_settings *settings);
+
+struct resampler *pool_take_resampler(struct speechful_pool *pool,
+                                      const struct audio_encoder_settings *dst,
+                                      const struct AVCodecContext *dec);
+void pool_give_resampler(struct speechful_pool *pool, struct resampler **resampler,
+                         const struct audio_encoder_settings *dst,
+                         const struct AVCodecContext *dec);
+
+#endif
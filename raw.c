@@ -0,0 +1,324 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/samplefmt.h>
+
+#include "raw.h"
+#include "stats.h"
+
+/* Samples are converted into a buffer this large before they are written. */
+#define RAW_BUFFER_SIZE (1024 * 1024)
+
+/* The samples start on a page of their own, so they can be mapped alone. */
+#define RAW_DATA_ALIGN 4096
+
+#define RAW_VERSION 1
+
+enum raw_format {
+	RAW_F32 = 1,
+	RAW_S16 = 2,
+};
+
+/* The layout of the file, see `struct speechful_raw`; neither has padding. */
+struct raw_header {
+	char     magic[4];
+	uint16_t version;
+	uint16_t format;
+	uint32_t sample_rate;
+	uint32_t channels;
+	uint32_t nr_cues;
+	uint32_t reserved;
+	uint64_t data_offset;
+};
+
+struct raw_entry {
+	uint32_t cue;
+	uint32_t reserved;
+	uint64_t offset;
+	uint64_t length;
+	int64_t  start_us;
+	int64_t  end_us;
+};
+
+struct raw_pcm {
+	int                 fd;
+	enum AVSampleFormat sample_fmt;
+	int                 channels;
+	bool                to_s16;
+	int                 frame_size;   /* The bytes of one sample of every channel in the file. */
+	i64                 data_offset;
+
+	struct raw_entry   *entries;
+	int                 nr_cues;
+	i64                 frames;       /* Written so far, buffered ones included. */
+	i64                 cue_start;    /* Where the cue being written started. */
+
+	u8                 *buffer;
+	int                 buffered;
+};
+
+static int pwrite_all(int fd, const void *buf, size_t size, i64 offset)
+{
+	const u8 *p = buf;
+
+	while (size) {
+		ssize_t n = pwrite(fd, p, size, offset);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return AVERROR(errno);
+		}
+
+		p      += n;
+		size   -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Asks the file system for the whole file up front, so it is laid out in one
+ * piece and a full disk shows now rather than halfway through. File systems
+ * that cannot do it are simply left to grow the file as it is written.
+ */
+static int preallocate(struct raw_pcm *r, const struct audio_encoder_settings *out,
+                       const struct cue_table *cues, int in_rate)
+{
+	i64 frames = 0;
+	int i, ret;
+
+	for (i = 0; i < cues->nr_cues; ++i)
+		frames += av_rescale(cues->cues[i].end - cues->cues[i].start, out->sample_rate, in_rate);
+
+	if (!frames)
+		return 0;
+
+	ret = posix_fallocate(r->fd, 0, r->data_offset + frames * r->frame_size);
+	if (ret == ENOSPC || ret == EFBIG || ret == EIO)
+		return AVERROR(ret);
+
+	return 0;
+}
+
+/* The cues' entries, with their lengths left for `raw_pcm_end_cue()`, and the header. */
+static int write_index(struct raw_pcm *r, const struct audio_encoder_settings *out,
+                       const struct cue_table *cues, int in_rate)
+{
+	struct raw_header header = {
+		.magic       = {'S', 'P', 'C', 'M'},
+		.version     = RAW_VERSION,
+		.format      = r->to_s16 ? RAW_S16 : RAW_F32,
+		.sample_rate = out->sample_rate,
+		.channels    = out->channels,
+		.nr_cues     = cues->nr_cues,
+		.data_offset = r->data_offset,
+	};
+	int i, ret;
+
+	for (i = 0; i < cues->nr_cues; ++i) {
+		r->entries[i].cue      = i;
+		r->entries[i].start_us = av_rescale(cues->cues[i].start, 1000000, in_rate);
+		r->entries[i].end_us   = av_rescale(cues->cues[i].end, 1000000, in_rate);
+	}
+
+	if ((ret = pwrite_all(r->fd, &header, sizeof(header), 0)) < 0)
+		return ret;
+
+	return pwrite_all(r->fd, r->entries, cues->nr_cues * sizeof(struct raw_entry), sizeof(header));
+}
+
+int raw_pcm_open(struct raw_pcm **raw, const struct speechful_raw *settings,
+                 const struct audio_encoder_settings *out,
+                 const struct cue_table *cues, int in_rate)
+{
+	enum AVSampleFormat packed = av_get_packed_sample_fmt(out->sample_fmt);
+	struct raw_pcm *r;
+	i64 index_size;
+	int ret;
+
+	if ((packed != AV_SAMPLE_FMT_S16 && packed != AV_SAMPLE_FMT_S32
+	     && packed != AV_SAMPLE_FMT_FLT && packed != AV_SAMPLE_FMT_DBL)
+	    || (settings->sample_fmt != AV_SAMPLE_FMT_FLT && settings->sample_fmt != AV_SAMPLE_FMT_S16))
+		return AVERROR(ENOSYS);
+
+	if (!(r = *raw = av_mallocz(sizeof(struct raw_pcm))))
+		return AVERROR(ENOMEM);
+
+	index_size = sizeof(struct raw_header) + (i64)cues->nr_cues * sizeof(struct raw_entry);
+
+	r->fd          = -1;
+	r->sample_fmt  = out->sample_fmt;
+	r->channels    = out->channels;
+	r->to_s16      = settings->sample_fmt == AV_SAMPLE_FMT_S16;
+	r->frame_size  = av_get_bytes_per_sample(settings->sample_fmt) * out->channels;
+	r->data_offset = (index_size + RAW_DATA_ALIGN - 1) / RAW_DATA_ALIGN * RAW_DATA_ALIGN;
+	r->nr_cues     = cues->nr_cues;
+
+	if (!(r->buffer = av_malloc(RAW_BUFFER_SIZE))
+	    || !(r->entries = av_calloc(cues->nr_cues ? cues->nr_cues : 1, sizeof(struct raw_entry)))) {
+		ret = AVERROR(ENOMEM);
+		goto err_free;
+	}
+
+	if ((r->fd = open(settings->path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		ret = AVERROR(errno);
+		goto err_free;
+	}
+
+	if ((ret = preallocate(r, out, cues, in_rate)) < 0
+	    || (ret = write_index(r, out, cues, in_rate)) < 0)
+		goto err_free;
+
+	/* No cue will end to leave the file at its size. */
+	if (!cues->nr_cues && ftruncate(r->fd, r->data_offset) < 0) {
+		ret = AVERROR(errno);
+		goto err_free;
+	}
+
+	return 0;
+
+err_free:
+	raw_pcm_free(raw);
+
+	return ret;
+}
+
+void raw_pcm_free(struct raw_pcm **raw)
+{
+	struct raw_pcm *r = *raw;
+
+	if (!r)
+		return;
+
+	if (r->fd >= 0)
+		close(r->fd);
+	av_freep(&r->buffer);
+	av_freep(&r->entries);
+	av_freep(raw);
+}
+
+static float sample_at(const u8 *plane, enum AVSampleFormat packed, int i)
+{
+	switch (packed) {
+	case AV_SAMPLE_FMT_S16: return ((const int16_t *)plane)[i] / 32768.0f;
+	case AV_SAMPLE_FMT_S32: return ((const int32_t *)plane)[i] / 2147483648.0f;
+	case AV_SAMPLE_FMT_FLT: return ((const float *)plane)[i];
+	case AV_SAMPLE_FMT_DBL: return ((const double *)plane)[i];
+	default:                return 0;
+	}
+}
+
+/* Interleaves samples `first` to `first + n` of `buf` into `dst`, in the file's format. */
+static void convert(const struct raw_pcm *r, u8 *dst, const u8 *const *buf, int first, int n)
+{
+	enum AVSampleFormat packed = av_get_packed_sample_fmt(r->sample_fmt);
+	bool planar = av_sample_fmt_is_planar(r->sample_fmt) && r->channels > 1;
+	int c, i;
+
+	/* What the encoder takes is often what the file holds already. */
+	if (!planar && packed == (r->to_s16 ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_FLT)) {
+		memcpy(dst, buf[0] + (size_t)first * r->frame_size, (size_t)n * r->frame_size);
+		return;
+	}
+
+	for (i = 0; i < n; ++i) {
+		for (c = 0; c < r->channels; ++c) {
+			float y = planar ? sample_at(buf[c], packed, first + i)
+			                 : sample_at(buf[0], packed, (first + i) * r->channels + c);
+
+			if (!r->to_s16) {
+				((float *)dst)[i * r->channels + c] = y;
+				continue;
+			}
+
+			y *= 32768.0f;
+			y = y < -32768.0f ? -32768.0f : y > 32767.0f ? 32767.0f : y;
+			((int16_t *)dst)[i * r->channels + c] = (int16_t)lrintf(y);
+		}
+	}
+}
+
+static int flush_buffer(struct raw_pcm *r)
+{
+	struct stage_clock clock;
+	i64 offset = r->data_offset + r->frames * r->frame_size - r->buffered;
+	int ret;
+
+	if (!r->buffered)
+		return 0;
+
+	stats_stage_begin(&clock, STAGE_WRITE);
+	ret = pwrite_all(r->fd, r->buffer, r->buffered, offset);
+	stats_stage_end(&clock);
+
+	if (ret < 0)
+		return ret;
+
+	stats_count(COUNTER_BYTES_WRITTEN, r->buffered);
+	r->buffered = 0;
+
+	return 0;
+}
+
+int raw_pcm_write(void *opaque, const u8 *const *buf, int samples)
+{
+	struct raw_pcm *r = opaque;
+	int done = 0, n, ret;
+
+	while (done < samples) {
+		if (!(n = FFMIN(samples - done, (RAW_BUFFER_SIZE - r->buffered) / r->frame_size))) {
+			if ((ret = flush_buffer(r)) < 0)
+				return ret;
+			continue;
+		}
+
+		convert(r, r->buffer + r->buffered, buf, done, n);
+		r->buffered += n * r->frame_size;
+		r->frames   += n;
+		done        += n;
+	}
+
+	return 0;
+}
+
+int raw_pcm_end_cue(void *opaque, int cue)
+{
+	struct raw_pcm *r = opaque;
+	struct raw_entry *entry;
+	int ret;
+
+	if (cue >= r->nr_cues)
+		return 0;
+
+	entry = &r->entries[cue];
+	entry->offset = r->cue_start;
+	entry->length = r->frames - r->cue_start;
+	r->cue_start  = r->frames;
+
+	if ((ret = pwrite_all(r->fd, entry, sizeof(struct raw_entry),
+	                      sizeof(struct raw_header) + (i64)cue * sizeof(struct raw_entry))) < 0)
+		return ret;
+
+	if (cue < r->nr_cues - 1)
+		return 0;
+
+	/* The last cue: whatever the cues were estimated at, the file ends where they did. */
+	if ((ret = flush_buffer(r)) < 0)
+		return ret;
+
+	if (ftruncate(r->fd, r->data_offset + r->frames * r->frame_size) < 0)
+		return AVERROR(errno);
+
+	return 0;
+}
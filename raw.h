@@ -0,0 +1,25 @@
+#ifndef SPEECHFUL_RAW_H
+#define SPEECHFUL_RAW_H
+
+#include "pipeline.h"
+#include "speechful.h"
+
+/*
+ * Writes the output, see `struct speechful_raw`, as a `struct cue_output`:
+ * the samples go out as they come, and each cue's entry of the index once
+ * it ends. The file is given the size the cues add up to when opened, and
+ * cut to what was written after the last cue. Takes s16, s32, float and
+ * double samples, planar or not.
+ */
+struct raw_pcm;
+
+/* `in_rate` is the rate `cues` count in. */
+int  raw_pcm_open(struct raw_pcm **raw, const struct speechful_raw *settings,
+                  const struct audio_encoder_settings *out,
+                  const struct cue_table *cues, int in_rate);
+void raw_pcm_free(struct raw_pcm **raw);
+
+int  raw_pcm_write(void *raw, const u8 *const *buf, int samples);
+int  raw_pcm_end_cue(void *raw, int cue);
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <libavutil/avutil.h>
+
+#include "pipeline.h"
+#include "segment.h"
+
+struct clip_entry {
+	int clip;
+	int nr_cues;
+	i64 audio;     /* In samples. */
+	i64 bucket;    /* In ms, the shortest duration it holds. */
+};
+
+int cue_table_group(struct cue_table *clips, const struct cue_table *cues, i64 target)
+{
+	i64 audio = 0;
+	int i, ret;
+
+	for (i = 0; i < cues->nr_cues; ++i) {
+		struct range cue = cues->cues[i];
+		i64 length = cue.end - cue.start;
+
+		if (clips->nr_cues && audio + length <= target) {
+			clips->cues[clips->nr_cues - 1].end = cue.end;
+			audio += length;
+			continue;
+		}
+
+		if ((ret = cue_table_append(clips, cue)) < 0)
+			return ret;
+		audio = length;
+	}
+
+	return 0;
+}
+
+int clip_find(const struct cue_table *clips, i64 at)
+{
+	int lo = 0, hi = clips->nr_cues - 1;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+
+		if (clips->cues[mid].start <= at)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct clip_entry *x = a, *y = b;
+
+	if (x->bucket != y->bucket)
+		return (x->bucket > y->bucket) - (x->bucket < y->bucket);
+
+	return (x->clip > y->clip) - (x->clip < y->clip);
+}
+
+int clip_write_manifest(const char *path, const struct cue_table *clips,
+                        const struct cue_table *cues, int sample_rate, i64 bucket_ms)
+{
+	struct clip_entry *entries;
+	FILE *out;
+	int i, k = 0, ret = 0;
+
+	if (!(entries = av_calloc(clips->nr_cues ? clips->nr_cues : 1, sizeof(struct clip_entry))))
+		return AVERROR(ENOMEM);
+
+	/* A clip's audio is its cues, not the pauses between them its span also covers. */
+	for (i = 0; i < clips->nr_cues; ++i) {
+		struct range span = clips->cues[i];
+		struct clip_entry *e = &entries[i];
+
+		e->clip = i;
+
+		for (; k < cues->nr_cues && cues->cues[k].start < span.end; ++k) {
+			struct range audio = get_overlapped_region(cues->cues[k], span);
+
+			e->audio += audio.end - audio.start;
+			e->nr_cues++;
+		}
+
+		e->bucket = av_rescale(e->audio, 1000, sample_rate) / bucket_ms * bucket_ms;
+	}
+
+	qsort(entries, clips->nr_cues, sizeof(struct clip_entry), compare_entries);
+
+	if (!(out = fopen(path, "w"))) {
+		ret = AVERROR(errno);
+		goto end;
+	}
+
+	fputs("# bucket_ms\tclip\tduration_ms\tstart_ms\tend_ms\tcues\n", out);
+
+	for (i = 0; i < clips->nr_cues; ++i) {
+		const struct clip_entry *e = &entries[i];
+		const struct range *span = &clips->cues[e->clip];
+
+		fprintf(out, "%" PRId64 "\t%d\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%d\n",
+		        e->bucket, e->clip, av_rescale(e->audio, 1000, sample_rate),
+		        av_rescale(span->start, 1000, sample_rate),
+		        av_rescale(span->end, 1000, sample_rate), e->nr_cues);
+	}
+
+	if (fclose(out) == EOF)
+		ret = AVERROR(errno);
+
+end:
+	av_free(entries);
+
+	return ret;
+}
@@ -0,0 +1,32 @@
+#ifndef SPEECHFUL_SEGMENT_H
+#define SPEECHFUL_SEGMENT_H
+
+#include "pipeline.h"
+
+/*
+ * Clips: runs of adjacent cues that are extracted as one, see `struct
+ * speechful_segment`. A clip is kept as the span from its first cue's start
+ * to its last cue's end, so the clips form a cue table of their own, and a
+ * clip's audio is where its span overlaps the cues.
+ */
+
+/*
+ * Fills `clips` from the settled `cues`, adding each cue to the clip before
+ * it while their audio stays within `target` samples; with a `target` of 0
+ * every cue is a clip of its own.
+ */
+int cue_table_group(struct cue_table *clips, const struct cue_table *cues, i64 target);
+
+/* The clip holding sample `at`, which must lie in one. */
+int clip_find(const struct cue_table *clips, i64 at);
+
+/*
+ * Writes the clips to `path` as tab-separated lines, `bucket_ms` wide
+ * duration buckets one after another from the shortest, the clips in order
+ * within each. Times are in ms of the input, counted from `sample_rate`
+ * samples.
+ */
+int clip_write_manifest(const char *path, const struct cue_table *clips,
+                        const struct cue_table *cues, int sample_rate, i64 bucket_ms);
+
+#endif
@@ -0,0 +1,1073 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+#include <libavutil/avutil.h>
+#include <libavutil/audio_fifo.h>
+
+#include "alloc.h"
+#include "analysis.h"
+#include "io.h"
+#include "loudness.h"
+#include "mel.h"
+#include "peaks.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "raw.h"
+#include "segment.h"
+#include "speechful.h"
+#include "stats.h"
+#include "trace.h"
+#include "trim.h"
+
+#define MAX_CACHED_CODECS 32
+
+#define codec_supports(c, what) ((c)->capabilities & (what))
+
+struct cached_codec {
+	enum AVCodecID        id;
+	bool                  encoder;
+	const struct AVCodec *codec;
+};
+
+struct speechful {
+	pthread_mutex_t     lock;
+	struct cached_codec codecs[MAX_CACHED_CODECS];
+	int                 nr_codecs;
+};
+
+struct speechful_job {
+	struct speechful       *sf;
+	bool                    streaming;
+	struct AVFormatContext *in_fmt_ctx;
+	struct AVFormatContext *sub_fmt_ctx;
+	struct AVIOContext     *in_pb;
+	struct AVIOContext     *out_pb;
+	struct AVStream        *in_st;
+	struct AVStream        *sub_st;
+	struct AVCodecContext  *dec;
+	struct audio_output     output;
+	struct log_mel         *mel;
+	struct raw_pcm         *raw;
+	struct AVPacket        *pkt;
+	struct AVFrame         *frame;
+	struct cue_table        cues;
+	struct cue_table        clips;
+	struct cue_plan         plan;
+	void                  (*progress)(void *opaque, int done, int nr_cues);
+	void                   *progress_opaque;
+	/* Contexts opened with options of their own never go back to the pool. */
+	struct speechful_pool  *pool;
+	bool                    pooled_dec;
+	bool                    pooled_enc;
+};
+
+static void error(const char *msg, ...)
+{
+	va_list va;
+	va_start(va, msg);
+	av_vlog(NULL, AV_LOG_ERROR, msg, va);
+	va_end(va);
+}
+
+static void warn(const char *msg, ...)
+{
+	va_list va;
+	va_start(va, msg);
+	av_vlog(NULL, AV_LOG_WARNING, msg, va);
+	va_end(va);
+}
+
+int speechful_alloc(struct speechful **sf)
+{
+	if (!(*sf = av_mallocz(sizeof(struct speechful))))
+		return AVERROR(ENOMEM);
+
+	pthread_mutex_init(&(*sf)->lock, NULL);
+
+	return 0;
+}
+
+void speechful_free(struct speechful **sf)
+{
+	if (!*sf)
+		return;
+
+	pthread_mutex_destroy(&(*sf)->lock);
+	av_freep(sf);
+}
+
+/* avcodec_find_*() walk the whole codec list, once per process is enough. */
+static const struct AVCodec *find_codec(struct speechful *sf, enum AVCodecID id, bool encoder)
+{
+	const struct AVCodec *codec = NULL;
+	int i;
+
+	pthread_mutex_lock(&sf->lock);
+
+	for (i = 0; i < sf->nr_codecs; ++i) {
+		if (sf->codecs[i].id == id && sf->codecs[i].encoder == encoder) {
+			codec = sf->codecs[i].codec;
+			goto end;
+		}
+	}
+
+	codec = encoder ? avcodec_find_encoder(id) : avcodec_find_decoder(id);
+
+	if (codec && sf->nr_codecs < MAX_CACHED_CODECS) {
+		sf->codecs[sf->nr_codecs].id      = id;
+		sf->codecs[sf->nr_codecs].encoder = encoder;
+		sf->codecs[sf->nr_codecs].codec   = codec;
+		sf->nr_codecs++;
+	}
+
+end:
+	pthread_mutex_unlock(&sf->lock);
+
+	return codec;
+}
+
+void speechful_config_init(struct speechful_config *config)
+{
+	memset(config, 0, sizeof(struct speechful_config));
+
+	config->input_fd    = -1;
+	config->output_fd   = -1;
+	config->codec       = AV_CODEC_ID_MP3;
+	config->channels    = 2;
+	config->sample_rate = 44100;
+	config->bit_rate    = 64000;
+	config->sample_fmt  = AV_SAMPLE_FMT_S16P;
+
+	config->vad.start_db       = 12;
+	config->vad.stop_db        = 6;
+	config->vad.min_speech_ms  = 250;
+	config->vad.min_silence_ms = 300;
+
+	config->trim.threshold_db   = -45;
+	config->trim.min_silence_ms = 500;
+	config->trim.keep_ms        = 200;
+
+	config->loudness.target_lufs  = -16;
+	config->loudness.max_gain_db  = 20;
+	config->loudness.ceiling_db   = -1;
+	config->loudness.lookahead_ms = 300;
+
+	config->segment.max_ms    = 20000;
+	config->segment.target_ms = 10000;
+	config->segment.bucket_ms = 2000;
+
+	config->mel.bins      = 80;
+	config->mel.window_ms = 25;
+	config->mel.hop_ms    = 10;
+
+	config->raw.sample_fmt = AV_SAMPLE_FMT_FLT;
+
+	config->peaks.bucket = 64;
+	config->peaks.levels = 5;
+}
+
+/* FFmpeg leaves behind whatever options it did not recognise. */
+static void warn_unused_options(const AVDictionary *opts, const char *group)
+{
+	const AVDictionaryEntry *e = NULL;
+
+	while ((e = av_dict_get(opts, "", e, AV_DICT_IGNORE_SUFFIX)))
+		warn("Option '%s' was not used by the %s.\n", e->key, group);
+}
+
+static int filter_streams(struct AVStream ***dst, struct AVStream **src, int n,
+                          enum AVMediaType which)
+{
+	int i, filtered;
+
+	if (!(*dst = malloc(n * sizeof(struct AVStream *))))
+		return -1; /* No memory. */
+
+	for (i = filtered = 0; i < n; ++i) {
+		if (which == src[i]->codecpar->codec_type)
+			(*dst)[filtered++] = src[i];
+	}
+
+	if (!filtered) {
+		free(*dst);
+		*dst = NULL;
+	}
+
+	return filtered;
+}
+
+static void report_progress(const struct speechful_job *job, int done)
+{
+	if (job->progress)
+		job->progress(job->progress_opaque, done, job->cues.nr_cues);
+}
+
+/* Returns the index of the chosen stream of type `which`. */
+static int choose_stream(const struct speechful_config *config,
+                         struct AVStream **streams, int nr_streams, enum AVMediaType which)
+{
+	struct AVStream **filtered;
+	int nr_filtered, ret;
+
+	if ((nr_filtered = filter_streams(&filtered, streams, nr_streams, which)) == -1)
+		return AVERROR(ENOMEM);
+
+	if (nr_filtered == 0)
+		return AVERROR_STREAM_NOT_FOUND;
+
+	if (nr_filtered == 1 || !config->choose_stream) {
+		if (nr_filtered > 1)
+			warn("Using the first of %d %s streams.\n", nr_filtered, av_get_media_type_string(which));
+		ret = filtered[0]->index;
+		goto end;
+	}
+
+	ret = config->choose_stream(config->choose_stream_opaque, filtered, nr_filtered);
+	if (ret >= 0)
+		ret = ret < nr_filtered ? filtered[ret]->index : AVERROR(EINVAL);
+
+end:
+	free(filtered);
+	return ret;
+}
+
+/*
+ * Seeks to every cue and decodes only the packets overlapping it. Needs a
+ * seekable input.
+ */
+static int extract_by_seeking(struct speechful_job *job)
+{
+	struct AVFormatContext *in_fmt_ctx = job->in_fmt_ctx;
+	struct AVStream *in_st = job->in_st;
+	struct AVCodecContext *dec = job->dec;
+	const struct cue_table *cues = &job->cues;
+	struct cue_plan *plan = &job->plan;
+	struct audio_output *out = &job->output;
+	struct AVPacket *pkt = job->pkt;
+	struct AVFrame *frame = job->frame;
+	int i, ret = 0;
+
+	for (i = 0; i < cues->nr_cues; ++i) {
+		struct range cue = cues->cues[i];
+		struct stage_clock clock;
+
+		trace_cue_begin(i);
+		cue_plan_enter(plan, i);
+
+		if ((ret = audio_output_begin_cue(out, clip_find(&job->clips, cue.start))) < 0)
+			return ret;
+
+		stats_stage_begin(&clock, STAGE_SEEK);
+		ret = av_seek_frame(in_fmt_ctx,
+		                    in_st->index,
+		                    samples2tb(in_st->time_base, dec->sample_rate, cue.start),
+		                    AVSEEK_FLAG_BACKWARD);
+		stats_stage_end(&clock);
+		stats_count(COUNTER_SEEKS, 1);
+
+		if (ret < 0) {
+			error("Failed to sync audio with subtitle: %s\n", av_err2str(ret));
+			return ret;
+		}
+
+		while ((ret = read_packet(in_fmt_ctx, in_st->index, pkt)) == 0) {
+			struct range audio_samples = {0};
+
+			audio_samples.start = tb2samples(in_st->time_base, dec->sample_rate, pkt->pts);
+			audio_samples.end   = tb2samples(in_st->time_base, dec->sample_rate, pkt->pts + pkt->duration);
+
+			if (audio_samples.end <= cue.start) {
+				stats_count(COUNTER_PACKETS_DISCARDED, 1);
+				av_packet_unref(pkt);
+				continue;
+			}
+
+			if (audio_samples.start >= cue.end) {
+				stats_count(COUNTER_PACKETS_DISCARDED, 1);
+				av_packet_unref(pkt);
+				break;
+			}
+
+			if ((ret = decoder_send_packet(dec, pkt)) < 0) {
+				error("Failed to decode audio data: %s\n", av_err2str(ret));
+				return ret;
+			}
+
+			av_packet_unref(pkt);
+
+			while ((ret = decoder_receive_frame(dec, frame)) == 0) {
+				/* The frame length comes from its sample count, never from a rounded duration. */
+				audio_samples.start = tb2samples(in_st->time_base, dec->sample_rate, frame->pts);
+				audio_samples.end   = audio_samples.start + frame->nb_samples;
+
+				if (audio_samples.end <= cue.start) {
+					stats_count(COUNTER_FRAMES_DISCARDED, 1);
+					av_frame_unref(frame);
+					continue;
+				}
+
+				if (audio_samples.start >= cue.end) {
+					stats_count(COUNTER_FRAMES_DISCARDED, 1);
+					av_frame_unref(frame);
+					avcodec_flush_buffers(dec);
+					break;
+				}
+
+				ret = audio_output_write_region(out, frame, audio_samples,
+				                                get_overlapped_region(audio_samples, cue));
+				av_frame_unref(frame);
+				if (ret < 0)
+					return ret;
+			}
+
+			if (ret < 0 && ret != AVERROR(EAGAIN)) {
+				error("Failed to decode audio data: %s\n", av_err2str(ret));
+				return ret;
+			}
+		}
+
+		trace_cue_end();
+		alloc_sample(i);
+		report_progress(job, i + 1);
+
+		if (ret < 0) {
+			if (ret == AVERROR_EOF)
+				return 0;
+			error("%s: failed to read audio data: %s\n", in_fmt_ctx->url, av_err2str(ret));
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Walks the input once, front to back, against the sorted cue table, so it
+ * works on unseekable inputs. Packets outside of every cue are not decoded;
+ * a decoded frame may feed several short cues.
+ */
+static int extract_in_one_pass(struct speechful_job *job)
+{
+	struct AVFormatContext *in_fmt_ctx = job->in_fmt_ctx;
+	struct AVStream *in_st = job->in_st;
+	struct AVCodecContext *dec = job->dec;
+	const struct cue_table *cues = &job->cues;
+	struct cue_plan *plan = &job->plan;
+	struct audio_output *out = &job->output;
+	struct AVPacket *pkt = job->pkt;
+	struct AVFrame *frame = job->frame;
+	bool skipped = false;
+	int cursor = 0;
+	int ret = 0;
+
+	if (cues->nr_cues) {
+		trace_cue_begin(0);
+		cue_plan_enter(plan, 0);
+	}
+
+	while (cursor < cues->nr_cues && (ret = read_packet(in_fmt_ctx, in_st->index, pkt)) == 0) {
+		struct range audio_samples = {0};
+		int k;
+
+		audio_samples.start = tb2samples(in_st->time_base, dec->sample_rate, pkt->pts);
+		audio_samples.end   = tb2samples(in_st->time_base, dec->sample_rate, pkt->pts + pkt->duration);
+
+		/* Cue ends are sorted as well, so the first one ending after the packet starts decides. */
+		for (k = cursor; k < cues->nr_cues && cues->cues[k].end <= audio_samples.start; ++k)
+			;
+
+		if (k == cues->nr_cues || cues->cues[k].start >= audio_samples.end) {
+			stats_count(COUNTER_PACKETS_DISCARDED, 1);
+			av_packet_unref(pkt);
+			skipped = true;
+			continue;
+		}
+
+		/* Whatever the decoder kept from before the gap would bleed into this cue. */
+		if (skipped) {
+			avcodec_flush_buffers(dec);
+			skipped = false;
+		}
+
+		ret = decoder_send_packet(dec, pkt);
+		av_packet_unref(pkt);
+
+		if (ret < 0) {
+			error("Failed to decode audio data: %s\n", av_err2str(ret));
+			return ret;
+		}
+
+		while ((ret = decoder_receive_frame(dec, frame)) == 0) {
+			bool used = false;
+
+			audio_samples.start = tb2samples(in_st->time_base, dec->sample_rate, frame->pts);
+			audio_samples.end   = audio_samples.start + frame->nb_samples;
+
+			while (cursor < cues->nr_cues && cues->cues[cursor].end <= audio_samples.start) {
+				trace_cue_end();
+				alloc_sample(cursor);
+				report_progress(job, cursor + 1);
+				if (++cursor < cues->nr_cues)
+					trace_cue_begin(cursor);
+				cue_plan_enter(plan, cursor);
+			}
+
+			for (k = cursor; k < cues->nr_cues && cues->cues[k].start < audio_samples.end; ++k) {
+				struct range cue = cues->cues[k];
+
+				if ((ret = audio_output_begin_cue(out, clip_find(&job->clips, cue.start))) >= 0)
+					ret = audio_output_write_region(out, frame, audio_samples,
+					                                get_overlapped_region(audio_samples, cue));
+				if (ret < 0) {
+					av_frame_unref(frame);
+					return ret;
+				}
+				used = true;
+			}
+
+			if (!used)
+				stats_count(COUNTER_FRAMES_DISCARDED, 1);
+
+			av_frame_unref(frame);
+		}
+
+		if (ret < 0 && ret != AVERROR(EAGAIN)) {
+			error("Failed to decode audio data: %s\n", av_err2str(ret));
+			return ret;
+		}
+	}
+
+	if (cursor < cues->nr_cues)
+		trace_cue_end();
+
+	if (ret < 0 && ret != AVERROR_EOF && ret != AVERROR(EAGAIN)) {
+		error("%s: failed to read audio data: %s\n", in_fmt_ctx->url, av_err2str(ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+static int open_input(struct speechful_job *job, const struct speechful_config *config)
+{
+	const char *name = config->input_fd >= 0 ? "stdin" : config->input;
+	AVDictionary *opts = NULL;
+	int ret;
+
+	if (job->streaming) {
+		if ((ret = io_open_pipe_input(&job->in_pb, config->input_fd)) < 0) {
+			error("Failed to read from %s: %s\n", name, av_err2str(ret));
+			return ret;
+		}
+	} else if (config->input_backend == SPEECHFUL_INPUT_MMAP
+	           && (ret = io_open_mmap_input(&job->in_pb, config->input)) < 0) {
+		warn("%s: cannot be memory-mapped, reading it normally: %s\n", name, av_err2str(ret));
+	} else if (config->input_backend == SPEECHFUL_INPUT_READAHEAD
+	           && (ret = io_open_readahead_input(&job->in_pb, config->input,
+	                                             config->io_delay_ms * 1000)) < 0) {
+		warn("%s: cannot be read ahead, reading it normally: %s\n", name, av_err2str(ret));
+	}
+
+	if ((ret = av_dict_copy(&opts, config->demux_opts, 0)) < 0)
+		goto end;
+
+	if ((ret = format_open_input(&job->in_fmt_ctx, job->streaming ? NULL : config->input,
+	                             job->in_pb, config->fast_probe, &opts)) < 0) {
+		error("%s: failed to open media file: %s\n", name, av_err2str(ret));
+		goto end;
+	}
+
+	warn_unused_options(opts, "demuxer");
+
+	if ((ret = choose_stream(config, job->in_fmt_ctx->streams, job->in_fmt_ctx->nb_streams,
+	                         AVMEDIA_TYPE_AUDIO)) < 0) {
+	        if (ret == AVERROR_STREAM_NOT_FOUND)
+	        	error("%s: no audio streams found.\n", name);
+		else
+			error("%s: failed to choose audio stream: %s\n", name, av_err2str(ret));
+		goto end;
+	}
+
+	job->in_st = job->in_fmt_ctx->streams[ret];
+	ret = 0;
+
+end:
+	av_dict_free(&opts);
+
+	return ret;
+}
+
+static int open_subtitles(struct speechful_job *job, const struct speechful_config *config)
+{
+	AVDictionary *opts = NULL;
+	int index, ret;
+
+	if (config->subtitles) {
+		if ((ret = format_open_input(&job->sub_fmt_ctx, config->subtitles, NULL,
+		                             config->fast_probe, NULL)) < 0) {
+			error("%s: failed to open media file: %s\n", config->subtitles, av_err2str(ret));
+			return ret;
+		}
+
+		if (job->sub_fmt_ctx->nb_streams != 1) {
+			error("%s: invalid subtitle media file.\n", config->subtitles);
+			error("Expected only one stream but got %d.\n", job->sub_fmt_ctx->nb_streams);
+			return AVERROR_INVALIDDATA;
+		}
+
+		if (job->sub_fmt_ctx->streams[0]->codecpar->codec_type != AVMEDIA_TYPE_SUBTITLE) {
+			error("%s: invalid subtitle media file.\n", config->subtitles);
+			error("Found only one stream of type %s\n",
+			      av_get_media_type_string(job->sub_fmt_ctx->streams[0]->codecpar->codec_type));
+			return AVERROR_INVALIDDATA;
+		}
+
+		job->sub_st = job->sub_fmt_ctx->streams[0];
+		return 0;
+	}
+
+	if (job->streaming) {
+		error("Reading the media from a stream requires a subtitle file.\n");
+		return AVERROR(EINVAL);
+	}
+
+	if ((index = choose_stream(config, job->in_fmt_ctx->streams, job->in_fmt_ctx->nb_streams,
+	                           AVMEDIA_TYPE_SUBTITLE)) < 0) {
+		if (index == AVERROR_STREAM_NOT_FOUND)
+			error("%s: no subtitle streams found.\n", config->input);
+		else
+			error("%s: failed to choose subtitle stream: %s\n", config->input, av_err2str(index));
+		return index;
+	}
+
+	/*
+	 * Processing audio and subtitle from the same container sucks.
+	 * For that reason, we will always have a different context for the subtitle,
+	 * even if it was found inside the same container as the input audio.
+	 */
+	if ((ret = av_dict_copy(&opts, config->demux_opts, 0)) < 0)
+		return ret;
+
+	/* Unused options were already reported by the first open. */
+	if ((ret = format_open_input(&job->sub_fmt_ctx, config->input, NULL,
+	                             config->fast_probe, &opts)) < 0) {
+		error("%s: failed to open media file: %s\n", config->input, av_err2str(ret));
+		goto end;
+	}
+
+	if (index >= (int)job->sub_fmt_ctx->nb_streams) {
+		ret = AVERROR_STREAM_NOT_FOUND;
+		goto end;
+	}
+
+	job->sub_st = job->sub_fmt_ctx->streams[index];
+
+end:
+	av_dict_free(&opts);
+
+	return ret;
+}
+
+static int open_decoder(struct speechful_job *job, const struct speechful_config *config)
+{
+	const struct AVCodec *codec;
+	AVDictionary *opts = NULL;
+	enum AVCodecID id = job->in_st->codecpar->codec_id;
+	int ret = 0;
+
+	if (!(codec = find_codec(job->sf, id, false))) {
+		error("%s: no decoder available.\n", avcodec_get_name(id));
+		return AVERROR_DECODER_NOT_FOUND;
+	}
+
+	if (job->pool && !av_dict_count(config->dec_opts)) {
+		job->pooled_dec = true;
+		job->dec = pool_take_decoder(job->pool, job->in_st->codecpar);
+	}
+
+	if (!job->dec) {
+		if ((ret = av_dict_copy(&opts, config->dec_opts, 0)) < 0)
+			return ret;
+
+		if ((ret = codec_open_decoder(&job->dec, codec, job->in_st->codecpar, &opts)) < 0) {
+			error("%s: failed to open decoder: %s\n", avcodec_get_name(id), av_err2str(ret));
+			goto end;
+		}
+
+		warn_unused_options(opts, "decoder");
+	}
+
+	job->dec->pkt_timebase = job->in_st->time_base;
+
+end:
+	av_dict_free(&opts);
+
+	return ret;
+}
+
+static int open_encoder(struct speechful_job *job, const struct speechful_config *config)
+{
+	struct audio_output *output = &job->output;
+	const struct AVCodec *codec;
+	AVDictionary *opts = NULL;
+	int ret = 0;
+
+	if (!(codec = find_codec(job->sf, config->codec, true))) {
+		error("%s: no encoder available.\n", avcodec_get_name(config->codec));
+		return AVERROR_ENCODER_NOT_FOUND;
+	}
+
+	if (job->pool && !av_dict_count(config->enc_opts)) {
+		job->pooled_enc = true;
+		output->enc = pool_take_encoder(job->pool, config->codec, &output->settings);
+	}
+
+	if (!output->enc) {
+		if ((ret = av_dict_copy(&opts, config->enc_opts, 0)) < 0)
+			return ret;
+
+		if ((ret = codec_open_audio_encoder(&output->enc, codec, output->settings, &opts)) < 0) {
+			error("%s: failed to open encoder: %s\n", avcodec_get_name(config->codec), av_err2str(ret));
+			goto end;
+		}
+
+		warn_unused_options(opts, "encoder");
+	}
+
+	/*
+	 * Encoders that take fixed frame sizes are fed from a queue; the rest,
+	 * PCM for one, get the samples as they come, see format_write_audio_data().
+	 */
+	if (!codec_supports(output->enc->codec, AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
+	    && output->enc->frame_size > 0
+	    && !(output->queue = av_audio_fifo_alloc(output->enc->sample_fmt,
+	                                             output->enc->ch_layout.nb_channels,
+	                                             1))) {
+		error("Failed to alloc queue: out of memory.\n");
+		ret = AVERROR(ENOMEM);
+	}
+
+end:
+	av_dict_free(&opts);
+
+	return ret;
+}
+
+static int load_cues(struct speechful_job *job, const struct speechful_config *config)
+{
+	int ret;
+
+	if (!config->vad.enabled) {
+		if ((ret = cue_table_load(&job->cues, job->sub_fmt_ctx, job->sub_st, job->dec->sample_rate,
+		                          config->padding_left_ms, config->padding_right_ms)) < 0)
+			error("%s: failed to read subtitle data: %s\n", job->sub_fmt_ctx->url, av_err2str(ret));
+		return ret;
+	}
+
+	if ((ret = cue_table_detect(&job->cues, job->in_fmt_ctx, job->in_st, job->dec, &config->vad,
+	                            config->padding_left_ms, config->padding_right_ms)) < 0)
+		error("%s: failed to detect speech: %s\n", job->in_fmt_ctx->url, av_err2str(ret));
+
+	return ret;
+}
+
+static int refine_cues(struct speechful_job *job, const struct speechful_config *config)
+{
+	int ret;
+
+	if (!config->refine_ms)
+		return 0;
+
+	if ((ret = cue_table_refine(&job->cues, job->in_fmt_ctx, job->in_st, job->dec,
+	                            config->refine_ms)) < 0)
+		error("%s: failed to refine cue edges: %s\n", job->in_fmt_ctx->url, av_err2str(ret));
+
+	return ret;
+}
+
+/* Without segmentation every cue is a clip of its own. */
+static int segment_cues(struct speechful_job *job, const struct speechful_config *config)
+{
+	const struct speechful_segment *segment = &config->segment;
+	int ret;
+
+	if (segment->enabled
+	    && (ret = cue_table_split(&job->cues, job->in_fmt_ctx, job->in_st, job->dec,
+	                              segment->max_ms)) < 0) {
+		error("%s: failed to split long cues: %s\n", job->in_fmt_ctx->url, av_err2str(ret));
+		return ret;
+	}
+
+	if ((ret = cue_table_group(&job->clips, &job->cues,
+	                           segment->enabled ? ms2samples(job->dec->sample_rate, segment->target_ms)
+	                                            : 0)) < 0)
+		return ret;
+
+	if (segment->enabled && segment->manifest
+	    && (ret = clip_write_manifest(segment->manifest, &job->clips, &job->cues,
+	                                  job->dec->sample_rate, segment->bucket_ms)) < 0)
+		error("%s: failed to write the clip manifest: %s\n", segment->manifest, av_err2str(ret));
+
+	return ret;
+}
+
+static int open_muxer(struct speechful_job *job, const struct speechful_config *config)
+{
+	struct audio_output *output = &job->output;
+	struct AVStream *st;
+	AVDictionary *opts = NULL;
+	int ret;
+
+	if (config->output_fd >= 0) {
+		/* There is no file name to guess the container from. */
+		if ((ret = avformat_alloc_output_context2(&output->fmt, NULL, "mp3", NULL)) < 0) {
+			error("Failed to open the output stream: %s\n", av_err2str(ret));
+			return ret;
+		}
+
+		if ((ret = io_open_pipe_output(&job->out_pb, config->output_fd)) < 0) {
+			error("Failed to open the output stream: %s\n", av_err2str(ret));
+			return ret;
+		}
+
+		output->fmt->pb = job->out_pb;
+	} else {
+		if ((ret = avformat_alloc_output_context2(&output->fmt, NULL, NULL, config->output)) < 0) {
+			error("%s: failed to open media file: %s\n", config->output, av_err2str(ret));
+			return ret;
+		}
+
+		if (!(output->fmt->oformat->flags & AVFMT_NOFILE)) {
+			if ((ret = io_open_file_output(&job->out_pb, output->fmt->url)) < 0) {
+				error("%s: failed to open media file: %s\n", output->fmt->url, av_err2str(ret));
+				return ret;
+			}
+
+			output->fmt->pb = job->out_pb;
+		}
+	}
+
+	if (!(st = avformat_new_stream(output->fmt, NULL))) {
+		error("%s: failed to attach audio track: out of memory.\n", output->fmt->url);
+		return AVERROR(ENOMEM);
+	}
+
+	if ((ret = avcodec_parameters_from_context(st->codecpar, output->enc)) < 0) {
+		error("%s: failed to record encoder settings: %s\n",
+		       avcodec_get_name(output->enc->codec->id), av_err2str(ret));
+		return ret;
+	}
+
+	st->time_base.num = 1;
+	st->time_base.den = output->enc->sample_rate;
+
+	if ((ret = av_dict_copy(&opts, config->mux_opts, 0)) < 0)
+		return ret;
+
+	if ((ret = avformat_write_header(output->fmt, &opts)) < 0) {
+		error("%s: failed to open media file: %s\n", output->fmt->url, av_err2str(ret));
+		goto end;
+	}
+
+	warn_unused_options(opts, "muxer");
+	ret = 0;
+
+end:
+	av_dict_free(&opts);
+
+	return ret;
+}
+
+static int open_features(struct speechful_job *job, const struct speechful_config *config)
+{
+	struct audio_output *output = &job->output;
+	struct cue_output features = {NULL, log_mel_write, log_mel_end_cue};
+	int ret;
+
+	if ((ret = log_mel_alloc(&job->mel, &config->mel, output->settings.sample_fmt,
+	                         output->settings.channels, output->settings.sample_rate)) < 0) {
+		if (ret == AVERROR(ENOSYS))
+			error("Features cannot be taken from %s samples.\n",
+			      av_get_sample_fmt_name(output->settings.sample_fmt));
+		else
+			error("%s: failed to set up features: %s\n", config->mel.dir, av_err2str(ret));
+		return ret;
+	}
+
+	features.opaque = job->mel;
+
+	return audio_output_split(output, &features, job->dec);
+}
+
+static int open_raw(struct speechful_job *job, const struct speechful_config *config)
+{
+	struct audio_output *output = &job->output;
+	struct cue_output raw = {NULL, raw_pcm_write, raw_pcm_end_cue};
+	int ret;
+
+	if ((ret = raw_pcm_open(&job->raw, &config->raw, &output->settings,
+	                        &job->clips, job->dec->sample_rate)) < 0) {
+		if (ret == AVERROR(ENOSYS))
+			error("Raw PCM cannot be written as %s from %s samples.\n",
+			      av_get_sample_fmt_name(config->raw.sample_fmt),
+			      av_get_sample_fmt_name(output->settings.sample_fmt));
+		else
+			error("%s: failed to open raw PCM file: %s\n", config->raw.path, av_err2str(ret));
+		return ret;
+	}
+
+	raw.opaque = job->raw;
+
+	return audio_output_split(output, &raw, job->dec);
+}
+
+int speechful_job_open(struct speechful_job **job, struct speechful *sf,
+                       const struct speechful_config *config)
+{
+	struct audio_output *output;
+	bool encoded = config->output || config->output_fd >= 0 || config->sink.packet;
+	int ret;
+
+	if (!config->input && config->input_fd < 0) {
+		error("No input media file was provided.\n");
+		return AVERROR(EINVAL);
+	}
+
+	if (config->vad.enabled && (config->subtitles || config->input_fd >= 0)) {
+		error("Voice activity detection needs a seekable input and no subtitles.\n");
+		return AVERROR(EINVAL);
+	}
+
+	if (config->refine_ms && config->input_fd >= 0) {
+		error("Refining cue edges needs a seekable input.\n");
+		return AVERROR(EINVAL);
+	}
+
+	if (config->segment.enabled && config->input_fd >= 0) {
+		error("Segmenting cues needs a seekable input.\n");
+		return AVERROR(EINVAL);
+	}
+
+	if (config->segment.enabled
+	    && (config->segment.max_ms <= 0 || config->segment.target_ms < 0
+	        || config->segment.bucket_ms <= 0)) {
+		error("Segmenting cues needs a positive maximum length and bucket width.\n");
+		return AVERROR(EINVAL);
+	}
+
+	if (!(*job = av_mallocz(sizeof(struct speechful_job))))
+		return AVERROR(ENOMEM);
+
+	(*job)->sf              = sf;
+	(*job)->streaming       = config->input_fd >= 0;
+	(*job)->progress        = config->progress;
+	(*job)->progress_opaque = config->progress_opaque;
+	(*job)->pool            = config->pool;
+
+	output = &(*job)->output;
+	output->sink                 = config->sink;
+	output->settings.channels    = config->channels;
+	output->settings.sample_rate = config->sample_rate;
+	output->settings.bit_rate    = config->bit_rate;
+	output->settings.sample_fmt  = config->sample_fmt;
+
+	if ((ret = open_input(*job, config)) < 0
+	    || (!config->vad.enabled && (ret = open_subtitles(*job, config)) < 0)
+	    || (ret = open_decoder(*job, config)) < 0
+	    || (ret = load_cues(*job, config)) < 0
+	    || (ret = refine_cues(*job, config)) < 0
+	    || (ret = segment_cues(*job, config)) < 0)
+		goto err_close;
+
+	/* Only our own input backends take hints; a pipe simply ignores them. */
+	if ((ret = cue_plan_init(&(*job)->plan, (*job)->in_pb, (*job)->in_fmt_ctx, (*job)->in_st,
+	                         (*job)->dec->sample_rate, &(*job)->cues)) < 0) {
+		error("Failed to plan input reads: %s\n", av_err2str(ret));
+		goto err_close;
+	}
+
+	if (encoded && (ret = open_encoder(*job, config)) < 0)
+		goto err_close;
+
+	if ((config->output || config->output_fd >= 0) && (ret = open_muxer(*job, config)) < 0)
+		goto err_close;
+
+	stats_set_media((*job)->in_fmt_ctx->duration != AV_NOPTS_VALUE
+	                ? (double)(*job)->in_fmt_ctx->duration / AV_TIME_BASE : 0,
+	                (*job)->dec->sample_rate, output->settings.sample_rate);
+
+	if ((*job)->pool)
+		output->resampler = pool_take_resampler((*job)->pool, &output->settings, (*job)->dec);
+
+	if (!output->resampler
+	    && (ret = resampler_open(&output->resampler, &output->settings, (*job)->dec)) < 0) {
+		error("Failed to initialize audio resampler: %s\n", av_err2str(ret));
+		goto err_close;
+	}
+
+	if (config->trim.enabled
+	    && (ret = audio_output_trim(output, &config->trim, (*job)->dec)) < 0) {
+		error("Failed to initialize silence trimming: %s\n", av_err2str(ret));
+		goto err_close;
+	}
+
+	if (config->loudness.enabled
+	    && (ret = audio_output_normalise(output, &config->loudness)) < 0) {
+		if (ret == AVERROR(ENOSYS))
+			error("Loudness normalisation does not support %s samples.\n",
+			      av_get_sample_fmt_name(output->settings.sample_fmt));
+		else
+			error("Failed to initialize loudness normalisation: %s\n", av_err2str(ret));
+		goto err_close;
+	}
+
+	if (config->peaks.path && (ret = audio_output_peaks(output, &config->peaks)) < 0) {
+		if (ret == AVERROR(ENOSYS))
+			error("Waveform peaks cannot be taken from %s samples.\n",
+			      av_get_sample_fmt_name(output->settings.sample_fmt));
+		else
+			error("Failed to initialize waveform peaks: %s\n", av_err2str(ret));
+		goto err_close;
+	}
+
+	if ((config->mel.dir && (ret = open_features(*job, config)) < 0)
+	    || (config->raw.path && (ret = open_raw(*job, config)) < 0))
+		goto err_close;
+
+	if (!((*job)->pkt = av_packet_alloc()) || !((*job)->frame = av_frame_alloc())) {
+		error("Failed to alloc packet or frame: out of memory.\n");
+		ret = AVERROR(ENOMEM);
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	speechful_job_close(job);
+
+	return ret;
+}
+
+int speechful_job_run(struct speechful_job *job)
+{
+	struct audio_output *output = &job->output;
+	int ret;
+
+	if (job->streaming)
+		ret = extract_in_one_pass(job);
+	else
+		ret = extract_by_seeking(job);
+
+	if (ret < 0)
+		return ret;
+
+	if ((ret = decoder_send_packet(job->dec, NULL)) < 0) {
+		error("Failed to flush audio decoder: %s\n", av_err2str(ret));
+		return ret;
+	}
+
+	while ((ret = decoder_receive_frame(job->dec, job->frame)) == 0) {
+		ret = audio_output_write(output, (const u8 *const *)job->frame->extended_data,
+		                         job->frame->nb_samples);
+		av_frame_unref(job->frame);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (ret != AVERROR_EOF) {
+		error("Failed to flush audio decoder: %s\n", av_err2str(ret));
+		return ret;
+	}
+
+	if ((ret = audio_output_begin_cue(output, job->clips.nr_cues)) < 0
+	    || (ret = audio_output_flush(output)) < 0)
+		return ret;
+
+	if (!output->enc)
+		return 0;
+
+	/* Flush the encoder and the container format. */
+	if ((ret = format_write_audio_data(output->fmt, &output->sink, output->enc, output->queue,
+	                                   NULL, 0, &output->next_pts)) < 0) {
+		error("%s: failed to write audio data: %s\n",
+		      output->fmt ? output->fmt->url : "packet sink", av_err2str(ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+int speechful_job_close(struct speechful_job **job)
+{
+	struct speechful_job *j = *job;
+	int ret = 0;
+
+	if (!j)
+		return 0;
+
+	/* The decoder is keyed by the stream parameters, so it goes back before the input closes. */
+	if (j->pool) {
+		if (j->output.resampler && j->dec)
+			pool_give_resampler(j->pool, &j->output.resampler, &j->output.settings, j->dec);
+		if (j->dec && j->pooled_dec)
+			pool_give_decoder(j->pool, &j->dec, j->in_st->codecpar);
+		if (j->output.enc && j->pooled_enc)
+			pool_give_encoder(j->pool, &j->output.enc, &j->output.settings);
+	}
+
+	if (j->in_fmt_ctx)
+		avformat_close_input(&j->in_fmt_ctx);
+
+	if (j->in_pb)
+		io_close(&j->in_pb);
+
+	if (j->output.fmt) {
+		if (j->out_pb && (ret = io_close(&j->out_pb)) < 0)
+			error("%s: failed to write media file: %s\n", j->output.fmt->url, av_err2str(ret));
+		avformat_free_context(j->output.fmt);
+	}
+
+	if (j->sub_fmt_ctx)
+		avformat_close_input(&j->sub_fmt_ctx);
+
+	if (j->dec)
+		avcodec_free_context(&j->dec);
+
+	if (j->output.enc)
+		avcodec_free_context(&j->output.enc);
+
+	if (j->output.resampler)
+		resampler_free(&j->output.resampler);
+
+	if (j->output.queue)
+		av_audio_fifo_free(j->output.queue);
+
+	trim_free(&j->output.trim);
+	loudness_free(&j->output.loudness);
+	peaks_free(&j->output.peaks);
+	log_mel_free(&j->mel);
+	raw_pcm_free(&j->raw);
+	av_freep(&j->output.split.ends);
+
+	if (j->pkt)
+		av_packet_free(&j->pkt);
+
+	if (j->frame)
+		av_frame_free(&j->frame);
+
+	cue_table_free(&j->cues);
+	cue_table_free(&j->clips);
+	cue_plan_free(&j->plan);
+
+	av_freep(job);
+
+	return ret;
+}
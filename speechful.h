@@ -0,0 +1,276 @@
+#ifndef SPEECHFUL_H
+#define SPEECHFUL_H
+
+/*
+ * libspeechful: the extraction pipeline of the `speechful` tool, for programs
+ * that run many jobs in one process. Nothing here exits the process; every
+ * failure is returned as an AVERROR code and described through av_log().
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+#include <libavutil/samplefmt.h>
+
+/*
+ * Receives the output of a job. `pcm` gets the extracted speech after
+ * resampling, in the channels, rate and sample format of the job config.
+ * `packet` gets every encoded packet, with timestamps counted in samples of
+ * the output rate. Either may be NULL; a negative return aborts the job.
+ */
+struct speechful_sink {
+	void *opaque;
+	int (*pcm)(void *opaque, const uint8_t *const *data, int samples);
+	int (*packet)(void *opaque, const struct AVPacket *pkt);
+};
+
+enum speechful_input_backend {
+	SPEECHFUL_INPUT_DEFAULT,
+	SPEECHFUL_INPUT_MMAP,
+	SPEECHFUL_INPUT_READAHEAD,
+};
+
+/*
+ * Voice activity detection, for media without subtitles. Over 10 ms windows,
+ * speech starts `start_db` above the tracked noise floor and goes on until
+ * it falls under `stop_db`, with noisy, quiet windows (fricatives) counting
+ * as speech meanwhile. Pauses shorter than `min_silence_ms` are bridged, then
+ * speech shorter than `min_speech_ms` is dropped.
+ */
+struct speechful_vad {
+	bool  enabled;
+	float start_db;
+	float stop_db;
+	int   min_speech_ms;
+	int   min_silence_ms;
+};
+
+/*
+ * Shortens the pauses inside the extracted speech. A run of 10 ms windows
+ * quieter than `threshold_db` (dBFS) that lasts longer than `min_silence_ms`
+ * is cut down to its first `keep_ms`.
+ */
+struct speechful_trim {
+	bool  enabled;
+	float threshold_db;
+	int   min_silence_ms;
+	int   keep_ms;
+};
+
+/*
+ * Brings the output towards `target_lufs` of short-term (3 s) loudness in a
+ * single pass. The output is delayed by `lookahead_ms` so the gain comes
+ * down before a loud passage rather than after it; it rises by at most
+ * `max_gain_db` and keeps peaks under `ceiling_db` dBFS. Works on s16, s32,
+ * float and double output.
+ */
+struct speechful_loudness {
+	bool  enabled;
+	float target_lufs;
+	float max_gain_db;
+	float ceiling_db;
+	int   lookahead_ms;
+};
+
+/*
+ * Reshapes the cues into clips of more even length, for training on them.
+ * Cues longer than `max_ms` are first cut at quiet points into pieces that
+ * are not, then adjacent cues are grouped into clips of at most
+ * `target_ms` of audio, a longer one staying a clip of its own. The
+ * features and raw PCM then have one entry per clip where they would have
+ * one per cue. With `manifest`, the clips are listed there, grouped into
+ * duration buckets `bucket_ms` wide. Cutting needs a seekable input.
+ */
+struct speechful_segment {
+	bool        enabled;
+	int         max_ms;
+	int         target_ms;
+	int         bucket_ms;
+	const char *manifest;
+};
+
+/*
+ * Log-mel features of the output, written to `dir` (created if missing) as
+ * one `<cue>.npy` per cue, or per clip, numbered from 0 and padded to six
+ * digits: a float32 array of frames by `bins`. Each frame is the natural
+ * log of the mel-weighted power spectrum of a `window_ms` Hann window of
+ * the channels averaged, taken every `hop_ms` within the cue.
+ */
+struct speechful_mel {
+	const char *dir;
+	int         bins;
+	int         window_ms;
+	int         hop_ms;
+};
+
+/*
+ * The output as raw PCM in one file at `path`, for loaders that map it and
+ * reach any cue directly. `sample_fmt` is AV_SAMPLE_FMT_FLT or
+ * AV_SAMPLE_FMT_S16, the channels interleaved. Everything is in the byte
+ * order of the machine that wrote it:
+ *
+ *   header, 32 bytes:  char magic[4] "SPCM", u16 version 1,
+ *                      u16 format (1 float, 2 s16), u32 sample_rate,
+ *                      u32 channels, u32 nr_cues, u32 reserved (0),
+ *                      u64 data_offset
+ *   nr_cues entries,   u32 cue, u32 reserved (0), u64 offset, u64 length,
+ *   40 bytes each:     i64 start_us, i64 end_us
+ *
+ * The samples start at `data_offset`, a multiple of 4096. A cue's `offset`
+ * and `length` count samples per channel from there; `start_us` and
+ * `end_us` are where it was taken from the input, padding included. With
+ * segmentation the entries are clips, spanning their first cue's start to
+ * their last cue's end.
+ */
+struct speechful_raw {
+	const char         *path;
+	enum AVSampleFormat sample_fmt;
+};
+
+/*
+ * Waveform peaks of the output, for drawing it at any zoom without decoding
+ * it again, written to `path` once the job is done. The finest of `levels`
+ * levels holds the minimum, maximum and RMS of every `bucket` samples, the
+ * channels taken together; each level after it, of every 4 buckets of the
+ * one before. In the byte order of the machine that wrote it:
+ *
+ *   header, 24 bytes:  char magic[4] "SPKS", u16 version 1, u16 nr_levels,
+ *                      u32 sample_rate, u32 channels, u64 samples
+ *   nr_levels entries, u32 bucket (samples), u32 reserved (0),
+ *   16 bytes each:     u64 nr_buckets
+ *
+ * then the buckets of each level in turn, finest first, each three s16 of
+ * full scale 32767: min, max and RMS. The last bucket of a level may be
+ * short.
+ */
+struct speechful_peaks {
+	const char *path;
+	int         bucket;
+	int         levels;
+};
+
+struct speechful_config {
+	/* The media, by path or, when `input_fd` is not -1, as an unseekable stream. */
+	const char                  *input;
+	int                          input_fd;
+	enum speechful_input_backend input_backend;
+	int                          io_delay_ms;
+	bool                         fast_probe;
+
+	/*
+	 * A subtitle file; NULL uses the subtitles embedded in `input`. With
+	 * `vad.enabled` the cues are detected instead, in a decoding pass over
+	 * the whole input before extraction, which needs a seekable input and
+	 * decodes the speech a second time.
+	 */
+	const char           *subtitles;
+	struct speechful_vad  vad;
+	int64_t               padding_left_ms;
+	int64_t               padding_right_ms;
+
+	/*
+	 * When not 0, each cue edge then moves to the quietest point within
+	 * this many ms of it, so timing errors need no padding to cover them.
+	 * Needs a seekable input.
+	 */
+	int refine_ms;
+
+	struct speechful_segment segment;
+
+	/*
+	 * A file to write, its container guessed from the name, or a descriptor
+	 * to stream MP3 to. With neither, only the sink, the features, the raw
+	 * PCM and the peaks get the output, and nothing is encoded unless the
+	 * sink takes packets.
+	 */
+	const char *output;
+	int         output_fd;
+
+	struct speechful_mel   mel;
+	struct speechful_raw   raw;
+	struct speechful_peaks peaks;
+
+	struct speechful_trim     trim;
+	struct speechful_loudness loudness;
+
+	enum AVCodecID      codec;
+	int                 channels;
+	int                 sample_rate;
+	int                 bit_rate;
+	enum AVSampleFormat sample_fmt;
+
+	/* Copied by the job; whatever FFmpeg does not use is warned about. */
+	const AVDictionary *demux_opts;
+	const AVDictionary *dec_opts;
+	const AVDictionary *enc_opts;
+	const AVDictionary *mux_opts;
+
+	/*
+	 * Picks one of several candidate streams, returning its position in
+	 * `candidates`. Without it the first candidate is used.
+	 */
+	int  (*choose_stream)(void *opaque, struct AVStream *const *candidates, int nr_candidates);
+	void  *choose_stream_opaque;
+
+	/* Called as each cue is finished, `done` out of `nr_cues`. */
+	void (*progress)(void *opaque, int done, int nr_cues);
+	void  *progress_opaque;
+
+	struct speechful_sink sink;
+
+	/* Where the job takes its codec and resampler contexts from and returns them to. */
+	struct speechful_pool *pool;
+};
+
+/* State shared by the jobs of a process, e.g. codec lookups. Thread-safe. */
+struct speechful;
+struct speechful_job;
+
+/*
+ * Opened codec and resampler contexts kept warm between jobs. A pool belongs
+ * to one thread at a time; give each worker its own. Contexts opened with
+ * `dec_opts` or `enc_opts` are not pooled.
+ */
+struct speechful_pool;
+
+int  speechful_alloc(struct speechful **sf);
+void speechful_free(struct speechful **sf);
+
+int  speechful_pool_alloc(struct speechful_pool **pool);
+void speechful_pool_free(struct speechful_pool **pool);
+
+/*
+ * Opens fresh contexts in place of those the last jobs could not give back
+ * warm, like LAME encoders, which cannot be restarted once drained. Call it
+ * between jobs, when the thread would otherwise wait, so the next job of
+ * the same shape does not pay for opening them.
+ */
+int  speechful_pool_refill(struct speechful_pool *pool);
+
+/*
+ * Fills `config` with the defaults: no descriptors, 64 kbps stereo MP3 at
+ * 44.1 kHz, a disabled VAD that starts at 12 dB, stops at 6 dB and keeps
+ * 250 ms of speech separated by 300 ms of silence, disabled trimming of
+ * pauses over 500 ms under -45 dBFS down to 200 ms, and disabled loudness
+ * normalisation to -16 LUFS, at most 20 dB up, -1 dBFS peaks and 300 ms of
+ * lookahead, no segmentation, into clips of 10 s from cues of at most 20 s
+ * in 2 s buckets when enabled, no features, 80 mel bins of 25 ms windows
+ * every 10 ms when they are asked for, no raw PCM, float when it is asked
+ * for, and no peaks, 5 levels from 64 samples up when they are asked for.
+ */
+void speechful_config_init(struct speechful_config *config);
+
+/*
+ * Opens the inputs, codecs and outputs of a job; `config` is not referenced
+ * afterwards. `speechful_job_run()` then extracts every cue, and
+ * `speechful_job_close()` releases the job, whether it ran or not.
+ */
+int  speechful_job_open(struct speechful_job **job, struct speechful *sf,
+                        const struct speechful_config *config);
+int  speechful_job_run(struct speechful_job *job);
+int  speechful_job_close(struct speechful_job **job);
+
+#endif
@@ -0,0 +1,252 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libavutil/avutil.h>
+
+#include "alloc.h"
+#include "stats.h"
+#include "trace.h"
+
+typedef int64_t i64;
+
+struct stage_totals {
+	i64 wall_ns;
+	i64 cpu_ns;
+	i64 calls;
+};
+
+static struct {
+	bool                enabled;
+	i64                 started_wall_ns;
+	i64                 started_cpu_ns;
+	struct stage_totals stages[NR_STAGES];
+	i64                 counters[NR_COUNTERS];
+	double              input_seconds;
+	int                 input_sample_rate;
+	int                 output_sample_rate;
+} stats;
+
+static const char *const stage_names[NR_STAGES] = {
+	[STAGE_PROBE]    = "probe",
+	[STAGE_SEEK]     = "seek",
+	[STAGE_READ]     = "read",
+	[STAGE_DECODE]   = "decode",
+	[STAGE_ANALYSIS] = "analysis",
+	[STAGE_EXTRACT]  = "extract",
+	[STAGE_TRIM]     = "trim",
+	[STAGE_RESAMPLE] = "resample",
+	[STAGE_LOUDNESS] = "loudness",
+	[STAGE_FEATURES] = "features",
+	[STAGE_PEAKS]    = "peaks",
+	[STAGE_ENCODE]   = "encode",
+	[STAGE_WRITE]    = "write",
+};
+
+static const char *const counter_names[NR_COUNTERS] = {
+	[COUNTER_SEEKS]                = "seeks",
+	[COUNTER_PACKETS_READ]         = "packets_read",
+	[COUNTER_PACKETS_DISCARDED]    = "packets_discarded",
+	[COUNTER_FRAMES_DECODED]       = "frames_decoded",
+	[COUNTER_FRAMES_DISCARDED]     = "frames_discarded",
+	[COUNTER_SAMPLES_IN]           = "samples_in",
+	[COUNTER_SAMPLES_OUT]          = "samples_out",
+	[COUNTER_BYTES_WRITTEN]        = "bytes_written",
+	[COUNTER_READAHEAD_HIT_BYTES]  = "readahead_hit_bytes",
+	[COUNTER_READAHEAD_MISS_BYTES] = "readahead_miss_bytes",
+	[COUNTER_PROBE_BYTES]          = "probe_bytes",
+	[COUNTER_PROBE_FALLBACKS]      = "probe_fallbacks",
+	[COUNTER_SAMPLES_TRIMMED]      = "samples_trimmed",
+};
+
+static i64 clock_ns(clockid_t id)
+{
+	struct timespec ts;
+
+	if (clock_gettime(id, &ts) < 0)
+		return 0;
+
+	return (i64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double ns2s(i64 ns)
+{
+	return ns / 1e9;
+}
+
+void stats_init(bool enabled)
+{
+	memset(&stats, 0, sizeof(stats));
+
+	stats.enabled         = enabled;
+	stats.started_wall_ns = clock_ns(CLOCK_MONOTONIC);
+	stats.started_cpu_ns  = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/* Stage measurements also feed the tracer, which shares the monotonic clock. */
+void stats_stage_begin(struct stage_clock *clock, enum stats_stage stage)
+{
+	clock->stage            = stage;
+	clock->prev_alloc_stage = alloc_enter_stage(stage);
+
+	if (!stats.enabled && !trace_enabled())
+		return;
+
+	clock->wall_ns = clock_ns(CLOCK_MONOTONIC);
+	clock->cpu_ns  = stats.enabled ? clock_ns(CLOCK_THREAD_CPUTIME_ID) : 0;
+}
+
+void stats_stage_end(const struct stage_clock *clock)
+{
+	struct stage_totals *totals = &stats.stages[clock->stage];
+	i64 now;
+
+	alloc_leave_stage(clock->prev_alloc_stage);
+
+	if (!stats.enabled && !trace_enabled())
+		return;
+
+	now = clock_ns(CLOCK_MONOTONIC);
+	trace_span(stage_names[clock->stage], clock->wall_ns, now);
+
+	if (!stats.enabled)
+		return;
+
+	totals->wall_ns += now - clock->wall_ns;
+	totals->cpu_ns  += clock_ns(CLOCK_THREAD_CPUTIME_ID) - clock->cpu_ns;
+	totals->calls++;
+}
+
+void stats_count(enum stats_counter counter, i64 n)
+{
+	if (!stats.enabled)
+		return;
+
+	stats.counters[counter] += n;
+}
+
+void stats_set_media(double input_seconds, int input_sample_rate, int output_sample_rate)
+{
+	if (!stats.enabled)
+		return;
+
+	stats.input_seconds      = input_seconds;
+	stats.input_sample_rate  = input_sample_rate;
+	stats.output_sample_rate = output_sample_rate;
+}
+
+const char *stats_stage_name(enum stats_stage stage)
+{
+	return stage_names[stage];
+}
+
+static double output_seconds(void)
+{
+	if (!stats.output_sample_rate)
+		return 0;
+	return (double)stats.counters[COUNTER_SAMPLES_OUT] / stats.output_sample_rate;
+}
+
+static double trimmed_seconds(void)
+{
+	if (!stats.input_sample_rate)
+		return 0;
+	return (double)stats.counters[COUNTER_SAMPLES_TRIMMED] / stats.input_sample_rate;
+}
+
+/*
+ * Encoding cost is about linear in its input, so the trimmed audio would have
+ * taken its share of the encoding time measured for the audio that was kept.
+ */
+static double encode_seconds_saved(void)
+{
+	double kept = output_seconds();
+
+	if (!kept)
+		return 0;
+	return ns2s(stats.stages[STAGE_ENCODE].wall_ns) * trimmed_seconds() / kept;
+}
+
+static double realtime_factor(i64 wall_ns)
+{
+	if (!wall_ns)
+		return 0;
+	return stats.input_seconds / ns2s(wall_ns);
+}
+
+void stats_report_summary(FILE *out)
+{
+	i64 wall_ns = clock_ns(CLOCK_MONOTONIC)         - stats.started_wall_ns;
+	i64 cpu_ns  = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - stats.started_cpu_ns;
+	int i;
+
+	fprintf(out, "Processed %.3fs of input into %.3fs of output in %.3fs (%.3fs CPU), %.1fx realtime.\n",
+	        stats.input_seconds, output_seconds(), ns2s(wall_ns), ns2s(cpu_ns),
+	        realtime_factor(wall_ns));
+
+	fprintf(out, "%-10s %12s %12s %7s %10s\n", "stage", "wall (s)", "cpu (s)", "wall %", "calls");
+	for (i = 0; i < NR_STAGES; ++i) {
+		const struct stage_totals *s = &stats.stages[i];
+
+		fprintf(out, "%-10s %12.6f %12.6f %6.1f%% %10" PRId64 "\n",
+		        stage_names[i], ns2s(s->wall_ns), ns2s(s->cpu_ns),
+		        wall_ns ? 100.0 * s->wall_ns / wall_ns : 0.0, s->calls);
+	}
+
+	for (i = 0; i < NR_COUNTERS; ++i)
+		fprintf(out, "%-20s %" PRId64 "\n", counter_names[i], stats.counters[i]);
+
+	if (stats.counters[COUNTER_SAMPLES_TRIMMED])
+		fprintf(out, "Trimmed %.3fs of silence, saving about %.3fs of encoding.\n",
+		        trimmed_seconds(), encode_seconds_saved());
+}
+
+int stats_report_json(const char *filepath)
+{
+	i64 wall_ns = clock_ns(CLOCK_MONOTONIC)         - stats.started_wall_ns;
+	i64 cpu_ns  = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - stats.started_cpu_ns;
+	FILE *out;
+	int i;
+
+	if (strcmp(filepath, "-") == 0)
+		out = stdout;
+	else if (!(out = fopen(filepath, "w")))
+		return AVERROR(errno);
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"wall_seconds\": %.9f,\n", ns2s(wall_ns));
+	fprintf(out, "  \"cpu_seconds\": %.9f,\n", ns2s(cpu_ns));
+	fprintf(out, "  \"input_seconds\": %.6f,\n", stats.input_seconds);
+	fprintf(out, "  \"input_sample_rate\": %d,\n", stats.input_sample_rate);
+	fprintf(out, "  \"output_seconds\": %.6f,\n", output_seconds());
+	fprintf(out, "  \"output_sample_rate\": %d,\n", stats.output_sample_rate);
+	fprintf(out, "  \"realtime_factor\": %.3f,\n", realtime_factor(wall_ns));
+	fprintf(out, "  \"trimmed_seconds\": %.6f,\n", trimmed_seconds());
+	fprintf(out, "  \"encode_seconds_saved\": %.6f,\n", encode_seconds_saved());
+
+	fprintf(out, "  \"stages\": {\n");
+	for (i = 0; i < NR_STAGES; ++i) {
+		const struct stage_totals *s = &stats.stages[i];
+
+		fprintf(out, "    \"%s\": {\"wall_seconds\": %.9f, \"cpu_seconds\": %.9f, \"calls\": %" PRId64 "}%s\n",
+		        stage_names[i], ns2s(s->wall_ns), ns2s(s->cpu_ns), s->calls,
+		        i + 1 < NR_STAGES ? "," : "");
+	}
+	fprintf(out, "  },\n");
+
+	fprintf(out, "  \"counters\": {\n");
+	for (i = 0; i < NR_COUNTERS; ++i)
+		fprintf(out, "    \"%s\": %" PRId64 "%s\n", counter_names[i], stats.counters[i],
+		        i + 1 < NR_COUNTERS ? "," : "");
+	fprintf(out, "  }\n");
+	fprintf(out, "}\n");
+
+	if (out != stdout && fclose(out) == EOF)
+		return AVERROR(errno);
+
+	return 0;
+}
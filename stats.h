@@ -0,0 +1,69 @@
+#ifndef SPEECHFUL_STATS_H
+#define SPEECHFUL_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+enum stats_stage {
+	STAGE_PROBE,
+	STAGE_SEEK,
+	STAGE_READ,
+	STAGE_DECODE,
+	STAGE_ANALYSIS,
+	STAGE_EXTRACT,
+	STAGE_TRIM,
+	STAGE_RESAMPLE,
+	STAGE_LOUDNESS,
+	STAGE_FEATURES,
+	STAGE_PEAKS,
+	STAGE_ENCODE,
+	STAGE_WRITE,
+	NR_STAGES
+};
+
+enum stats_counter {
+	COUNTER_SEEKS,
+	COUNTER_PACKETS_READ,
+	COUNTER_PACKETS_DISCARDED,
+	COUNTER_FRAMES_DECODED,
+	COUNTER_FRAMES_DISCARDED,
+	COUNTER_SAMPLES_IN,
+	COUNTER_SAMPLES_OUT,
+	COUNTER_BYTES_WRITTEN,
+	COUNTER_READAHEAD_HIT_BYTES,
+	COUNTER_READAHEAD_MISS_BYTES,
+	COUNTER_PROBE_BYTES,
+	COUNTER_PROBE_FALLBACKS,
+	COUNTER_SAMPLES_TRIMMED,
+	NR_COUNTERS
+};
+
+/* A started measurement, see `stats_stage_begin()` and `stats_stage_end()`. */
+struct stage_clock {
+	int64_t          wall_ns;
+	int64_t          cpu_ns;
+	enum stats_stage stage;
+	int              prev_alloc_stage;
+};
+
+/*
+ * When `enabled` is false every measurement and count turns into a no-op,
+ * so the instrumented code pays nothing but a branch. The totals are shared
+ * and unsynchronised: processes running jobs on several threads, like
+ * `speechful serve`, leave stats disabled.
+ */
+void stats_init(bool enabled);
+void stats_stage_begin(struct stage_clock *clock, enum stats_stage stage);
+void stats_stage_end(const struct stage_clock *clock);
+void stats_count(enum stats_counter counter, int64_t n);
+
+/* Media durations, used to derive the realtime factor. */
+void stats_set_media(double input_seconds, int input_sample_rate, int output_sample_rate);
+
+const char *stats_stage_name(enum stats_stage stage);
+
+void stats_report_summary(FILE *out);
+int  stats_report_json(const char *filepath);
+
+#endif
@@ -0,0 +1,209 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <libavutil/avutil.h>
+
+#include "trace.h"
+
+typedef int64_t  i64;
+typedef uint64_t u64;
+
+/* Must be a power of two. */
+#define TRACE_RING_SIZE (1 << 16)
+
+struct trace_event {
+	const char *name;
+	i64         start_ns;
+	i64         end_ns;
+	int         cue;
+};
+
+struct trace_ring {
+	struct trace_event events[TRACE_RING_SIZE];
+	u64                head;
+	int                tid;
+	int                cue;
+	i64                cue_started_at;
+	struct trace_ring *next;
+};
+
+static struct {
+	bool               enabled;
+	i64                started_at;
+	pthread_key_t      key;
+	pthread_mutex_t    lock; /* Only guards `rings` and `nr_rings`. */
+	struct trace_ring *rings;
+	int                nr_rings;
+} tracer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+i64 trace_now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (i64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int trace_init(void)
+{
+	int ret;
+
+	if ((ret = pthread_key_create(&tracer.key, NULL)) != 0)
+		return AVERROR(ret);
+
+	tracer.enabled    = true;
+	tracer.started_at = trace_now_ns();
+
+	return 0;
+}
+
+bool trace_enabled(void)
+{
+	return tracer.enabled;
+}
+
+/* Returns the calling thread's ring, registering one on first use. */
+static struct trace_ring *thread_ring(void)
+{
+	struct trace_ring *ring;
+
+	if ((ring = pthread_getspecific(tracer.key)))
+		return ring;
+
+	if (!(ring = calloc(1, sizeof(struct trace_ring))))
+		return NULL;
+
+	ring->cue = -1;
+
+	pthread_mutex_lock(&tracer.lock);
+	ring->tid    = ++tracer.nr_rings;
+	ring->next   = tracer.rings;
+	tracer.rings = ring;
+	pthread_mutex_unlock(&tracer.lock);
+
+	pthread_setspecific(tracer.key, ring);
+
+	return ring;
+}
+
+static void ring_push(struct trace_ring *ring, const char *name, i64 start_ns, i64 end_ns)
+{
+	struct trace_event *ev = &ring->events[ring->head++ & (TRACE_RING_SIZE - 1)];
+
+	ev->name     = name;
+	ev->start_ns = start_ns;
+	ev->end_ns   = end_ns;
+	ev->cue      = ring->cue;
+}
+
+void trace_span(const char *name, i64 start_ns, i64 end_ns)
+{
+	struct trace_ring *ring;
+
+	if (!tracer.enabled || !(ring = thread_ring()))
+		return;
+
+	ring_push(ring, name, start_ns, end_ns);
+}
+
+void trace_cue_begin(int cue)
+{
+	struct trace_ring *ring;
+
+	if (!tracer.enabled || !(ring = thread_ring()))
+		return;
+
+	ring->cue            = cue;
+	ring->cue_started_at = trace_now_ns();
+}
+
+void trace_cue_end(void)
+{
+	struct trace_ring *ring;
+
+	if (!tracer.enabled || !(ring = thread_ring()))
+		return;
+
+	ring_push(ring, "cue", ring->cue_started_at, trace_now_ns());
+	ring->cue = -1;
+}
+
+static double ns2us(i64 ns)
+{
+	return ns / 1e3;
+}
+
+static void write_ring(FILE *out, const struct trace_ring *ring, bool *first)
+{
+	u64 i = ring->head > TRACE_RING_SIZE ? ring->head - TRACE_RING_SIZE : 0;
+
+	fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+	        "\"args\":{\"name\":\"%s %d\"}}",
+	        *first ? "" : ",", ring->tid, ring->tid == 1 ? "main" : "worker", ring->tid);
+	*first = false;
+
+	for (; i < ring->head; ++i) {
+		const struct trace_event *ev = &ring->events[i & (TRACE_RING_SIZE - 1)];
+
+		fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"speechful\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+		        "\"ts\":%.3f,\"dur\":%.3f",
+		        ev->name, ring->tid,
+		        ns2us(ev->start_ns - tracer.started_at), ns2us(ev->end_ns - ev->start_ns));
+
+		if (ev->cue >= 0)
+			fprintf(out, ",\"args\":{\"cue\":%d}", ev->cue);
+
+		fputc('}', out);
+	}
+}
+
+int trace_flush(const char *filepath)
+{
+	struct trace_ring *ring, *next;
+	bool first = true;
+	FILE *out;
+	int ret = 0;
+
+	if (!tracer.enabled)
+		return 0;
+
+	tracer.enabled = false;
+
+	if (!(out = fopen(filepath, "w"))) {
+		ret = AVERROR(errno);
+		goto end;
+	}
+
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (ring = tracer.rings; ring; ring = ring->next)
+		write_ring(out, ring, &first);
+	fprintf(out, "\n]}\n");
+
+	if (fclose(out) == EOF)
+		ret = AVERROR(errno);
+
+end:
+	pthread_mutex_lock(&tracer.lock);
+	for (ring = tracer.rings; ring; ring = next) {
+		next = ring->next;
+		free(ring);
+	}
+	tracer.rings    = NULL;
+	tracer.nr_rings = 0;
+	pthread_mutex_unlock(&tracer.lock);
+
+	pthread_key_delete(tracer.key);
+
+	return ret;
+}
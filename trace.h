@@ -0,0 +1,28 @@
+#ifndef SPEECHFUL_TRACE_H
+#define SPEECHFUL_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Span recorder producing Chrome trace-event JSON (loadable by Perfetto and
+ * chrome://tracing). Every thread records into its own ring buffer, so the
+ * hot path takes no locks; when a ring fills up the oldest spans are lost.
+ */
+
+int  trace_init(void);
+bool trace_enabled(void);
+
+/* `name` must outlive the tracer, string literals are the intended use. */
+void trace_span(const char *name, int64_t start_ns, int64_t end_ns);
+
+/* Brackets the work done for cue `cue`; spans recorded meanwhile are tagged with it. */
+void trace_cue_begin(int cue);
+void trace_cue_end(void);
+
+int64_t trace_now_ns(void);
+
+/* Writes every recorded span to `filepath` and releases the ring buffers. */
+int trace_flush(const char *filepath);
+
+#endif
@@ -0,0 +1,411 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <math.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/samplefmt.h>
+
+#include "pipeline.h"
+#include "stats.h"
+#include "trim.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Silence is judged over 10 ms windows, as in the detectors. */
+#define WINDOW_MS 10
+
+typedef double (*sum_squares_flt_fn)(const float *x, int n);
+typedef double (*sum_squares_s16_fn)(const int16_t *x, int n);
+
+struct silence_trim {
+	enum AVSampleFormat sample_fmt;
+	int                 channels;
+	int                 window;
+	i64                 min_silence;
+	i64                 keep;
+	double              threshold; /* Mean square, full scale being 1. */
+	sum_squares_flt_fn  sum_squares_flt;
+	sum_squares_s16_fn  sum_squares_s16;
+
+	struct AVAudioFifo *in;    /* Not classified yet. */
+	struct AVAudioFifo *quiet; /* The current silence, while it may still turn out short. */
+	i64                 run;   /* Length of the current silence. */
+	u8                **scratch;
+
+	pcm_fn              emit;
+	void               *opaque;
+};
+
+static double sum_squares_flt_c(const float *x, int n)
+{
+	double s = 0;
+	int i;
+
+	for (i = 0; i < n; ++i)
+		s += x[i] * x[i];
+
+	return s;
+}
+
+static double sum_squares_s16_c(const int16_t *x, int n)
+{
+	int64_t s = 0;
+	int i;
+
+	for (i = 0; i < n; ++i)
+		s += (int32_t)x[i] * x[i];
+
+	return s / (32768.0 * 32768.0);
+}
+
+#ifdef HAVE_X86
+static inline float hsum_sse2(__m128 v)
+{
+	v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+
+	return _mm_cvtss_f32(v);
+}
+
+static inline int64_t hsum_epi64_sse2(__m128i v)
+{
+	int64_t lanes[2];
+
+	_mm_storeu_si128((__m128i *)lanes, v);
+
+	return lanes[0] + lanes[1];
+}
+
+static double sum_squares_flt_sse2(const float *x, int n)
+{
+	__m128 acc = _mm_setzero_ps();
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128 v = _mm_loadu_ps(x + i);
+
+		acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+	}
+
+	return hsum_sse2(acc) + sum_squares_flt_c(x + i, n - i);
+}
+
+/*
+ * madd squares eight samples into four sums of two, at most 2^31 each, so
+ * they are taken as unsigned and widened to 64 bits before adding up.
+ */
+static double sum_squares_s16_sse2(const int16_t *x, int n)
+{
+	__m128i zero = _mm_setzero_si128(), acc = zero;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v  = _mm_loadu_si128((const __m128i *)(x + i));
+		__m128i sq = _mm_madd_epi16(v, v);
+
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+	}
+
+	return hsum_epi64_sse2(acc) / (32768.0 * 32768.0) + sum_squares_s16_c(x + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static double sum_squares_flt_avx2(const float *x, int n)
+{
+	__m256 acc = _mm256_setzero_ps();
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256 v = _mm256_loadu_ps(x + i);
+
+		acc = _mm256_add_ps(acc, _mm256_mul_ps(v, v));
+	}
+
+	return hsum_sse2(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)))
+	     + sum_squares_flt_c(x + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static double sum_squares_s16_avx2(const int16_t *x, int n)
+{
+	__m256i zero = _mm256_setzero_si256(), acc = zero;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i v  = _mm256_loadu_si256((const __m256i *)(x + i));
+		__m256i sq = _mm256_madd_epi16(v, v);
+
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(sq, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(sq, zero));
+	}
+
+	return hsum_epi64_sse2(_mm_add_epi64(_mm256_castsi256_si128(acc),
+	                                     _mm256_extracti128_si256(acc, 1))) / (32768.0 * 32768.0)
+	     + sum_squares_s16_c(x + i, n - i);
+}
+#endif
+
+#ifdef HAVE_NEON
+static double sum_squares_flt_neon(const float *x, int n)
+{
+	float32x4_t acc = vdupq_n_f32(0);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		float32x4_t v = vld1q_f32(x + i);
+
+		acc = vfmaq_f32(acc, v, v);
+	}
+
+	return vaddvq_f32(acc) + sum_squares_flt_c(x + i, n - i);
+}
+
+static double sum_squares_s16_neon(const int16_t *x, int n)
+{
+	int64x2_t acc = vdupq_n_s64(0);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		int16x4_t v = vld1_s16(x + i);
+
+		acc = vpadalq_s32(acc, vmull_s16(v, v));
+	}
+
+	return vaddvq_s64(acc) / (32768.0 * 32768.0) + sum_squares_s16_c(x + i, n - i);
+}
+#endif
+
+/* Picked once, from what the machine running us supports. */
+static void pick_kernels(struct silence_trim *t)
+{
+	t->sum_squares_flt = sum_squares_flt_c;
+	t->sum_squares_s16 = sum_squares_s16_c;
+
+#if defined(HAVE_X86)
+	t->sum_squares_flt = sum_squares_flt_sse2;
+	t->sum_squares_s16 = sum_squares_s16_sse2;
+
+	if (__builtin_cpu_supports("avx2")) {
+		t->sum_squares_flt = sum_squares_flt_avx2;
+		t->sum_squares_s16 = sum_squares_s16_avx2;
+	}
+#elif defined(HAVE_NEON)
+	t->sum_squares_flt = sum_squares_flt_neon;
+	t->sum_squares_s16 = sum_squares_s16_neon;
+#endif
+}
+
+int trim_alloc(struct silence_trim **trim, const struct speechful_trim *settings,
+               enum AVSampleFormat sample_fmt, int channels, int sample_rate,
+               pcm_fn emit, void *opaque)
+{
+	struct silence_trim *t;
+	int ret;
+
+	if (!(t = *trim = av_mallocz(sizeof(struct silence_trim))))
+		return AVERROR(ENOMEM);
+
+	t->sample_fmt  = sample_fmt;
+	t->channels    = channels;
+	t->window      = ms2samples(sample_rate, WINDOW_MS);
+	t->min_silence = ms2samples(sample_rate, settings->min_silence_ms);
+	t->keep        = MIN(ms2samples(sample_rate, settings->keep_ms), t->min_silence);
+	t->threshold   = pow(10, settings->threshold_db / 10);
+	t->emit        = emit;
+	t->opaque      = opaque;
+
+	if (t->window < 1)
+		t->window = 1;
+
+	pick_kernels(t);
+
+	if (!(t->in    = av_audio_fifo_alloc(sample_fmt, channels, t->window * 2))
+	    || !(t->quiet = av_audio_fifo_alloc(sample_fmt, channels, t->min_silence + t->window))) {
+		ret = AVERROR(ENOMEM);
+		goto err_free;
+	}
+
+	if ((ret = av_samples_alloc_array_and_samples(&t->scratch, NULL, channels, t->window,
+	                                              sample_fmt, 0)) < 0)
+		goto err_free;
+
+	return 0;
+
+err_free:
+	trim_free(trim);
+
+	return ret;
+}
+
+void trim_free(struct silence_trim **trim)
+{
+	struct silence_trim *t = *trim;
+
+	if (!t)
+		return;
+
+	if (t->in)
+		av_audio_fifo_free(t->in);
+	if (t->quiet)
+		av_audio_fifo_free(t->quiet);
+	if (t->scratch)
+		av_freep(t->scratch);
+	av_freep(&t->scratch);
+	av_freep(trim);
+}
+
+static double sum_squares_other(const u8 *plane, enum AVSampleFormat packed, int n)
+{
+	double s = 0;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		double x;
+
+		switch (packed) {
+		case AV_SAMPLE_FMT_U8:  x = (((const u8 *)plane)[i] - 128) / 128.0; break;
+		case AV_SAMPLE_FMT_S32: x = ((const int32_t *)plane)[i] / 2147483648.0; break;
+		case AV_SAMPLE_FMT_S64: x = ((const int64_t *)plane)[i] / 9223372036854775808.0; break;
+		case AV_SAMPLE_FMT_DBL: x = ((const double *)plane)[i]; break;
+		default:                x = 0; break;
+		}
+
+		s += x * x;
+	}
+
+	return s;
+}
+
+static bool is_quiet(const struct silence_trim *t, u8 *const *data, int n)
+{
+	enum AVSampleFormat packed = av_get_packed_sample_fmt(t->sample_fmt);
+	bool planar = av_sample_fmt_is_planar(t->sample_fmt);
+	int planes  = planar ? t->channels : 1;
+	int count   = planar ? n : n * t->channels;
+	double s = 0;
+	int p;
+
+	for (p = 0; p < planes; ++p) {
+		if (packed == AV_SAMPLE_FMT_FLT)
+			s += t->sum_squares_flt((const float *)data[p], count);
+		else if (packed == AV_SAMPLE_FMT_S16)
+			s += t->sum_squares_s16((const int16_t *)data[p], count);
+		else
+			s += sum_squares_other(data[p], packed, count);
+	}
+
+	return s / ((double)n * t->channels) < t->threshold;
+}
+
+/* Passes on the first `n` samples of `fifo` a window at a time. */
+static int emit_from(struct silence_trim *t, struct AVAudioFifo *fifo, i64 n)
+{
+	int ret;
+
+	while (n > 0) {
+		int chunk = MIN(n, t->window);
+
+		if ((ret = av_audio_fifo_read(fifo, (void **)t->scratch, chunk)) < 0)
+			return ret;
+
+		if ((ret = t->emit(t->opaque, (const u8 *const *)t->scratch, chunk)) < 0)
+			return ret;
+
+		n -= chunk;
+	}
+
+	return 0;
+}
+
+/*
+ * Classifies the next `n` samples of `in`. A silence is held in `quiet` until
+ * it either ends short, and is passed on whole, or grows past `min_silence`,
+ * and is cut down to its first `keep` samples; what follows it is dropped.
+ */
+static int process_window(struct silence_trim *t, int n)
+{
+	struct stage_clock clock;
+	bool quiet;
+	int ret;
+
+	if ((ret = av_audio_fifo_peek(t->in, (void **)t->scratch, n)) < 0)
+		return ret;
+
+	stats_stage_begin(&clock, STAGE_TRIM);
+	quiet = is_quiet(t, t->scratch, n);
+	stats_stage_end(&clock);
+
+	if (!quiet) {
+		if ((ret = emit_from(t, t->quiet, av_audio_fifo_size(t->quiet))) < 0)
+			return ret;
+
+		t->run = 0;
+
+		return emit_from(t, t->in, n);
+	}
+
+	t->run += n;
+
+	if (t->run <= t->min_silence) {
+		if ((ret = av_audio_fifo_read(t->in, (void **)t->scratch, n)) < 0)
+			return ret;
+		return av_audio_fifo_write(t->quiet, (void **)t->scratch, n) < 0 ? AVERROR(ENOMEM) : 0;
+	}
+
+	if (av_audio_fifo_size(t->quiet)) {
+		i64 held = av_audio_fifo_size(t->quiet);
+		i64 keep = MIN(held, t->keep);
+
+		if ((ret = emit_from(t, t->quiet, keep)) < 0)
+			return ret;
+
+		stats_count(COUNTER_SAMPLES_TRIMMED, held - keep);
+		av_audio_fifo_reset(t->quiet);
+	}
+
+	stats_count(COUNTER_SAMPLES_TRIMMED, n);
+
+	return av_audio_fifo_drain(t->in, n);
+}
+
+int trim_write(struct silence_trim *t, const u8 *const *buf, int samples)
+{
+	int ret;
+
+	if (av_audio_fifo_write(t->in, (void **)buf, samples) < samples)
+		return AVERROR(ENOMEM);
+
+	while (av_audio_fifo_size(t->in) >= t->window)
+		if ((ret = process_window(t, t->window)) < 0)
+			return ret;
+
+	return 0;
+}
+
+int trim_flush(struct silence_trim *t)
+{
+	int ret;
+
+	if (av_audio_fifo_size(t->in) && (ret = process_window(t, av_audio_fifo_size(t->in))) < 0)
+		return ret;
+
+	/* A silence still held at the end was short enough to keep. */
+	if ((ret = emit_from(t, t->quiet, av_audio_fifo_size(t->quiet))) < 0)
+		return ret;
+
+	t->run = 0;
+
+	return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef SPEECHFUL_TRIM_H
+#define SPEECHFUL_TRIM_H
+
+#include <libavutil/samplefmt.h>
+
+#include "pipeline.h"
+#include "speechful.h"
+
+/*
+ * Shortens the long pauses of a stream of decoded samples, see `struct
+ * speechful_trim`. Silence is held back until it is known to be short
+ * enough to keep whole, so output lags input by up to `min_silence_ms`.
+ */
+struct silence_trim;
+
+int  trim_alloc(struct silence_trim **trim, const struct speechful_trim *settings,
+                enum AVSampleFormat sample_fmt, int channels, int sample_rate,
+                pcm_fn emit, void *opaque);
+void trim_free(struct silence_trim **trim);
+
+int  trim_write(struct silence_trim *trim, const u8 *const *buf, int samples);
+/* Emits whatever is held back, as if the stream ended here. */
+int  trim_flush(struct silence_trim *trim);
+
+#endif